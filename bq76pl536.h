@@ -84,6 +84,7 @@
 #define FC_ADCT6	0x40 /*		  ADC time 6us			 	*/
 #define FC_ADCT12	0x80 /*		  ADC time 12us				*/
 #define FC_ADCT24	0xC0 /*		  ADC time 24us				*/
+#define FC_ADCT_MASK	0xC0 /*		  All the ADC time bits			*/
 #define FC_GPAI_REF	0x20 /*		  GPAI ref	0=internal ADC 1=VREG50	*/
 #define FC_GPAI_SRC	0x10 /*		  GPAI source	0=pins	 1=brick	*/
 #define FC_CN1		0x08 /*		  Cell count 1	0=6  1=5  2=4  3=3	*/
@@ -0,0 +1,3926 @@
+/*
+  bq76pl536_drv.c
+
+  Copyright Tom Messick, 2012
+  Copyright Scott Ellis, 2010
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+  Driver for the Texas Instruments bq76pl536 battery monitor IC.
+  This version has only been tested on a Beaglebone board.
+
+  Creates device /dev/bq76pl536.c
+  Each read from the device gets data in the following format:
+  All data is 8 bits.
+  Voltage count       How many voltage measurements to follow
+  Voltage 1           Range 0-255 - 0.02 volts/unit - 0-5.10 volts
+  Voltage 2
+     .
+     .
+     .
+  Voltage n
+  Chip count          How many Groups of chip paramters to follow
+  Each chip returns
+    Cell count        Cells connected to this chip
+    Temperature 1     Signed degrees Celsius
+    Temperature 2
+    Status            Chip status
+    Fault             Fault register
+    Alert             Alert register
+    Undervoltage      Undervoltage register
+    Overvoltage       Overvoltage register
+  CRC                 CRC-8, poly = x^8 + x^2 + x^1 + x^0, init = 0
+                      CRC source available at flac.sourceforge.net
+                      or google for "0x00, 0x07, 0x0E, 0x09"
+
+  A scan reads each chip with two block reads, all in one SPI message.
+  The SPI buffers and records are sized for the chain found when the
+  driver loads, up to 32 chips with 192 cells.
+
+  When scan_interval_ms is set the driver scans the pack on its own.
+  A read then returns the most recent scan instead of starting a new one.
+
+  Periodic scans run from the system workqueue. With rt_priority set
+  they run on their own SCHED_FIFO thread at that priority instead,
+  pinned to rt_cpu when it is not -1, which sleeps on absolute hrtimer
+  deadlines so a loaded system does not move the samples around. How
+  late each scan started is in the scan_late_us histogram in debugfs
+  and scans that ran past the next deadline are counted in overruns in
+  the sysfs directory.
+
+  Delta mode
+
+  Files opened while delta_mode is set keep reading instead of getting
+  one record per open. The first record, and then one every
+  keyframe_interval scans, is a full record as above. The rest are
+  delta records that only carry what changed since the reader was last
+  told about it. A cell is included when it moved more than its deadband
+  (cell_deadband[cell] or deadband_mv millivolts), a chip when any
+  status register changed or a temperature moved more than
+  temp_deadband degrees.
+  Delta marker        0xFF, a full record never starts with 255
+  Changed cells       How many cell pairs follow
+    Cell number       0..Voltage count-1
+    Voltage           Same units as a full record
+  Changed chips       How many chip groups follow
+    Chip number       1..Chip count
+    7 bytes           Temperature 1 .. Overvoltage as in a full record
+  CRC                 Same as a full record
+  With scan_interval_ms set a delta reader only wakes up when there is
+  something to report, so an idle pack costs nothing. Without it each
+  read scans the pack and may return a delta record with no changes.
+
+  Oversampling
+
+  With oversample set to more than 1 the ADC is left on and switched to
+  its fastest conversion time, every scan runs that many conversions
+  back to back and the cells and temperatures are filtered in the
+  driver. filter 0 averages the conversions of one scan, filter 1 is a
+  running IIR filter with a gain of 1/2^iir_shift per conversion.
+
+  sample_bits sets the resolution of the voltages. 8 gives the records
+  above. 9 to 16 gives extended records where each voltage is 16 bits,
+  most significant byte first, in units of 5.12 volts / 2^Resolution.
+  Extended record    0xFE
+  Resolution         sample_bits
+  Voltage count ...  As a full record with 16 bit voltages
+  Extended delta     0xFD
+  Resolution         sample_bits
+  Changed cells ...  As a delta record with 16 bit voltages
+
+  Adaptive scan rate
+
+  With adaptive set the periodic scan (scan_interval_ms) speeds up to
+  fast_interval_ms while the pack is active: a cell moved more than
+  activity_mv since the last scan, a chip reports a fault or alert, or
+  the current sensor on the GPAI input of gpai_chip reads more than
+  gpai_threshold_mv away from gpai_zero_mv. After idle_scans quiet
+  scans it slows down to idle_interval_ms and the chips are put to
+  sleep between scans. The current state and the time spent in each
+  state are in /sys/class/bq76pl536/bq76pl536.
+
+  Power management
+
+  The driver uses runtime PM with autosuspend. autosuspend_ms after the
+  last bus access the chips are put to sleep with the ADC off and the
+  SPI controller is free to power down. Periodic scans wake the chain
+  early by the worst wake latency seen so the conversion still starts
+  on time. The latency is in wake_latency_us and wake_latency_max_us.
+
+  Tracing
+
+  The scan path has tracepoints in the bq76pl536 trace system, see
+  bq76pl536_trace.h. /sys/kernel/debug/bq76pl536 has histograms of
+  the scan time, the DRDY wait, each SPI message and the time readers
+  wait for a record. Write to a histogram file to clear it.
+
+  Link health
+
+  The driver counts scans, SPI messages, transfers, bytes, CRC errors,
+  SPI errors, DRDY timeouts, read retries, chips that lost their
+  address and fault/alert events. link_stats in the sysfs directory
+  has the totals and link_stats in debugfs has them for each chip.
+  Chip 0 is broadcast and discovery traffic. Each file is a consistent
+  copy of all the counters.
+
+  Every conversion has a budget of SPI traffic: the ADC_CONVERT write,
+  the status reads it took to see DRDY and one message with two block
+  reads per chip. A conversion without CRC retries that takes more messages,
+  transfers or bytes than that is counted in over_budget and warned
+  about once, so a change that adds bus traffic to the scan path shows
+  up on the first scan.
+
+  Link diagnostics
+
+  Writing to link_diag in the sysfs directory tests every link of the
+  chain, reading it shows the result. Each chip is read diag_reads
+  times at each speed in diag_speed_hz, half, one and four times
+  spi_speed_hz by default, without retries. A read of chip n crosses
+  every link below it, so the link into the first chip to show errors,
+  or more errors than the chip below it, is the bad one. Chips the
+  search did not find are reported as a break. The scans wait while it
+  runs, a second or two for 32 chips at the default speeds, and the
+  protection settings are checked afterwards.
+
+  Protection settings
+
+  The Group3 protection registers (over and undervoltage, over
+  temperature and their delays) can be changed while the driver runs
+  with the BQ_IOC_SET_CONFIG ioctl, see bq76pl536_user.h. They are
+  written to every chip in one message, read back from every chip in
+  one message and checked along with the PRESULT parity registers.
+  config in the sysfs directory shows them and whether the last check
+  passed. A failed check at probe does not stop the driver loading,
+  so the settings can still be fixed with the ioctl.
+
+  A chip that power on resets loses its address and goes back to its
+  EPROM settings. When a scan fails or shows a chip without an address
+  and a chip does not answer at its address, the chain is searched
+  again, everything probe wrote is written again and the settings are
+  applied. chain_resets in link_stats counts these.
+
+  Register access
+
+  Service tools can read and write any register of any chip without
+  unloading the driver with the BQ_IOC_REGS ioctl. The operations run
+  as one SPI message, in between scans, see bq76pl536_user.h.
+
+  Targeted queries
+
+  A balancer or fault handler that needs a few chips right now uses the
+  BQ_IOC_QUERY ioctl instead of reading the device. It converts and
+  reads only the chips and cells asked for: one message with an
+  ADC_CONVERT write per chip, the DRDY polls and one message with a
+  block read per chip. Queries do not take the file lock and go ahead
+  of the periodic scan, which hands over the bus between oversampled
+  conversions when a query is waiting. The time from the call to the
+  data is in the query_us histogram in debugfs.
+
+  Conversion timing
+
+  Every scan is stamped with the time its conversion started and the
+  time DRDY was seen, on CLOCK_MONOTONIC so it lines up with a current
+  sensor read by another driver. The start time comes with the window
+  the start is known to within, the SPI message of the broadcast write
+  or the GPIO write with conv_gpio. The stamps are in the netlink
+  samples and the BQ_IOC_TIMING ioctl returns them for the record a
+  reader last read. convert_skew_ns in the sysfs directory has the last
+  and the largest window.
+
+  conv_gpio is a GPIO wired to the CONV input of the bottom chip, or of
+  the bottom chip of several chains and the trigger of the current
+  sensor. A pulse on it starts every chip on the same edge instead of
+  the broadcast write, so the whole pack is one snapshot in time.
+
+  Every completed scan and every fault or alert is also multicast on the
+  "bq76pl536" generic netlink family. See bq76pl536_user.h. This lets
+  any number of programs watch the pack without touching the SPI bus.
+*/
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/device.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/cdev.h>
+#include <linux/spi/spi.h>
+#include <linux/string.h>
+#include <linux/crc8.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+#include <linux/pm_runtime.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/seqlock.h>
+#include <linux/preempt.h>
+#include <linux/gpio.h>
+#include <linux/delay.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <net/genetlink.h>
+#include <asm/uaccess.h>
+#include "bq76pl536.h"
+#include "bq76pl536_proto.h"
+#include "bq76pl536_user.h"
+
+#define CREATE_TRACE_POINTS
+#include "bq76pl536_trace.h"
+
+/* Enough for the messages used outside a scan. The buffers grow by
+   BQ_SCAN_BYTES and BQ_SCAN_PACKETS for every chip found.
+*/
+#define SPI_BUFF_SIZE	50
+
+#define SPI_BUS 2
+#define SPI_BUS_CS1 0
+#define SPI_BUS_SPEED 100000
+#define MAX_BQ_DEVICES 32
+#define MAX_XFER 16
+#define CRC_TABLE_SIZE 256
+#define CELL_MISSING_THRESHOLD 1000
+#define MAX_CELLS_PER_DEVICE 6
+#define MAX_CELLS (MAX_BQ_DEVICES * MAX_CELLS_PER_DEVICE)
+#define MAX_OVERSAMPLE 256
+#define FILTER_FRAC 8
+#define WAKE_DELAY_US 1000
+#define HIST_BUCKETS 21
+
+/* Status reads before a conversion is given up on */
+#define DRDY_POLLS 7
+#define CONV_PULSE_US 5
+
+/* The most SPI traffic one conversion that took polls status reads
+   may take, see the top of this file. A status read is 3 header
+   bytes, 1 data byte and the CRC.
+*/
+#define SCAN_MESSAGES(polls)		(1 + (polls) + 1)
+#define SCAN_TRANSFERS(chips, polls)	\
+	(1 + (polls) + BQ_SCAN_PACKETS(chips))
+#define SCAN_BYTES(chips, polls)	\
+	(4 + (polls) * 5 + BQ_SCAN_BYTES(chips))
+
+typedef struct cell
+{
+	int chip;
+	int index;
+} cell_t;
+
+cell_t *cells = 0;
+int total_cell_count;
+
+static void bq_prepare_spi_message(void);
+
+static int cells_per_device[MAX_BQ_DEVICES+1] =
+{
+	/* The first element in this array is not used. The chain of
+	   devices is numbered starting with 1. Adding an extra
+	   element here gets rid of +1 and -i in the code.
+	 */
+	0,
+	4, 4, 4, 3, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0
+};
+
+/* Configure the pack when loading the driver. The driver looks at what is
+   attached so this is not critical
+*/
+static int devices_used = 4;
+
+module_param_array(cells_per_device, int, &devices_used, S_IRUGO);
+
+/* Scan the pack every scan_interval_ms milliseconds and publish the
+   result. 0 means only scan when somebody reads the device.
+*/
+static int scan_interval_ms = 0;
+
+module_param(scan_interval_ms, int, S_IRUGO);
+
+/* Real time periodic scans, see the top of this file */
+static int rt_priority = 0;
+static int rt_cpu = -1;
+
+module_param(rt_priority, int, S_IRUGO);
+module_param(rt_cpu, int, S_IRUGO);
+
+/* Delta mode, see the top of this file. Deadbands can be changed at any
+   time through /sys/module/bq76pl536/parameters.
+*/
+static bool delta_mode = 0;
+static int keyframe_interval = 100;
+static int deadband_mv = 20;
+static int temp_deadband = 0;
+static int cell_deadband[MAX_CELLS];
+static int cell_deadband_count = 0;
+
+module_param(delta_mode, bool, S_IRUGO | S_IWUSR);
+module_param(keyframe_interval, int, S_IRUGO | S_IWUSR);
+module_param(deadband_mv, int, S_IRUGO | S_IWUSR);
+module_param(temp_deadband, int, S_IRUGO | S_IWUSR);
+module_param_array(cell_deadband, int, &cell_deadband_count,
+		   S_IRUGO | S_IWUSR);
+
+/* Oversampling, see the top of this file */
+static int oversample = 1;
+static int filter = 0;
+static int iir_shift = 3;
+static int sample_bits = 8;
+
+module_param(oversample, int, S_IRUGO);
+module_param(filter, int, S_IRUGO | S_IWUSR);
+module_param(iir_shift, int, S_IRUGO | S_IWUSR);
+module_param(sample_bits, int, S_IRUGO | S_IWUSR);
+
+/* Adaptive scan rate, see the top of this file */
+static bool adaptive = 0;
+static int fast_interval_ms = 100;
+static int idle_interval_ms = 10000;
+static int idle_scans = 10;
+static int activity_mv = 10;
+static int gpai_chip = 0;
+static int gpai_zero_mv = 1250;
+static int gpai_threshold_mv = 50;
+
+module_param(adaptive, bool, S_IRUGO | S_IWUSR);
+module_param(fast_interval_ms, int, S_IRUGO | S_IWUSR);
+module_param(idle_interval_ms, int, S_IRUGO | S_IWUSR);
+module_param(idle_scans, int, S_IRUGO | S_IWUSR);
+module_param(activity_mv, int, S_IRUGO | S_IWUSR);
+module_param(gpai_chip, int, S_IRUGO);
+module_param(gpai_zero_mv, int, S_IRUGO | S_IWUSR);
+module_param(gpai_threshold_mv, int, S_IRUGO | S_IWUSR);
+
+enum bq_rate {
+	RATE_FAST,
+	RATE_NORMAL,
+	RATE_IDLE,
+	RATE_COUNT
+};
+
+static const char *bq_rate_names[RATE_COUNT] = { "fast", "normal", "idle" };
+
+/* Power management, see the top of this file */
+static int autosuspend_ms = 100;
+
+module_param(autosuspend_ms, int, S_IRUGO);
+
+/* Conversion start, see the top of this file. -1 uses the broadcast
+   ADC_CONVERT write.
+*/
+static int conv_gpio = -1;
+
+module_param(conv_gpio, int, S_IRUGO);
+
+/* Where the chain is. bq76pl536_sim.ko can stand in for it on any bus */
+static int spi_bus = SPI_BUS;
+static int spi_speed_hz = SPI_BUS_SPEED;
+
+module_param(spi_bus, int, S_IRUGO);
+module_param(spi_speed_hz, int, S_IRUGO);
+
+/* How many times to run a read again after a CRC error */
+static int read_retries = 1;
+
+module_param(read_retries, int, S_IRUGO | S_IWUSR);
+
+/* Link diagnostics, see the top of this file. No speeds means the
+   defaults.
+*/
+#define DIAG_SPEEDS 4
+static int diag_reads = 32;
+static int diag_speed_hz[DIAG_SPEEDS];
+static int diag_speeds = 0;
+
+module_param(diag_reads, int, S_IRUGO | S_IWUSR);
+module_param_array(diag_speed_hz, int, &diag_speeds, S_IRUGO | S_IWUSR);
+
+const char this_driver_name[] = "bq76pl536";
+
+/* The protocol core queues packets, they go out as spi_transfers */
+struct bq_control {
+	struct spi_message msg;
+	struct spi_transfer *xfer;	/* One for each packet		*/
+	struct bq_packet *packet;
+	u8 *tx_buff;
+	u8 *rx_buff;
+	struct bq_proto proto;
+	u32 speed_hz;			/* 0 for the device speed	*/
+};
+
+static struct bq_control bq_ctl;
+
+/* One scan of the pack as it came from the chips */
+struct bq_chip_sample {
+	u8 cells;
+	u16 temperature[2];	/* Raw ADC counts */
+	u8 status;
+	u8 fault;
+	u8 alert;
+	u8 cuv;
+	u8 cov;
+};
+
+struct bq_sample {
+	int cell_count;
+	u32 cell[MAX_CELLS];	/* Microvolts */
+	int gpai_mv;		/* GPAI input of gpai_chip */
+	int chip_count;
+	struct bq_chip_sample chip[MAX_BQ_DEVICES+1];
+	ktime_t convert_time;	/* Conversion started, within skew */
+	u32 convert_skew_ns;
+	ktime_t drdy_time;	/* Conversion seen done */
+};
+
+/*
+  Oversampling filter state. Each kind of channel has its own array so
+  the filter loops walk memory in order. Boxcar sums are plain, IIR
+  values are shifted left by FILTER_FRAC.
+*/
+struct bq_filter {
+	int mode;				/* filter of the last scan */
+	int count;				/* Conversions this scan */
+	bool primed;				/* IIR has a start value */
+	u32 cell[MAX_CELLS];			/* Microvolts */
+	u32 temperature[2][MAX_BQ_DEVICES+1];	/* Raw ADC counts */
+};
+
+/* Per open file state */
+struct bq_file {
+	u32 seq;		/* Last scan this reader has seen */
+	bool delta;		/* Reader gets delta records */
+	bool have_ref;		/* ref is valid */
+	u32 keyframe_seq;	/* Scan of the last full record */
+	struct bq_timing timing;	/* Of the last record read */
+	struct bq_sample ref;	/* What this reader has been told */
+};
+
+/*
+  Latency histogram. Bucket n counts times from 2^(n-1) up to 2^n
+  microseconds, the last bucket counts everything longer.
+*/
+struct bq_hist {
+	spinlock_t lock;
+	u32 bucket[HIST_BUCKETS];
+	u64 count;
+	u64 total_us;
+	u64 max_us;
+};
+
+/* Counters kept for every chip and for the whole chain */
+struct bq_link_counters {
+	u64 transfers;
+	u64 bytes;
+	u64 crc_errors;
+	u64 spi_errors;
+	u64 retries;
+	u64 address_lost;
+	u64 faults;
+	u64 alerts;
+};
+
+/*
+  Link health. Writers hold spi_sem and run with preemption off, so a
+  reader never spins on a writer that was scheduled out mid-update.
+  Readers use the seqcount to copy all of it without stopping the bus.
+*/
+struct bq_stats {
+	seqcount_t seq;
+	u64 scans;
+	u64 messages;
+	u64 drdy_timeouts;
+	u64 over_budget;
+	u64 chain_resets;	/* Searched again after a reset	*/
+	struct bq_link_counters total;
+	struct bq_link_counters chip[MAX_BQ_DEVICES+1];
+};
+
+/* How one chip did at one speed in the link diagnostics */
+struct bq_diag_result {
+	u32 reads;
+	u32 crc_errors;
+	u32 bad_values;
+	u32 spi_errors;
+	u32 us;			/* For all the reads */
+};
+
+struct bq_diag {
+	int status;		/* -ENODATA before the first run */
+	int speeds;
+	u32 speed_hz[DIAG_SPEEDS];
+	int chips;		/* Found by the search */
+	int expected;		/* Configured */
+	int config;		/* bq_verify_config() afterwards */
+	struct bq_diag_result chip[DIAG_SPEEDS][MAX_BQ_DEVICES+1];
+};
+
+struct bq_dev {
+	struct semaphore spi_sem;
+	struct semaphore fop_sem;
+	dev_t devt;
+	struct cdev cdev;
+	struct class *class;
+	struct spi_device *spi_device;
+	char *user_buff;
+	u8 test_data;
+
+	/* Scanning, protected by spi_sem */
+	struct delayed_work scan_work;
+	struct task_struct *scan_thread;	/* With rt_priority */
+	u64 overruns;
+	struct bq_sample scan;
+	struct bq_filter filter;
+	u8 *scan_buff;
+
+	/* Longest record for the chain that was found, the size of
+	   scan_buff and user_buff
+	*/
+	int record_size;
+
+	/* The most recent scan, protected by sample_sem */
+	struct semaphore sample_sem;
+	wait_queue_head_t sample_wait;
+	struct bq_sample sample;
+	u32 sample_seq;
+
+	/* Adaptive scan rate. active and asleep are protected by spi_sem,
+	   the rest by rate_lock
+	*/
+	bool active;
+	bool asleep;
+	int quiet_scans;
+	spinlock_t rate_lock;
+	enum bq_rate rate;
+	unsigned long rate_since;
+	u64 rate_time[RATE_COUNT];	/* jiffies */
+
+	/* Runtime PM, protected by spi_sem */
+	ktime_t next_scan;
+	s64 wake_latency_us;
+	s64 wake_latency_max_us;
+
+	/* Conversion start window, protected by spi_sem */
+	u32 convert_skew_ns;
+	u32 convert_skew_max_ns;
+
+	/* Where the time goes */
+	struct dentry *debugfs;
+	struct bq_hist scan_hist;
+	struct bq_hist drdy_hist;
+	struct bq_hist xfer_hist;
+	struct bq_hist read_hist;
+	struct bq_hist query_hist;
+	struct bq_hist late_hist;
+
+	/* Queries waiting for the bus */
+	atomic_t queries;
+
+	struct bq_stats stats;
+
+	/* Group3 protection registers, protected by spi_sem. verified
+	   is 0 when the last check passed and an errno when it did not,
+	   -ESTALE after BQ_IOC_REGS wrote a Group3 register.
+	*/
+	struct bq_config config;
+	int config_verified;
+
+	/* Last link diagnostics, protected by spi_sem */
+	int devices_expected;
+	struct bq_diag diag;
+
+	struct device *device;
+
+	/* DEVICE_STATUS, FAULT_STATUS, ALERT_STATUS from the last scan.
+	   Used to only send netlink events when something changes.
+	*/
+	u8 chip_state[MAX_BQ_DEVICES+1][3];
+};
+
+static struct bq_dev bq_dev;
+
+static u8 *crc8_table = 0;
+
+static struct genl_family bq_nl_family = {
+	.id = GENL_ID_GENERATE,
+	.hdrsize = 0,
+	.name = BQ_NL_FAMILY_NAME,
+	.version = BQ_NL_VERSION,
+	.maxattr = BQ_NL_A_MAX,
+};
+
+static struct genl_multicast_group bq_nl_samples = {
+	.name = BQ_NL_GROUP_SAMPLES,
+};
+
+static struct genl_multicast_group bq_nl_events = {
+	.name = BQ_NL_GROUP_EVENTS,
+};
+
+/*
+  Multicast a completed scan. The message is not even built when
+  nobody is listening.
+*/
+static void bq_nl_send_sample(const u8 *record, int len, u32 seq,
+			      const struct bq_sample *sample)
+{
+	struct sk_buff *skb;
+	void *hdr;
+
+	if (!netlink_has_listeners(init_net.genl_sock, bq_nl_samples.id))
+		return;
+
+	skb = genlmsg_new(2 * nla_total_size(sizeof(u32)) +
+			  2 * nla_total_size(sizeof(u64)) +
+			  nla_total_size(len), GFP_KERNEL);
+	if (!skb)
+		return;
+
+	hdr = genlmsg_put(skb, 0, 0, &bq_nl_family, 0, BQ_NL_CMD_SAMPLE);
+	if (!hdr)
+		goto nla_put_failure;
+
+	if (nla_put_u32(skb, BQ_NL_A_SEQ, seq) ||
+	    nla_put(skb, BQ_NL_A_RECORD, len, record) ||
+	    nla_put_u64(skb, BQ_NL_A_CONVERT_NS,
+			ktime_to_ns(sample->convert_time)) ||
+	    nla_put_u64(skb, BQ_NL_A_DRDY_NS,
+			ktime_to_ns(sample->drdy_time)) ||
+	    nla_put_u32(skb, BQ_NL_A_SKEW_NS, sample->convert_skew_ns))
+		goto nla_put_failure;
+
+	genlmsg_end(skb, hdr);
+	genlmsg_multicast(skb, 0, bq_nl_samples.id, GFP_KERNEL);
+	return;
+
+ nla_put_failure:
+	nlmsg_free(skb);
+}
+
+static void bq_nl_send_event(u8 chip, u8 status, u8 fault, u8 alert)
+{
+	struct sk_buff *skb;
+	void *hdr;
+
+	if (!netlink_has_listeners(init_net.genl_sock, bq_nl_events.id))
+		return;
+
+	skb = genlmsg_new(4 * nla_total_size(sizeof(u8)), GFP_KERNEL);
+	if (!skb)
+		return;
+
+	hdr = genlmsg_put(skb, 0, 0, &bq_nl_family, 0, BQ_NL_CMD_EVENT);
+	if (!hdr)
+		goto nla_put_failure;
+
+	if (nla_put_u8(skb, BQ_NL_A_CHIP, chip) ||
+	    nla_put_u8(skb, BQ_NL_A_STATUS, status) ||
+	    nla_put_u8(skb, BQ_NL_A_FAULT, fault) ||
+	    nla_put_u8(skb, BQ_NL_A_ALERT, alert))
+		goto nla_put_failure;
+
+	genlmsg_end(skb, hdr);
+	genlmsg_multicast(skb, 0, bq_nl_events.id, GFP_KERNEL);
+	return;
+
+ nla_put_failure:
+	nlmsg_free(skb);
+}
+
+static int __init bq_nl_init(void)
+{
+	int error;
+
+	error = genl_register_family(&bq_nl_family);
+	if (error)
+		return error;
+
+	error = genl_register_mc_group(&bq_nl_family, &bq_nl_samples);
+	if (error)
+		goto bq_nl_error;
+
+	error = genl_register_mc_group(&bq_nl_family, &bq_nl_events);
+	if (error)
+		goto bq_nl_error;
+
+	return 0;
+
+ bq_nl_error:
+	/* Unregistering the family also drops its groups */
+	genl_unregister_family(&bq_nl_family);
+	return error;
+}
+
+/* Counters for the chip a packet is addressed to */
+static struct bq_link_counters *bq_counters(u8 address)
+{
+	if (address > MAX_BQ_DEVICES)
+		address = 0;
+	return &bq_dev.stats.chip[address];
+}
+
+static void bq_stats_begin(void)
+{
+	preempt_disable();
+	write_seqcount_begin(&bq_dev.stats.seq);
+}
+
+static void bq_stats_end(void)
+{
+	write_seqcount_end(&bq_dev.stats.seq);
+	preempt_enable();
+}
+
+/* Count one event for a chip and the total. Called with spi_sem held */
+#define bq_count(address, field)				\
+	do {							\
+		bq_stats_begin();				\
+		bq_counters(address)->field++;			\
+		bq_dev.stats.total.field++;			\
+		bq_stats_end();					\
+	} while (0)
+
+/* Copy all the counters in one go */
+static void bq_stats_copy(struct bq_stats *copy)
+{
+	unsigned seq;
+
+	do {
+		seq = read_seqcount_begin(&bq_dev.stats.seq);
+		memcpy(copy, &bq_dev.stats, sizeof(*copy));
+	} while (read_seqcount_retry(&bq_dev.stats.seq, seq));
+}
+
+static int bq_format_counters(char *buf, size_t size, const char *name,
+			      const struct bq_link_counters *c)
+{
+	return scnprintf(buf, size, "%s%llu %llu %llu %llu %llu %llu %llu %llu\n",
+			 name, c->transfers, c->bytes, c->crc_errors,
+			 c->spi_errors, c->retries, c->address_lost,
+			 c->faults, c->alerts);
+}
+
+static void bq_hist_add(struct bq_hist *hist, s64 us)
+{
+	int bucket = 0;
+
+	if (us < 0)
+		us = 0;
+	if (us > 0)
+		bucket = min(fls64(us), HIST_BUCKETS - 1);
+
+	spin_lock(&hist->lock);
+	hist->bucket[bucket]++;
+	hist->count++;
+	hist->total_us += us;
+	if (us > hist->max_us)
+		hist->max_us = us;
+	spin_unlock(&hist->lock);
+}
+
+static int bq_hist_show(struct seq_file *m, void *v)
+{
+	struct bq_hist *hist = m->private;
+	struct bq_hist copy;
+	int i;
+
+	spin_lock(&hist->lock);
+	copy = *hist;
+	spin_unlock(&hist->lock);
+
+	seq_printf(m, "count %llu\n", copy.count);
+	seq_printf(m, "average_us %llu\n",
+		   copy.count ? div64_u64(copy.total_us, copy.count) : 0);
+	seq_printf(m, "max_us %llu\n", copy.max_us);
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+	{
+		if (i == HIST_BUCKETS - 1)
+			seq_printf(m, "%8u+        %u\n",
+				   1 << (i - 1), copy.bucket[i]);
+		else
+			seq_printf(m, "%8u-%-8u %u\n",
+				   i ? 1 << (i - 1) : 0, 1 << i,
+				   copy.bucket[i]);
+	}
+	return 0;
+}
+
+static int bq_hist_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, bq_hist_show, inode->i_private);
+}
+
+/* Any write clears the histogram */
+static ssize_t bq_hist_write(struct file *file, const char __user *buff,
+			     size_t count, loff_t *offp)
+{
+	struct bq_hist *hist = ((struct seq_file *)file->private_data)->private;
+
+	spin_lock(&hist->lock);
+	memset(hist->bucket, 0, sizeof(hist->bucket));
+	hist->count = 0;
+	hist->total_us = 0;
+	hist->max_us = 0;
+	spin_unlock(&hist->lock);
+
+	return count;
+}
+
+static const struct file_operations bq_hist_fops = {
+	.owner =	THIS_MODULE,
+	.open =		bq_hist_open,
+	.read =		seq_read,
+	.write =	bq_hist_write,
+	.llseek =	seq_lseek,
+	.release =	single_release,
+};
+
+/* Totals and every chip, one line each */
+static int bq_link_stats_show(struct seq_file *m, void *v)
+{
+	struct bq_stats *copy;
+	char line[128];
+	char name[8];
+	int i;
+
+	copy = kmalloc(sizeof(*copy), GFP_KERNEL);
+	if (!copy)
+		return -ENOMEM;
+	bq_stats_copy(copy);
+
+	seq_printf(m, "scans %llu messages %llu drdy_timeouts %llu "
+		   "over_budget %llu chain_resets %llu\n", copy->scans,
+		   copy->messages, copy->drdy_timeouts, copy->over_budget,
+		   copy->chain_resets);
+	seq_puts(m, "chip  transfers bytes crc_errors spi_errors retries "
+		 "address_lost faults alerts\n");
+	bq_format_counters(line, sizeof(line), "total ", &copy->total);
+	seq_puts(m, line);
+	for (i = 0; i < MAX_BQ_DEVICES + 1; i++)
+	{
+		if (i > devices_used && !copy->chip[i].transfers)
+			continue;
+		snprintf(name, sizeof(name), "%-5d ", i);
+		bq_format_counters(line, sizeof(line), name, &copy->chip[i]);
+		seq_puts(m, line);
+	}
+
+	kfree(copy);
+	return 0;
+}
+
+static int bq_link_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, bq_link_stats_show, NULL);
+}
+
+static const struct file_operations bq_link_stats_fops = {
+	.owner =	THIS_MODULE,
+	.open =		bq_link_stats_open,
+	.read =		seq_read,
+	.llseek =	seq_lseek,
+	.release =	single_release,
+};
+
+static void __init bq_debugfs_init(void)
+{
+	spin_lock_init(&bq_dev.scan_hist.lock);
+	spin_lock_init(&bq_dev.drdy_hist.lock);
+	spin_lock_init(&bq_dev.xfer_hist.lock);
+	spin_lock_init(&bq_dev.read_hist.lock);
+	spin_lock_init(&bq_dev.query_hist.lock);
+	spin_lock_init(&bq_dev.late_hist.lock);
+	seqcount_init(&bq_dev.stats.seq);
+
+	/* Not having debugfs is not an error */
+	bq_dev.debugfs = debugfs_create_dir(this_driver_name, NULL);
+	if (IS_ERR_OR_NULL(bq_dev.debugfs))
+	{
+		bq_dev.debugfs = NULL;
+		return;
+	}
+
+	debugfs_create_file("scan_us", S_IRUGO | S_IWUSR, bq_dev.debugfs,
+			    &bq_dev.scan_hist, &bq_hist_fops);
+	debugfs_create_file("drdy_wait_us", S_IRUGO | S_IWUSR, bq_dev.debugfs,
+			    &bq_dev.drdy_hist, &bq_hist_fops);
+	debugfs_create_file("spi_sync_us", S_IRUGO | S_IWUSR, bq_dev.debugfs,
+			    &bq_dev.xfer_hist, &bq_hist_fops);
+	debugfs_create_file("read_wait_us", S_IRUGO | S_IWUSR, bq_dev.debugfs,
+			    &bq_dev.read_hist, &bq_hist_fops);
+	debugfs_create_file("query_us", S_IRUGO | S_IWUSR, bq_dev.debugfs,
+			    &bq_dev.query_hist, &bq_hist_fops);
+	debugfs_create_file("scan_late_us", S_IRUGO | S_IWUSR, bq_dev.debugfs,
+			    &bq_dev.late_hist, &bq_hist_fops);
+	debugfs_create_file("link_stats", S_IRUGO, bq_dev.debugfs,
+			    NULL, &bq_link_stats_fops);
+}
+
+/* Send packets for the protocol core. Every message goes through here
+   so it can be traced, timed and counted.
+*/
+static int bq_spi_transfer(struct bq_proto *proto, int first, int count)
+{
+	struct spi_transfer *xfer;
+	struct bq_link_counters *c;
+	ktime_t start;
+	s64 us;
+	int status;
+	int xfers = 0;
+	int bytes = 0;
+	int i;
+
+	spi_message_init(&bq_ctl.msg);
+	for (i = first; i < first + count; i++)
+	{
+		xfer = &bq_ctl.xfer[i];
+		xfer->cs_change = 1;
+		xfer->tx_buf = proto->packet[i].tx;
+		xfer->rx_buf = proto->packet[i].rx;
+		xfer->len = proto->packet[i].len;
+		xfer->speed_hz = bq_ctl.speed_hz;
+		spi_message_add_tail(xfer, &bq_ctl.msg);
+		xfers++;
+		bytes += xfer->len;
+	}
+
+	trace_bq_spi_sync(xfers, bytes);
+	start = ktime_get();
+	status = spi_sync(bq_dev.spi_device, &bq_ctl.msg);
+	us = ktime_us_delta(ktime_get(), start);
+	trace_bq_spi_sync_done(status, us);
+	bq_hist_add(&bq_dev.xfer_hist, us);
+
+	/* The chip address is in the first byte of every packet */
+	bq_stats_begin();
+	bq_dev.stats.messages++;
+	bq_dev.stats.total.transfers += xfers;
+	bq_dev.stats.total.bytes += bytes;
+	if (status)
+		bq_dev.stats.total.spi_errors++;
+	list_for_each_entry(xfer, &bq_ctl.msg.transfers, transfer_list)
+	{
+		c = bq_counters(((const u8 *)xfer->tx_buf)[0] >> 1);
+		c->transfers++;
+		c->bytes += xfer->len;
+		if (status)
+			c->spi_errors++;
+	}
+	bq_stats_end();
+
+	return status;
+}
+
+/* Run what the protocol core has queued since the last run */
+static int bq_spi_sync(void)
+{
+	return bq_proto_run(&bq_ctl.proto);
+}
+
+/* Trace and count CRC errors, tell the core whether to retry */
+static bool bq_crc_error(struct bq_proto *proto,
+			 const struct bq_packet *packet, u8 crc, int tries)
+{
+	u8 address = packet->tx[0] >> 1;
+
+	trace_bq_crc_check(address, packet->tx[1], crc,
+			   packet->rx[packet->len - 1]);
+	bq_count(address, crc_errors);
+	if (tries >= read_retries)
+	{
+		dev_alert(&bq_dev.spi_device->dev,
+			  "CRC error %x != %x\n", crc,
+			  packet->rx[packet->len - 1]);
+		return false;
+	}
+
+	bq_count(address, retries);
+	return true;
+}
+
+static const struct bq_proto_ops bq_proto_ops = {
+	.transfer = bq_spi_transfer,
+	.crc_error = bq_crc_error,
+};
+
+/* The link diagnostics count CRC errors themselves and never retry */
+static const struct bq_proto_ops bq_diag_ops = {
+	.transfer = bq_spi_transfer,
+};
+
+/* The core only says the buffers are full, say it louder */
+static int bq_queued(int status)
+{
+	if (status == -ENOSPC)
+		dev_alert(&bq_dev.spi_device->dev,
+			  "Transfer index overflow\n");
+	return status;
+}
+
+static int writeRegister(u8 address, u8 reg, u8 data)
+{
+	pr_devel("%s: write reg(%x %x) = %x\n",
+		 this_driver_name, address, reg, data);
+
+	return bq_queued(bq_proto_write(&bq_ctl.proto, address, reg, data));
+}
+
+/*
+  Read a register or a register pair.
+  This will terminate and run the current chain of writes and start a
+  new chain.
+*/
+int readRegister(u8 address, u8 reg, int count)
+{
+	int val;
+
+	if ((count != 1) && (count != 2))
+	{
+		dev_alert(&bq_dev.spi_device->dev,
+			  "readRegister: count is %d, must be 1,2\n", count);
+		return -EFAULT;
+	}
+
+	val = bq_queued(bq_proto_read(&bq_ctl.proto, address, reg, count));
+
+	pr_devel("read reg(%x %x) = %x\n", address, reg, val);
+
+	return val;
+}
+
+/* Warn when a conversion used more of the bus than it should.
+   Called with spi_sem held so the counters can be read directly.
+*/
+static void bq_check_budget(u64 start_messages,
+			    const struct bq_link_counters *start, int chips,
+			    int polls)
+{
+	const struct bq_stats *now = &bq_dev.stats;
+	u64 messages = now->messages - start_messages;
+	u64 transfers = now->total.transfers - start->transfers;
+	u64 bytes = now->total.bytes - start->bytes;
+
+	/* A retry is extra traffic on purpose */
+	if (now->total.retries != start->retries)
+		return;
+
+	if (messages <= SCAN_MESSAGES(polls) &&
+	    transfers <= SCAN_TRANSFERS(chips, polls) &&
+	    bytes <= SCAN_BYTES(chips, polls))
+		return;
+
+	bq_stats_begin();
+	bq_dev.stats.over_budget++;
+	bq_stats_end();
+
+	WARN_ONCE(1, "%s: scan of %d chips with %d polls took %llu "
+		  "messages, %llu transfers, %llu bytes, budget %d, %d, %d\n",
+		  this_driver_name, chips, polls, messages, transfers, bytes,
+		  SCAN_MESSAGES(polls), SCAN_TRANSFERS(chips, polls),
+		  SCAN_BYTES(chips, polls));
+}
+
+/*
+  Start a conversion on every chip and stamp it. The chips start
+  somewhere between the two times taken around the write or the GPIO
+  edge. Called with spi_sem held.
+*/
+static int bq_start_conversion(struct bq_sample *sample)
+{
+	ktime_t before;
+	ktime_t after;
+	int status = 0;
+
+	if (conv_gpio >= 0)
+	{
+		before = ktime_get();
+		gpio_set_value(conv_gpio, 1);
+		after = ktime_get();
+		udelay(CONV_PULSE_US);
+		gpio_set_value(conv_gpio, 0);
+	}
+	else
+	{
+		bq_prepare_spi_message();
+		writeRegister(BROADCAST, ADC_CONVERT, AC_CONV);
+		before = ktime_get();
+		status = bq_spi_sync();
+		after = ktime_get();
+	}
+	trace_bq_adc_convert(status);
+	if (status != 0)
+		return status;
+
+	sample->convert_time = before;
+	sample->convert_skew_ns = ktime_to_ns(ktime_sub(after, before));
+	bq_dev.convert_skew_ns = sample->convert_skew_ns;
+	if (bq_dev.convert_skew_ns > bq_dev.convert_skew_max_ns)
+		bq_dev.convert_skew_max_ns = bq_dev.convert_skew_ns;
+
+	return 0;
+}
+
+//TODO: rename
+int get_voltages(struct bq_sample *sample)
+{
+	struct bq_chip_sample *chip;
+	struct bq_chip_regs regs;
+	struct bq_link_counters budget;
+	u64 budget_messages;
+	ktime_t start;
+	int first;
+	int cell;
+	int i;
+	int temp;
+	int status;
+	int tries = 0;
+
+	/* Only the totals are needed to check the budget */
+	budget_messages = bq_dev.stats.messages;
+	budget = bq_dev.stats.total;
+
+	/* Start the ADC */
+	status = bq_start_conversion(sample);
+	if (status != 0)
+	{
+		dev_alert(&bq_dev.spi_device->dev,
+			  "start conversion status = %x\n",
+			  status);
+		return status;
+	}
+
+	/* Wait until the conversions are done. By the time we read
+	   the first chip the others are done also
+	*/
+	start = ktime_get();
+	do
+	{
+		bq_prepare_spi_message();
+		temp = readRegister(1, DEVICE_STATUS, 1);
+		trace_bq_drdy_wait(tries, temp,
+				   ktime_us_delta(ktime_get(), start));
+		if (++tries >= DRDY_POLLS)
+		{
+			dev_info(&bq_dev.spi_device->dev,
+				 "Giving up\n");
+			bq_stats_begin();
+			bq_dev.stats.drdy_timeouts++;
+			bq_stats_end();
+			return -EIO;
+		}
+
+	} while ((temp & DRDY) == 0);
+	sample->drdy_time = ktime_get();
+	bq_hist_add(&bq_dev.drdy_hist,
+		    ktime_us_delta(sample->drdy_time, start));
+
+	/* Read the whole chain in one message, two block reads per chip */
+	bq_prepare_spi_message();
+	first = bq_queued(bq_proto_queue_scan(&bq_ctl.proto, devices_used));
+	if (first < 0)
+	{
+		bq_prepare_spi_message();
+		return first;
+	}
+
+	status = bq_spi_sync();
+	if (status != 0)
+	{
+		dev_alert(&bq_dev.spi_device->dev,
+			  "scan status = %x\n", status);
+		bq_prepare_spi_message();
+		return status;
+	}
+
+	sample->cell_count = total_cell_count;
+	sample->chip_count = devices_used;
+
+	/* The cells are in chip order */
+	cell = 0;
+	for(i=1; i<devices_used+1; i++)
+	{
+		status = bq_proto_decode_chip(&bq_ctl.proto, first, i, &regs);
+		if (status != 0)
+		{
+			trace_bq_decode_chip(i, status, 0, 0, 0);
+			bq_prepare_spi_message();
+			return status;
+		}
+		trace_bq_decode_chip(i, 0, regs.status, regs.alert, regs.fault);
+
+		for(; cell<total_cell_count && cells[cell].chip == i; cell++)
+		{
+			temp = regs.cell[(cells[cell].index - VCELL1) / 2];
+			sample->cell[cell] = bq_cell_uv(temp);
+		}
+
+		if (i == gpai_chip)
+			sample->gpai_mv = bq_gpai_mv(regs.gpai);
+
+		chip = &sample->chip[i];
+		chip->cells = cells_per_device[i];
+		chip->temperature[0] = regs.temperature[0];
+		chip->temperature[1] = regs.temperature[1];
+		pr_devel("%d raw temperature = %x %x\n", i,
+			 chip->temperature[0], chip->temperature[1]);
+
+		chip->status = regs.status;
+		chip->alert = regs.alert;
+		chip->fault = regs.fault;
+		chip->cov = regs.cov;
+		chip->cuv = regs.cuv;
+
+		if ((chip->status & DS_ADDR_RQST) == 0)
+			bq_count(i, address_lost);
+	}
+	bq_prepare_spi_message();
+
+	bq_stats_begin();
+	bq_dev.stats.scans++;
+	bq_stats_end();
+
+	bq_check_budget(budget_messages, &budget, devices_used, tries);
+
+	return 0;
+}
+
+/* Cell voltage in millivolts */
+static int bq_cell_mv(u32 uv)
+{
+	return uv / 1000;
+}
+
+/* Cell voltage scaled differently than the data sheet.
+   Make 0-5.10 volts fit in one byte (0-255)
+*/
+static u8 bq_cell_byte(u32 uv)
+{
+	return uv / 20000;
+}
+
+/* Cell voltage in units of 5.12 volts / 2^bits */
+static u16 bq_cell_word(u32 uv, int bits)
+{
+	u64 val = div_u64((u64)uv << bits, 5120000);
+
+	return min_t(u64, val, 0xFFFF);
+}
+
+/* Extended records are used when sample_bits asks for them */
+static int bq_resolution(void)
+{
+	return clamp_t(int, sample_bits, 8, 16);
+}
+
+static u8 *bq_encode_cell(u32 uv, int bits, u8 *p)
+{
+	u16 word;
+
+	if (bits == 8)
+	{
+		*p++ = bq_cell_byte(uv);
+		return p;
+	}
+
+	word = bq_cell_word(uv, bits);
+	*p++ = word >> 8;
+	*p++ = word;
+	return p;
+}
+
+/* Signed degrees Celsius */
+static s8 bq_temperature(u16 raw)
+{
+	//TODO: constants
+	return ((int)raw - 2048) / 120;
+}
+
+/* The 7 bytes of a chip group after the cell count */
+static u8 *bq_encode_chip(const struct bq_chip_sample *chip, u8 *p)
+{
+	*p++ = bq_temperature(chip->temperature[0]);
+	*p++ = bq_temperature(chip->temperature[1]);
+	*p++ = chip->status;
+	*p++ = chip->fault;
+	*p++ = chip->alert;
+	*p++ = chip->cuv;
+	*p++ = chip->cov;
+	return p;
+}
+
+/* Build a full record, see the top of this file. Returns the length */
+static int bq_encode_record(const struct bq_sample *sample, u8 *p)
+{
+	int i;
+	int size;
+	int bits = bq_resolution();
+	u8 *save = p;
+
+	if (bits > 8)
+	{
+		*p++ = BQ_RECORD_EXTENDED;
+		*p++ = bits;
+	}
+
+	*p++ = sample->cell_count;
+
+	for(i=0; i<sample->cell_count; i++)
+		p = bq_encode_cell(sample->cell[i], bits, p);
+
+	*p++ = sample->chip_count;
+
+	for(i=1; i<sample->chip_count+1; i++)
+	{
+		*p++ = sample->chip[i].cells;
+		p = bq_encode_chip(&sample->chip[i], p);
+	}
+	size = p - save;
+	*p++ = crc8(crc8_table, save, size, 0);
+	/* +1 to include the crc */
+	return size+1;
+}
+
+static int bq_cell_deadband(int cell)
+{
+	if (cell < cell_deadband_count)
+		return cell_deadband[cell];
+	return deadband_mv;
+}
+
+static bool bq_chip_changed(const struct bq_chip_sample *now,
+			    const struct bq_chip_sample *ref)
+{
+	int i;
+
+	for (i = 0; i < 2; i++)
+	{
+		if (abs(bq_temperature(now->temperature[i]) -
+			bq_temperature(ref->temperature[i])) > temp_deadband)
+			return true;
+	}
+	return now->status != ref->status ||
+		now->fault != ref->fault ||
+		now->alert != ref->alert ||
+		now->cuv != ref->cuv ||
+		now->cov != ref->cov;
+}
+
+/*
+  Build a delta record for one reader, see the top of this file.
+  Everything that goes into the record is remembered as what the
+  reader has been told. With p == NULL nothing is built or remembered
+  and the return value is the number of changes. Otherwise the return
+  value is the length of the record.
+*/
+static int bq_encode_delta(struct bq_file *file,
+			   const struct bq_sample *sample, u8 *p)
+{
+	struct bq_sample *ref = &file->ref;
+	u8 *save = p;
+	u8 *count;
+	int changes = 0;
+	int size;
+	int bits = bq_resolution();
+	int i;
+
+	if (p)
+	{
+		if (bits > 8)
+		{
+			*p++ = BQ_RECORD_EXTENDED_DELTA;
+			*p++ = bits;
+		}
+		else
+			*p++ = BQ_RECORD_DELTA;
+		count = p++;
+		*count = 0;
+	}
+
+	for(i=0; i<sample->cell_count; i++)
+	{
+		if (abs(bq_cell_mv(sample->cell[i]) -
+			bq_cell_mv(ref->cell[i])) <= bq_cell_deadband(i))
+			continue;
+
+		changes++;
+		if (!p)
+			continue;
+		(*count)++;
+		*p++ = i;
+		p = bq_encode_cell(sample->cell[i], bits, p);
+		ref->cell[i] = sample->cell[i];
+	}
+
+	if (p)
+	{
+		count = p++;
+		*count = 0;
+	}
+
+	for(i=1; i<sample->chip_count+1; i++)
+	{
+		if (!bq_chip_changed(&sample->chip[i], &ref->chip[i]))
+			continue;
+
+		changes++;
+		if (!p)
+			continue;
+		(*count)++;
+		*p++ = i;
+		p = bq_encode_chip(&sample->chip[i], p);
+		ref->chip[i] = sample->chip[i];
+	}
+
+	if (!p)
+		return changes;
+
+	size = p - save;
+	*p++ = crc8(crc8_table, save, size, 0);
+	return size+1;
+}
+
+/* Add one conversion to the filters */
+static void bq_filter_add(struct bq_filter *f, int mode,
+			  const struct bq_sample *sample)
+{
+	int shift = clamp_t(int, iir_shift, 0, 16);
+	s32 val;
+	int i;
+	int t;
+
+	if (mode == 0)
+	{
+		if (f->count == 0)
+			memset(f->cell, 0, sizeof(f->cell));
+
+		for (i = 0; i < sample->cell_count; i++)
+			f->cell[i] += sample->cell[i];
+
+		for (t = 0; t < 2; t++)
+		{
+			if (f->count == 0)
+				memset(f->temperature[t], 0,
+				       sizeof(f->temperature[t]));
+			for (i = 1; i < sample->chip_count + 1; i++)
+				f->temperature[t][i] +=
+					sample->chip[i].temperature[t];
+		}
+	}
+	else if (!f->primed)
+	{
+		for (i = 0; i < sample->cell_count; i++)
+			f->cell[i] = sample->cell[i] << FILTER_FRAC;
+
+		for (t = 0; t < 2; t++)
+			for (i = 1; i < sample->chip_count + 1; i++)
+				f->temperature[t][i] =
+				  sample->chip[i].temperature[t] << FILTER_FRAC;
+		f->primed = true;
+	}
+	else
+	{
+		for (i = 0; i < sample->cell_count; i++)
+		{
+			val = (sample->cell[i] << FILTER_FRAC) - f->cell[i];
+			f->cell[i] += val >> shift;
+		}
+
+		for (t = 0; t < 2; t++)
+			for (i = 1; i < sample->chip_count + 1; i++)
+			{
+				val = (sample->chip[i].temperature[t] <<
+				       FILTER_FRAC) - f->temperature[t][i];
+				f->temperature[t][i] += val >> shift;
+			}
+	}
+	f->count++;
+}
+
+/* Replace the cells and temperatures of the last conversion with the
+   filter output
+*/
+static void bq_filter_output(struct bq_filter *f, int mode,
+			     struct bq_sample *sample)
+{
+	int i;
+	int t;
+
+	if (mode == 0)
+	{
+		for (i = 0; i < sample->cell_count; i++)
+			sample->cell[i] = f->cell[i] / f->count;
+
+		for (t = 0; t < 2; t++)
+			for (i = 1; i < sample->chip_count + 1; i++)
+				sample->chip[i].temperature[t] =
+					f->temperature[t][i] / f->count;
+	}
+	else
+	{
+		for (i = 0; i < sample->cell_count; i++)
+			sample->cell[i] = (f->cell[i] +
+				(1 << (FILTER_FRAC - 1))) >> FILTER_FRAC;
+
+		for (t = 0; t < 2; t++)
+			for (i = 1; i < sample->chip_count + 1; i++)
+				sample->chip[i].temperature[t] =
+					(f->temperature[t][i] +
+					 (1 << (FILTER_FRAC - 1))) >> FILTER_FRAC;
+	}
+	f->count = 0;
+}
+
+/*
+  Let a waiting query have the bus between two conversions. up() hands
+  the semaphore straight to the first waiter so the query goes before
+  we get it back. Called with spi_sem held.
+*/
+static void bq_yield_bus(void)
+{
+	if (atomic_read(&bq_dev.queries) == 0)
+		return;
+
+	up(&bq_dev.spi_sem);
+	down(&bq_dev.spi_sem);
+}
+
+/* Run oversample conversions back to back and filter them. The status
+   registers come from the last conversion.
+*/
+static int bq_oversample(struct bq_sample *sample)
+{
+	int n = clamp_t(int, oversample, 1, MAX_OVERSAMPLE);
+	int mode = filter;
+	ktime_t convert_time = ktime_set(0, 0);
+	u32 convert_skew_ns = 0;
+	int status;
+	int i;
+
+	/* filter can change at any time, keep it for the whole scan and
+	   start over when it did. Neither filter's state means anything
+	   to the other
+	*/
+	if (mode != bq_dev.filter.mode)
+	{
+		bq_dev.filter.mode = mode;
+		bq_dev.filter.primed = false;
+	}
+	bq_dev.filter.count = 0;
+	for (i = 0; i < n; i++)
+	{
+		status = get_voltages(sample);
+		if (status != 0)
+		{
+			/* Start the IIR filter over after a gap */
+			bq_dev.filter.primed = false;
+			return status;
+		}
+		bq_filter_add(&bq_dev.filter, mode, sample);
+		if (i == 0)
+		{
+			convert_time = sample->convert_time;
+			convert_skew_ns = sample->convert_skew_ns;
+		}
+		if (i < n - 1)
+			bq_yield_bus();
+	}
+	bq_filter_output(&bq_dev.filter, mode, sample);
+
+	/* From the start of the first conversion to the end of the last */
+	sample->convert_time = convert_time;
+	sample->convert_skew_ns = convert_skew_ns;
+
+	return 0;
+}
+
+/* Switch every chip to the given ADC conversion time */
+static int bq_set_adc_time(u8 adct)
+{
+	int config;
+	int status;
+	int i;
+
+	for (i = 1; i < devices_used + 1; i++)
+	{
+		bq_prepare_spi_message();
+		config = readRegister(i, FUNCTION_CONFIG, 1);
+		if (config < 0)
+			return config;
+
+		bq_prepare_spi_message();
+		writeRegister(i, SHDW_CTRL, SC_ENABLE);
+		writeRegister(i, FUNCTION_CONFIG,
+			      (config & ~FC_ADCT_MASK) | adct);
+		status = bq_spi_sync();
+		if (status != 0)
+		{
+			dev_alert(&bq_dev.spi_device->dev,
+				  "set ADC time status = %x\n", status);
+			return status;
+		}
+	}
+	return 0;
+}
+
+/* ADC_CONTROL while the chips are awake. Enable all cells &
+   thermistors. Leave the ADC powered when running conversions back to
+   back
+*/
+static u8 bq_adc_control(void)
+{
+	return AC_CELL_SEL_6 | AC_TS1 | AC_TS2 |
+		(oversample > 1 ? AC_ADC_ON : 0) |
+		(gpai_chip > 0 ? AC_GPAI : 0);
+}
+
+/* Group3 registers in struct bq_config, one message writes them all */
+#define CONFIG_REGS	(CONFIG_OTT + 1 - CONFIG_COV)
+
+/* What write_defaults() always wrote. CUTV, OT and OTT were never
+   written, they are read from chip 1 by bq_read_config() so its EPROM
+   settings stay in force until BQ_IOC_SET_CONFIG changes them
+*/
+static const struct bq_config bq_default_config = {
+	.cov = COV_350,			/* 3.5 V			*/
+	.covt = CC_USMS | 1,		/* 100 ms			*/
+	.cuv = 0x14,			/* 2.7 V			*/
+};
+
+/*
+  Seed the settings the driver has no default for from the first chip,
+  in one message with every chip. The apply broadcasts them, so a chip
+  whose EPROM has other values gets chip 1's and is warned about here.
+*/
+static int bq_read_config(void)
+{
+	static const u8 seeded[] = { CONFIG_CUTV, CONFIG_OT, CONFIG_OTT };
+	const u8 *data;
+	u8 want[ARRAY_SIZE(seeded)];
+	int first;
+	int status;
+	int i;
+	int r;
+
+	bq_prepare_spi_message();
+	first = bq_ctl.proto.packets;
+	for (i = 1; i < devices_used + 1; i++)
+	{
+		status = bq_queued(bq_proto_queue_read(&bq_ctl.proto, i,
+						       CONFIG_COV,
+						       CONFIG_REGS));
+		if (status < 0)
+			return status;
+	}
+	status = bq_spi_sync();
+	if (status != 0)
+		return status;
+
+	for (i = 1; i < devices_used + 1; i++)
+	{
+		status = bq_proto_read_data(&bq_ctl.proto, first + i - 1,
+					    &data);
+		if (status != 0)
+			return status;
+		for (r = 0; r < ARRAY_SIZE(seeded); r++)
+		{
+			if (i == 1)
+				want[r] = data[seeded[r] - CONFIG_COV];
+			else if (data[seeded[r] - CONFIG_COV] != want[r])
+				dev_warn(&bq_dev.spi_device->dev,
+					 "chip %d register %x is %x, chip 1 "
+					 "has %x\n", i, seeded[r],
+					 data[seeded[r] - CONFIG_COV], want[r]);
+		}
+	}
+
+	bq_dev.config.cutv = want[0];
+	bq_dev.config.ot = want[1];
+	bq_dev.config.ott = want[2];
+	return 0;
+}
+
+/*
+  Read the protection registers and the parity results back from every
+  chip in one message. Returns how many registers and parity results
+  are wrong, or an errno when the chips could not be read. Called with
+  spi_sem held.
+*/
+static int bq_verify_config(void)
+{
+	const u8 *want = (const u8 *)&bq_dev.config;
+	const u8 *data;
+	int first;
+	int status;
+	int errors = 0;
+	int i;
+	int r;
+
+	bq_prepare_spi_message();
+	first = bq_ctl.proto.packets;
+	for (i = 1; i < devices_used + 1; i++)
+	{
+		status = bq_proto_queue_read(&bq_ctl.proto, i, CONFIG_COV,
+					     CONFIG_REGS);
+		if (status >= 0)
+			status = bq_proto_queue_read(&bq_ctl.proto, i,
+						     PRESULT_A, 2);
+		if (status < 0)
+			return bq_queued(status);
+	}
+	status = bq_spi_sync();
+	if (status != 0)
+		return status;
+
+	for (i = 1; i < devices_used + 1; i++)
+	{
+		status = bq_proto_read_data(&bq_ctl.proto,
+					    first + 2 * (i - 1), &data);
+		if (status != 0)
+			return status;
+		for (r = 0; r < CONFIG_REGS; r++)
+		{
+			if (data[r] == want[r])
+				continue;
+			dev_alert(&bq_dev.spi_device->dev,
+				  "chip %d register %x is %x not %x\n",
+				  i, CONFIG_COV + r, data[r], want[r]);
+			errors++;
+		}
+
+		status = bq_proto_read_data(&bq_ctl.proto,
+					    first + 2 * (i - 1) + 1, &data);
+		if (status != 0)
+			return status;
+		if (data[0] || data[1])
+		{
+			dev_alert(&bq_dev.spi_device->dev,
+				  "chip %d Group3 parity %x %x\n",
+				  i, data[0], data[1]);
+			errors++;
+		}
+	}
+
+	return errors;
+}
+
+/*
+  Write the protection registers to every chip in one message and
+  check them. Each Group3 write has to follow its own SHDW_CTRL, the
+  chips close Group3 again after one write. Called with spi_sem held.
+*/
+static int bq_apply_config(void)
+{
+	const u8 *regs = (const u8 *)&bq_dev.config;
+	int status = 0;
+	int r;
+
+	BUILD_BUG_ON(sizeof(struct bq_config) != CONFIG_REGS);
+
+	bq_prepare_spi_message();
+	for (r = 0; r < CONFIG_REGS && status == 0; r++)
+	{
+		status = writeRegister(BROADCAST, SHDW_CTRL, SC_ENABLE);
+		if (status == 0)
+			status = writeRegister(BROADCAST, CONFIG_COV + r,
+					       regs[r]);
+	}
+	if (status == 0)
+		status = bq_spi_sync();
+	if (status == 0)
+		status = bq_verify_config();
+
+	bq_dev.config_verified = status > 0 ? -EIO : status;
+	if (status != 0)
+		dev_alert(&bq_dev.spi_device->dev,
+			  "protection settings not applied: %d\n",
+			  bq_dev.config_verified);
+
+	/* Chips that did not take them show in config_verified, only a
+	   failed transfer is an error here
+	*/
+	return status > 0 ? 0 : status;
+}
+
+/* Reject bits the data sheet leaves unused in each register */
+static int bq_check_config(const struct bq_config *config)
+{
+	if ((config->cov & ~COV_DISABLE) > COV_520)
+		return -EINVAL;
+	if (config->covt & ~(CC_USMS | 0x1F))
+		return -EINVAL;
+	if (config->cuv & ~(UV_DISABLE | 0x1F))
+		return -EINVAL;
+	if (config->cutv & ~(CC_USMS | 0x1F))
+		return -EINVAL;
+	if (config->ot > OT_90C)
+		return -EINVAL;
+	return 0;
+}
+
+int write_defaults(void)
+{
+	int status;
+
+	bq_prepare_spi_message();
+	writeRegister(BROADCAST, ADC_CONTROL, bq_adc_control());
+
+	/* Connect the thermistors to REG50 */
+	writeRegister(BROADCAST, IO_CONTROL, TS1 | TS2);
+
+	/* Start the ADC. This is needed because we read the voltages
+	   to discover which cells are present
+	*/
+	writeRegister(BROADCAST, ADC_CONVERT, AC_CONV);
+
+	status = bq_spi_sync();
+	if (status != 0)
+	{
+		dev_alert(&bq_dev.spi_device->dev,
+			  "write_defaults status = %x\n",
+			  status);
+		return status;
+	}
+
+	status = bq_read_config();
+	if (status != 0)
+	{
+		dev_alert(&bq_dev.spi_device->dev,
+			  "reading protection settings status = %d\n",
+			  status);
+		return status;
+	}
+
+	return bq_apply_config();
+}
+
+void cov(int address)
+{
+	int cov;
+
+	cov = readRegister(address, COV_FAULT, 1);
+	dev_info(&bq_dev.spi_device->dev, "cov = %x\n", cov);
+	cov = readRegister(address, CONFIG_COV, 1);
+	dev_info(&bq_dev.spi_device->dev, "config cov = %x\n", cov);
+}
+
+int get_fault(u8 address)
+{
+	int fault;
+
+	fault = readRegister(address, FAULT_STATUS, 1);
+	writeRegister(address, FAULT_STATUS, fault);
+	writeRegister(address, FAULT_STATUS, 0);
+	dev_info(&bq_dev.spi_device->dev, "fault = %x\n", fault);
+	/* Every chip reports this after search_pack(), write_defaults()
+	   has already written the settings. A reset later on is caught
+	   by bq_recover_chain()
+	*/
+	if (fault & FS_POR)
+	{
+		dev_info(&bq_dev.spi_device->dev, "Power on\n");
+	}
+	if (fault & FS_COV)
+	{
+		dev_info(&bq_dev.spi_device->dev, "Cell over voltage\n");
+		cov(address);
+	}
+	return fault;
+}
+
+int get_alert(int address)
+{
+	int alert;
+	int address_reg;
+
+	alert = readRegister(address, ALERT_STATUS, 1);
+	writeRegister(address, ALERT_STATUS, alert);
+	writeRegister(address, ALERT_STATUS, 0);
+	dev_info(&bq_dev.spi_device->dev, "Alert = %x\n", alert);
+	if ((alert & AS_AR) == 0)
+	{
+		address_reg = readRegister(address, ADDRESS_CONTROL, 1);
+		dev_info(&bq_dev.spi_device->dev, "Address register = %x\n",
+			 address_reg);
+	}
+	return alert;
+}
+
+int get_chip_status(int address)
+{
+	int val = 0;
+	int fault = 0;
+	int alert = 0;
+
+	bq_prepare_spi_message();
+	val = readRegister(address, DEVICE_STATUS, 1);
+	if (val < 0)
+	{
+		return (int) val;
+	}
+	dev_info(&bq_dev.spi_device->dev,
+		 "Chip %d status = %x\n", address, val);
+
+	if ((val & DS_ADDR_RQST) == 0)
+	{
+		dev_alert(&bq_dev.spi_device->dev,
+			  "Address not assigned!!!!!!!!!\n");
+		bq_count(address, address_lost);
+	}
+	if (val & DS_FAULT)
+	{
+		fault = get_fault(address);
+		bq_count(address, faults);
+	}
+	if (val & DS_ALERT)
+	{
+		alert = get_alert(address);
+		bq_count(address, alerts);
+	}
+	if (val & (DS_FAULT | DS_ALERT))
+	{
+		bq_nl_send_event(address, val, fault, alert);
+	}
+	return val;
+}
+
+/*
+  search_pack - Discover all the bq76PL536 chips in the system.
+
+  This is right from the flow chart in the data sheet.
+
+  The RESET_COMMAND only resets chips that are addressable plus one extra
+  chip. This code will find and reset chips that somehow have bogus addresses.
+*/
+
+u8 search_pack (void)
+{
+	int n = bq_queued(bq_proto_search(&bq_ctl.proto, devices_used));
+
+	return n < 0 ? 0 : n;
+}
+
+/*
+  Read ADDRESS_CONTROL of one chip diag_reads times at the current
+  speed, as many reads to a message as fit. It has to read back the
+  address with AC_ADDR_RQST. Called with spi_sem held.
+*/
+static int bq_diag_chip(u8 address, struct bq_diag_result *r)
+{
+	const u8 *data;
+	ktime_t start;
+	int batch;
+	int first;
+	int status;
+	int i;
+
+	while (r->reads < diag_reads)
+	{
+		batch = min3(diag_reads - (int)r->reads,
+			     bq_ctl.proto.max_packets,
+			     bq_ctl.proto.buff_size / 5);
+
+		bq_prepare_spi_message();
+		first = bq_ctl.proto.packets;
+		for (i = 0; i < batch; i++)
+		{
+			status = bq_queued(bq_proto_queue_read(&bq_ctl.proto,
+							       address,
+							       ADDRESS_CONTROL,
+							       1));
+			if (status < 0)
+				return status;
+		}
+
+		start = ktime_get();
+		status = bq_spi_sync();
+		r->us += ktime_us_delta(ktime_get(), start);
+		r->reads += batch;
+		if (status != 0)
+		{
+			r->spi_errors += batch;
+			continue;
+		}
+
+		for (i = 0; i < batch; i++)
+		{
+			if (bq_proto_read_data(&bq_ctl.proto, first + i, &data))
+				r->crc_errors++;
+			else if (data[0] != (address | AC_ADDR_RQST))
+				r->bad_values++;
+		}
+	}
+	bq_prepare_spi_message();
+
+	return 0;
+}
+
+/* Test every chip at every speed. Called with spi_sem held */
+static int bq_link_diag(void)
+{
+	struct bq_diag *d = &bq_dev.diag;
+	int status = 0;
+	int s;
+	int i;
+
+	memset(d, 0, sizeof(*d));
+	if (diag_speeds > 0)
+	{
+		d->speeds = diag_speeds;
+		for (s = 0; s < diag_speeds; s++)
+			d->speed_hz[s] = diag_speed_hz[s];
+	}
+	else
+	{
+		d->speeds = 3;
+		d->speed_hz[0] = spi_speed_hz / 2;
+		d->speed_hz[1] = spi_speed_hz;
+		d->speed_hz[2] = spi_speed_hz * 4;
+	}
+	d->chips = devices_used;
+	d->expected = bq_dev.devices_expected;
+
+	bq_ctl.proto.ops = &bq_diag_ops;
+	for (s = 0; s < d->speeds && status == 0; s++)
+	{
+		bq_ctl.speed_hz = d->speed_hz[s];
+		for (i = 1; i < devices_used + 1 && status == 0; i++)
+			status = bq_diag_chip(i, &d->chip[s][i]);
+	}
+	bq_ctl.speed_hz = 0;
+	bq_ctl.proto.ops = &bq_proto_ops;
+
+	/* A read turned into a write by a bit error needs a good CRC to
+	   be taken, make sure that did not happen
+	*/
+	d->config = bq_verify_config();
+	if (d->config > 0)
+		d->config = -EIO;
+	bq_dev.config_verified = d->config;
+	d->status = status;
+
+	return status;
+}
+
+
+static void bq_free_spi_buffers(void)
+{
+	if (bq_ctl.xfer)
+		kfree(bq_ctl.xfer);
+
+	if (bq_ctl.packet)
+		kfree(bq_ctl.packet);
+
+	if (bq_ctl.tx_buff)
+		kfree(bq_ctl.tx_buff);
+
+	if (bq_ctl.rx_buff)
+		kfree(bq_ctl.rx_buff);
+
+	bq_ctl.xfer = 0;
+	bq_ctl.packet = 0;
+	bq_ctl.tx_buff = 0;
+	bq_ctl.rx_buff = 0;
+	bq_proto_init(&bq_ctl.proto, &bq_proto_ops, crc8_table,
+		      NULL, NULL, 0, NULL, 0);
+}
+
+/*
+  Size the SPI buffers for a chain of chips. Called with 0 before the
+  pack is searched and again with the chips that were found so a scan
+  fits in one message.
+*/
+static int bq_alloc_spi_buffers(int chips)
+{
+	struct spi_transfer *xfer;
+	struct bq_packet *packet;
+	int count = MAX_XFER + BQ_SCAN_PACKETS(chips);
+	int buff_size = SPI_BUFF_SIZE + BQ_SCAN_BYTES(chips);
+	u8 *tx_buff;
+	u8 *rx_buff;
+
+	xfer = kcalloc(count, sizeof(*xfer), GFP_KERNEL);
+	packet = kcalloc(count, sizeof(*packet), GFP_KERNEL);
+	tx_buff = kmalloc(buff_size, GFP_KERNEL | GFP_DMA);
+	rx_buff = kzalloc(buff_size, GFP_KERNEL | GFP_DMA);
+	if (!xfer || !packet || !tx_buff || !rx_buff)
+	{
+		kfree(xfer);
+		kfree(packet);
+		kfree(tx_buff);
+		kfree(rx_buff);
+		return -ENOMEM;
+	}
+
+	bq_free_spi_buffers();
+
+	bq_ctl.xfer = xfer;
+	bq_ctl.packet = packet;
+	bq_ctl.tx_buff = tx_buff;
+	bq_ctl.rx_buff = rx_buff;
+	bq_proto_init(&bq_ctl.proto, &bq_proto_ops, crc8_table,
+		      tx_buff, rx_buff, buff_size, packet, count);
+
+	return 0;
+}
+
+/* The longest record for a chain, see bq76pl536_user.h */
+static int bq_record_size(int cell_count, int chip_count)
+{
+	return BQ_RECORD_SIZE_MAX(cell_count, chip_count);
+}
+
+static void bq_prepare_spi_message(void)
+{
+	bq_proto_reset(&bq_ctl.proto);
+}
+
+/*
+  Called with spi_sem held after every good scan. Keeps a copy for
+  readers, multicasts the record and sends an event for every chip
+  whose fault or alert state changed since the last scan.
+*/
+static void bq_publish_scan(const struct bq_sample *sample)
+{
+	const struct bq_chip_sample *chip;
+	u8 state[3];
+	u32 seq;
+	int len;
+	int i;
+
+	down(&bq_dev.sample_sem);
+	bq_dev.sample = *sample;
+	seq = ++bq_dev.sample_seq;
+	up(&bq_dev.sample_sem);
+	wake_up_interruptible(&bq_dev.sample_wait);
+
+	len = bq_encode_record(sample, bq_dev.scan_buff);
+	trace_bq_encode(sample->cell_count, sample->chip_count, len);
+	bq_nl_send_sample(bq_dev.scan_buff, len, seq, sample);
+
+	for (i = 1; i < sample->chip_count + 1; i++)
+	{
+		chip = &sample->chip[i];
+
+		/* Only the fault and alert bits of the status are events */
+		state[0] = chip->status & (DS_FAULT | DS_ALERT);
+		state[1] = chip->fault;
+		state[2] = chip->alert;
+		if (!memcmp(bq_dev.chip_state[i], state, sizeof(state)))
+			continue;
+
+		memcpy(bq_dev.chip_state[i], state, sizeof(state));
+		bq_nl_send_event(i, chip->status, chip->fault, chip->alert);
+		if (chip->status & DS_FAULT)
+			bq_count(i, faults);
+		if (chip->status & DS_ALERT)
+			bq_count(i, alerts);
+	}
+}
+
+/* Put all the chips to sleep or wake them up. Called with spi_sem held */
+static int bq_sleep_chips(bool sleep)
+{
+	ktime_t start = ktime_get();
+	int status;
+
+	if (bq_dev.asleep == sleep)
+		return 0;
+
+	bq_prepare_spi_message();
+	/* Sleeping also turns the ADC off and disconnects the thermistors
+	   from REG50
+	*/
+	if (sleep)
+	{
+		writeRegister(BROADCAST, ADC_CONTROL,
+			      bq_adc_control() & ~AC_ADC_ON);
+		writeRegister(BROADCAST, IO_CONTROL, IO_SLEEP);
+	}
+	else
+	{
+		writeRegister(BROADCAST, IO_CONTROL, TS1 | TS2);
+		writeRegister(BROADCAST, ADC_CONTROL, bq_adc_control());
+	}
+	status = bq_spi_sync();
+	if (status != 0)
+	{
+		dev_alert(&bq_dev.spi_device->dev,
+			  "sleep %d status = %x\n", sleep, status);
+		return status;
+	}
+
+	if (!sleep)
+	{
+		usleep_range(WAKE_DELAY_US, 2 * WAKE_DELAY_US);
+		bq_dev.wake_latency_us = ktime_us_delta(ktime_get(), start);
+		if (bq_dev.wake_latency_us > bq_dev.wake_latency_max_us)
+			bq_dev.wake_latency_max_us = bq_dev.wake_latency_us;
+	}
+
+	bq_dev.asleep = sleep;
+	return 0;
+}
+
+/*
+  Take the bus for a transaction. Wakes the chips if they were put to
+  sleep, either by runtime PM or by an idle scan rate.
+*/
+static int bq_bus_get(void)
+{
+	int status;
+
+	status = pm_runtime_get_sync(&bq_dev.spi_device->dev);
+	if (status < 0)
+	{
+		pm_runtime_put_noidle(&bq_dev.spi_device->dev);
+		return status;
+	}
+
+	down(&bq_dev.spi_sem);
+	status = bq_sleep_chips(false);
+	if (status)
+	{
+		up(&bq_dev.spi_sem);
+		pm_runtime_put_autosuspend(&bq_dev.spi_device->dev);
+	}
+	return status;
+}
+
+static void bq_bus_put(void)
+{
+	up(&bq_dev.spi_sem);
+	pm_runtime_mark_last_busy(&bq_dev.spi_device->dev);
+	pm_runtime_put_autosuspend(&bq_dev.spi_device->dev);
+}
+
+static int bq_runtime_suspend(struct device *dev)
+{
+	int status;
+
+	down(&bq_dev.spi_sem);
+	status = bq_sleep_chips(true);
+	up(&bq_dev.spi_sem);
+
+	return status;
+}
+
+static int bq_runtime_resume(struct device *dev)
+{
+	int status;
+
+	down(&bq_dev.spi_sem);
+	status = bq_sleep_chips(false);
+	up(&bq_dev.spi_sem);
+
+	return status;
+}
+
+static const struct dev_pm_ops bq_pm_ops = {
+	SET_RUNTIME_PM_OPS(bq_runtime_suspend, bq_runtime_resume, NULL)
+};
+
+/* Is anything going on in the pack? Compares a new scan with the
+   last one published. Called with spi_sem held.
+*/
+static bool bq_pack_active(const struct bq_sample *now)
+{
+	const struct bq_sample *last = &bq_dev.sample;
+	int i;
+
+	if (bq_dev.sample_seq == 0)
+		return true;
+
+	for (i = 0; i < now->cell_count; i++)
+	{
+		if (abs(bq_cell_mv(now->cell[i]) -
+			bq_cell_mv(last->cell[i])) > activity_mv)
+			return true;
+	}
+
+	for (i = 1; i < now->chip_count + 1; i++)
+	{
+		if (now->chip[i].status & (DS_FAULT | DS_ALERT))
+			return true;
+	}
+
+	if (gpai_chip > 0 &&
+	    abs(now->gpai_mv - gpai_zero_mv) > gpai_threshold_mv)
+		return true;
+
+	return false;
+}
+
+/*
+  True if a scan shows a chip that lost its address, or a chip no
+  longer answers at its address. Called with spi_sem held.
+*/
+static bool bq_chain_lost(int status, const struct bq_sample *sample)
+{
+	int val;
+	int i;
+
+	if (status == 0)
+	{
+		for (i = 1; i < sample->chip_count + 1; i++)
+			if (!(sample->chip[i].status & DS_ADDR_RQST))
+				break;
+		if (i == sample->chip_count + 1)
+			return false;
+	}
+
+	for (i = 1; i < devices_used + 1; i++)
+	{
+		bq_prepare_spi_message();
+		val = readRegister(i, DEVICE_STATUS, 1);
+		if (val < 0 || !(val & DS_ADDR_RQST))
+			return true;
+	}
+	return false;
+}
+
+/*
+  A chip that power on reset has no address and is back on its EPROM
+  settings. The search resets every chip, so put back everything probe
+  wrote, clear the POR faults and apply the protection settings.
+  Called with spi_sem held.
+*/
+static int bq_recover_chain(void)
+{
+	int count;
+	int status;
+
+	bq_stats_begin();
+	bq_dev.stats.chain_resets++;
+	bq_stats_end();
+
+	count = search_pack();
+	if (count != devices_used)
+	{
+		dev_alert(&bq_dev.spi_device->dev,
+			  "Chain reset, found %d chips of %d\n",
+			  count, devices_used);
+		return -ENODEV;
+	}
+	dev_alert(&bq_dev.spi_device->dev,
+		  "Chain reset, %d chips addressed again\n", count);
+
+	bq_prepare_spi_message();
+	writeRegister(BROADCAST, ADC_CONTROL, bq_adc_control());
+	writeRegister(BROADCAST, IO_CONTROL, TS1 | TS2);
+	writeRegister(BROADCAST, FAULT_STATUS, FS_POR);
+	writeRegister(BROADCAST, FAULT_STATUS, 0);
+	status = bq_spi_sync();
+	if (status == 0 && oversample > 1)
+		status = bq_set_adc_time(FC_ADCT3);
+	if (status == 0)
+		status = bq_apply_config();
+	return status;
+}
+
+static int bq_scan(void)
+{
+	ktime_t start;
+	s64 us;
+	int status;
+
+	status = bq_bus_get();
+	if (status)
+		return status;
+
+	trace_bq_scan_start(bq_dev.sample_seq + 1);
+	start = ktime_get();
+
+	if (oversample > 1)
+		status = bq_oversample(&bq_dev.scan);
+	else
+		status = get_voltages(&bq_dev.scan);
+	if (status == 0)
+	{
+		bq_dev.active = bq_pack_active(&bq_dev.scan);
+		bq_publish_scan(&bq_dev.scan);
+	}
+	if (bq_chain_lost(status, &bq_dev.scan))
+		bq_recover_chain();
+
+	us = ktime_us_delta(ktime_get(), start);
+	trace_bq_scan_done(status, us);
+	bq_hist_add(&bq_dev.scan_hist, us);
+
+	bq_bus_put();
+
+	return status;
+}
+
+static int bq_rate_interval(enum bq_rate rate)
+{
+	switch (rate)
+	{
+	case RATE_FAST:
+		return fast_interval_ms;
+	case RATE_IDLE:
+		return idle_interval_ms;
+	default:
+		return scan_interval_ms;
+	}
+}
+
+static void bq_set_rate(enum bq_rate rate)
+{
+	unsigned long now = jiffies;
+
+	spin_lock(&bq_dev.rate_lock);
+	bq_dev.rate_time[bq_dev.rate] += now - bq_dev.rate_since;
+	bq_dev.rate_since = now;
+	bq_dev.rate = rate;
+	spin_unlock(&bq_dev.rate_lock);
+}
+
+/* Pick the scan rate from what the last scan saw */
+static enum bq_rate bq_next_rate(void)
+{
+	if (!adaptive)
+		return RATE_NORMAL;
+
+	if (bq_dev.active)
+	{
+		bq_dev.quiet_scans = 0;
+		return RATE_FAST;
+	}
+
+	if (++bq_dev.quiet_scans >= idle_scans)
+		return RATE_IDLE;
+
+	return RATE_NORMAL;
+}
+
+/*
+  A periodic scan from its deadline on, for the work item and the real
+  time thread. Returns when to wake up for the next one, early by the
+  wake latency when the chips will be asleep by then.
+*/
+static ktime_t bq_periodic_scan(void)
+{
+	struct device *dev = &bq_dev.spi_device->dev;
+	enum bq_rate rate;
+	ktime_t now;
+	int interval;
+
+	bq_hist_add(&bq_dev.late_hist,
+		    max_t(s64, ktime_us_delta(ktime_get(), bq_dev.next_scan), 0));
+	bq_scan();
+	pm_runtime_put_autosuspend(dev);
+
+	rate = bq_next_rate();
+	bq_set_rate(rate);
+	interval = bq_rate_interval(rate);
+
+	/* Let the chips sleep until the next scan */
+	if (rate == RATE_IDLE)
+	{
+		down(&bq_dev.spi_sem);
+		bq_sleep_chips(true);
+		up(&bq_dev.spi_sem);
+	}
+
+	/* Keep to the schedule unless we have fallen behind */
+	now = ktime_get();
+	bq_dev.next_scan = ktime_add_ms(bq_dev.next_scan, interval);
+	if (ktime_us_delta(bq_dev.next_scan, now) < 0)
+	{
+		bq_dev.overruns++;
+		bq_dev.next_scan = ktime_add_ms(now, interval);
+	}
+
+	if (rate == RATE_IDLE || interval > autosuspend_ms)
+		return ktime_sub(bq_dev.next_scan,
+				 ns_to_ktime(bq_dev.wake_latency_max_us *
+					     NSEC_PER_USEC));
+	return bq_dev.next_scan;
+}
+
+static void bq_scan_work(struct work_struct *work)
+{
+	struct device *dev = &bq_dev.spi_device->dev;
+	ktime_t wake;
+	s64 delay;
+
+	/* This runs early by the wake latency. Wake the chips now and
+	   start the scan on time
+	*/
+	pm_runtime_get_sync(dev);
+	delay = ktime_us_delta(bq_dev.next_scan, ktime_get());
+	if (delay > 0)
+		usleep_range(delay, delay + 100);
+
+	wake = bq_periodic_scan();
+
+	delay = ktime_us_delta(wake, ktime_get());
+	schedule_delayed_work(&bq_dev.scan_work,
+			      usecs_to_jiffies(max_t(s64, delay, 0)));
+}
+
+/* Sleep until an absolute time or until the thread is stopped */
+static void bq_sleep_until(ktime_t t)
+{
+	while (!kthread_should_stop())
+	{
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (schedule_hrtimeout_range(&t, 0, HRTIMER_MODE_ABS) == 0)
+			break;
+	}
+	__set_current_state(TASK_RUNNING);
+}
+
+static int bq_scan_thread(void *data)
+{
+	struct device *dev = &bq_dev.spi_device->dev;
+	ktime_t wake = bq_dev.next_scan;
+
+	while (!kthread_should_stop())
+	{
+		bq_sleep_until(wake);
+		if (kthread_should_stop())
+			break;
+
+		pm_runtime_get_sync(dev);
+		bq_sleep_until(bq_dev.next_scan);
+		wake = bq_periodic_scan();
+	}
+
+	return 0;
+}
+
+/* Start the periodic scans on the workqueue or the real time thread */
+static int bq_start_scans(void)
+{
+	struct sched_param param = { .sched_priority = rt_priority };
+	struct task_struct *thread;
+	int status;
+
+	bq_dev.next_scan = ktime_get();
+	if (rt_priority <= 0)
+	{
+		schedule_delayed_work(&bq_dev.scan_work, 0);
+		return 0;
+	}
+
+	thread = kthread_create(bq_scan_thread, NULL, this_driver_name);
+	if (IS_ERR(thread))
+		return PTR_ERR(thread);
+
+	if (rt_cpu >= 0)
+	{
+		if (rt_cpu >= nr_cpu_ids || !cpu_online(rt_cpu))
+			status = -EINVAL;
+		else
+			status = set_cpus_allowed_ptr(thread,
+						      cpumask_of(rt_cpu));
+		if (status)
+			dev_alert(&bq_dev.spi_device->dev,
+				  "Can not run on CPU %d: %d\n",
+				  rt_cpu, status);
+	}
+
+	status = sched_setscheduler(thread, SCHED_FIFO, &param);
+	if (status)
+		dev_alert(&bq_dev.spi_device->dev,
+			  "Can not use SCHED_FIFO %d: %d\n",
+			  rt_priority, status);
+
+	bq_dev.scan_thread = thread;
+	wake_up_process(thread);
+	return 0;
+}
+
+static void bq_stop_scans(void)
+{
+	if (bq_dev.scan_thread)
+	{
+		kthread_stop(bq_dev.scan_thread);
+		bq_dev.scan_thread = NULL;
+	}
+	cancel_delayed_work_sync(&bq_dev.scan_work);
+}
+
+/*
+  Make sure there is a scan this reader has not seen. Either wait for
+  the periodic scan or do one right now.
+*/
+static int bq_wait_sample(struct file *filp, struct bq_file *file)
+{
+	if (scan_interval_ms == 0)
+		return bq_scan();
+
+	if (bq_dev.sample_seq != file->seq)
+		return 0;
+
+	if (filp->f_flags & O_NONBLOCK)
+		return -EAGAIN;
+
+	if (wait_event_interruptible(bq_dev.sample_wait,
+				     bq_dev.sample_seq != file->seq))
+		return -ERESTARTSYS;
+
+	return 0;
+}
+
+static bool bq_keyframe_due(struct bq_file *file)
+{
+	return !file->have_ref ||
+		(keyframe_interval > 0 &&
+		 bq_dev.sample_seq - file->keyframe_seq >= keyframe_interval);
+}
+
+/*
+  Build the record for this reader from the latest scan. Called with
+  sample_sem held. Returns 0 when a delta reader has nothing new.
+*/
+static int bq_encode_for(struct bq_file *file, u8 *p)
+{
+	file->seq = bq_dev.sample_seq;
+	file->timing.seq = bq_dev.sample_seq;
+	file->timing.skew_ns = bq_dev.sample.convert_skew_ns;
+	file->timing.convert_ns = ktime_to_ns(bq_dev.sample.convert_time);
+	file->timing.drdy_ns = ktime_to_ns(bq_dev.sample.drdy_time);
+
+	if (!file->delta)
+		return bq_encode_record(&bq_dev.sample, p);
+
+	if (bq_keyframe_due(file))
+	{
+		file->ref = bq_dev.sample;
+		file->have_ref = true;
+		file->keyframe_seq = bq_dev.sample_seq;
+		return bq_encode_record(&bq_dev.sample, p);
+	}
+
+	/* Skip periodic scans with nothing to report. Without periodic
+	   scans the reader asked for this one, send it even if nothing
+	   changed.
+	*/
+	if (scan_interval_ms > 0 &&
+	    bq_encode_delta(file, &bq_dev.sample, NULL) == 0)
+		return 0;
+
+	return bq_encode_delta(file, &bq_dev.sample, p);
+}
+
+static ssize_t bq_read(struct file *filp, char __user *buff, size_t count,
+			loff_t *offp)
+{
+	struct bq_file *file = filp->private_data;
+	ktime_t start = ktime_get();
+	size_t len;
+	ssize_t status = 0;
+
+	if (!buff)
+		return -EFAULT;
+
+	/* One full record per open, delta readers keep reading */
+	if (!file->delta && *offp > 0)
+		return 0;
+
+	do
+	{
+		status = bq_wait_sample(filp, file);
+		if (status < 0)
+		{
+			/* Old behaviour, a failed scan reads as end of file */
+			if (!file->delta && status != -ERESTARTSYS &&
+			    status != -EAGAIN)
+				status = 0;
+			return status;
+		}
+
+		if (down_interruptible(&bq_dev.fop_sem))
+			return -ERESTARTSYS;
+
+		down(&bq_dev.sample_sem);
+		len = bq_encode_for(file, bq_dev.user_buff);
+		up(&bq_dev.sample_sem);
+
+		if (len == 0)
+			up(&bq_dev.fop_sem);
+	} while (len == 0);
+
+	bq_hist_add(&bq_dev.read_hist, ktime_us_delta(ktime_get(), start));
+
+	if (len < count)
+		count = len;
+
+	if (copy_to_user(buff, bq_dev.user_buff, count)) {
+		dev_alert(&bq_dev.spi_device->dev,
+			  "bq_read(): copy_to_user() failed\n");
+		status = -EFAULT;
+	} else {
+		*offp += count;
+		status = count;
+	}
+
+	up(&bq_dev.fop_sem);
+
+	return status;
+}
+
+static unsigned int bq_poll(struct file *filp, poll_table *wait)
+{
+	struct bq_file *file = filp->private_data;
+	unsigned int mask = 0;
+
+	/* Without periodic scans a read always has something */
+	if (scan_interval_ms == 0)
+		return POLLIN | POLLRDNORM;
+
+	poll_wait(filp, &bq_dev.sample_wait, wait);
+
+	down(&bq_dev.sample_sem);
+	if (bq_dev.sample_seq != file->seq &&
+	    (!file->delta || bq_keyframe_due(file) ||
+	     bq_encode_delta(file, &bq_dev.sample, NULL) > 0))
+		mask = POLLIN | POLLRDNORM;
+	up(&bq_dev.sample_sem);
+
+	return mask;
+}
+
+static int bq_open(struct inode *inode, struct file *filp)
+{
+	struct bq_file *file;
+	int status = 0;
+
+	file = kzalloc(sizeof(*file), GFP_KERNEL);
+	if (!file)
+		return -ENOMEM;
+
+	file->delta = delta_mode;
+
+	if (down_interruptible(&bq_dev.fop_sem)) {
+		kfree(file);
+		return -ERESTARTSYS;
+	}
+
+	/* Sized for the chain found at probe time */
+	if (!bq_dev.record_size) {
+		status = -ENODEV;
+	} else if (!bq_dev.user_buff) {
+		bq_dev.user_buff = kmalloc(bq_dev.record_size, GFP_KERNEL);
+		if (!bq_dev.user_buff)
+			status = -ENOMEM;
+	}
+
+	up(&bq_dev.fop_sem);
+
+	if (status)
+		kfree(file);
+	else
+		filp->private_data = file;
+
+	return status;
+}
+
+static int bq_release(struct inode *inode, struct file *filp)
+{
+	kfree(filp->private_data);
+	filp->private_data = NULL;
+
+	return 0;
+}
+
+/* Registers BQ_IOC_REGS does not write, the driver owns them */
+static bool bq_reg_protected(u8 reg)
+{
+	return reg == ADDRESS_CONTROL || reg == RESET ||
+		reg == TEST_SELECT || reg == E_EN;
+}
+
+/* The EPROM backed registers SHDW_CTRL opens for writing */
+static bool bq_reg_group3(u8 reg)
+{
+	return reg >= FUNCTION_CONFIG && reg <= 0x4F;
+}
+
+/* Check a BQ_IOC_REGS request and that it fits in one message */
+static int bq_check_regs(const struct bq_reg_op *ops, int n, bool writable)
+{
+	int bytes = 0;
+	int i;
+
+	if (n > bq_ctl.proto.max_packets)
+		return -E2BIG;
+
+	for (i = 0; i < n; i++)
+	{
+		if (ops[i].count == 0)
+		{
+			if (!writable)
+				return -EPERM;
+			if (bq_reg_protected(ops[i].reg))
+				return -EPERM;
+			if (ops[i].address != BROADCAST &&
+			    (ops[i].address < 1 || ops[i].address > devices_used))
+				return -EINVAL;
+			bytes += 4;
+			continue;
+		}
+		if (ops[i].count > BQ_REG_OP_MAX ||
+		    ops[i].address < 1 || ops[i].address > devices_used)
+			return -EINVAL;
+		bytes += 3 + ops[i].count + 1;
+	}
+
+	return bytes > bq_ctl.proto.buff_size ? -E2BIG : 0;
+}
+
+/*
+  Run register operations as one message, they were checked to fit.
+  Called with spi_sem held.
+*/
+static int bq_run_regs(struct bq_reg_op *ops, int n)
+{
+	const u8 *data;
+	bool group3 = false;
+	int first;
+	int status;
+	int i;
+
+	bq_prepare_spi_message();
+	first = bq_ctl.proto.packets;
+	for (i = 0; i < n; i++)
+	{
+		if (ops[i].count == 0)
+		{
+			group3 |= bq_reg_group3(ops[i].reg);
+			status = bq_proto_write(&bq_ctl.proto, ops[i].address,
+						ops[i].reg, ops[i].value);
+		}
+		else
+			status = bq_proto_queue_read(&bq_ctl.proto,
+						     ops[i].address,
+						     ops[i].reg, ops[i].count);
+		if (status < 0)
+			return bq_queued(status);
+	}
+
+	/* config no longer says what the chips have */
+	if (group3)
+		bq_dev.config_verified = -ESTALE;
+
+	status = bq_spi_sync();
+	if (status != 0)
+		return status;
+
+	for (i = 0; i < n; i++)
+	{
+		ops[i].status = 0;
+		if (ops[i].count == 0)
+			continue;
+		ops[i].status = bq_proto_read_data(&bq_ctl.proto, first + i,
+						   &data);
+		if (ops[i].status == 0)
+			memcpy(ops[i].data, data, ops[i].count);
+	}
+	return 0;
+}
+
+static long bq_ioctl_regs(struct file *filp, void __user *argp)
+{
+	struct bq_regs regs;
+	struct bq_reg_op *ops;
+	void __user *user_ops;
+	size_t size;
+	int status;
+
+	if (copy_from_user(&regs, argp, sizeof(regs)))
+		return -EFAULT;
+	if (regs.count == 0)
+		return 0;
+	if (regs.count > BQ_REGS_MAX)
+		return -E2BIG;
+
+	size = regs.count * sizeof(*ops);
+	user_ops = (void __user *)(unsigned long)regs.ops;
+	ops = kmalloc(size, GFP_KERNEL);
+	if (!ops)
+		return -ENOMEM;
+	if (copy_from_user(ops, user_ops, size))
+	{
+		kfree(ops);
+		return -EFAULT;
+	}
+
+	status = bq_bus_get();
+	if (status == 0)
+	{
+		status = bq_check_regs(ops, regs.count,
+				       filp->f_mode & FMODE_WRITE);
+		if (status == 0)
+		{
+			status = bq_run_regs(ops, regs.count);
+			if (status != 0)
+				bq_prepare_spi_message();
+		}
+		bq_bus_put();
+	}
+
+	if (status == 0 && copy_to_user(user_ops, ops, size))
+		status = -EFAULT;
+
+	kfree(ops);
+	return status;
+}
+
+/* Registers a query reads from each chip, first and how many */
+static int bq_query_regs(const struct bq_query *q, u8 *first)
+{
+	int low = ffs(q->cells) - 1;
+	int high = fls(q->cells) - 1;
+	u8 last;
+
+	if (q->cells)
+	{
+		*first = VCELL1 + 2 * low;
+		last = VCELL1 + 2 * high + 1;
+	}
+	else
+	{
+		*first = TEMPERATURE1;
+		last = TEMPERATURE1;
+	}
+	if (q->flags & BQ_QUERY_TEMPERATURE)
+		last = TEMPERATURE2 + 1;
+	if (q->flags & BQ_QUERY_STATUS)
+		*first = DEVICE_STATUS;
+
+	return last - *first + 1;
+}
+
+/*
+  Convert and read the chips a query asks for. Called with spi_sem
+  held, the query was checked.
+*/
+static int bq_run_query(struct bq_query *q)
+{
+	int packet[MAX_BQ_DEVICES+1];
+	const u8 *data;
+	u8 first;
+	int count;
+	int last = 0;
+	int tries = 0;
+	int status;
+	int i;
+	int j;
+
+	count = bq_query_regs(q, &first);
+
+	/* Start the ADC of just these chips */
+	bq_prepare_spi_message();
+	for (i = 1; i < devices_used + 1; i++)
+	{
+		if (!(q->chips & (1 << (i - 1))))
+			continue;
+		status = bq_queued(bq_proto_write(&bq_ctl.proto, i,
+						  ADC_CONVERT, AC_CONV));
+		if (status < 0)
+			return status;
+		last = i;
+	}
+	status = bq_spi_sync();
+	if (status != 0)
+		return status;
+
+	/* The last chip started last */
+	do
+	{
+		bq_prepare_spi_message();
+		status = readRegister(last, DEVICE_STATUS, 1);
+		if (++tries >= DRDY_POLLS)
+		{
+			bq_stats_begin();
+			bq_dev.stats.drdy_timeouts++;
+			bq_stats_end();
+			return -EIO;
+		}
+	} while (status < 0 || (status & DRDY) == 0);
+
+	/* One block read per chip */
+	bq_prepare_spi_message();
+	for (i = 1; i < last + 1; i++)
+	{
+		if (!(q->chips & (1 << (i - 1))))
+			continue;
+		packet[i] = bq_queued(bq_proto_queue_read(&bq_ctl.proto, i,
+							  first, count));
+		if (packet[i] < 0)
+			return packet[i];
+	}
+	status = bq_spi_sync();
+	if (status != 0)
+		return status;
+
+	for (i = 1; i < last + 1; i++)
+	{
+		if (!(q->chips & (1 << (i - 1))))
+			continue;
+		status = bq_proto_read_data(&bq_ctl.proto, packet[i], &data);
+		if (status != 0)
+			return status;
+
+		/* data[0] is register first */
+		for (j = 0; j < BQ_QUERY_CELLS; j++)
+		{
+			const u8 *p = data + VCELL1 + 2 * j - first;
+
+			if (q->cells & (1 << j))
+				q->cell_uv[i-1][j] = bq_cell_uv(p[0] << 8 | p[1]);
+		}
+		if (q->flags & BQ_QUERY_TEMPERATURE)
+		{
+			const u8 *p = data + TEMPERATURE1 - first;
+
+			q->temperature[i-1][0] = bq_temperature(p[0] << 8 | p[1]);
+			q->temperature[i-1][1] = bq_temperature(p[2] << 8 | p[3]);
+		}
+		if (q->flags & BQ_QUERY_STATUS)
+			q->status[i-1] = data[0];
+	}
+	bq_prepare_spi_message();
+
+	return 0;
+}
+
+static long bq_ioctl_query(void __user *argp)
+{
+	struct bq_query *q;
+	ktime_t start = ktime_get();
+	s64 us;
+	int status;
+
+	q = kmalloc(sizeof(*q), GFP_KERNEL);
+	if (!q)
+		return -ENOMEM;
+	if (copy_from_user(q, argp, offsetof(struct bq_query, latency_us)))
+	{
+		kfree(q);
+		return -EFAULT;
+	}
+	memset(&q->latency_us, 0,
+	       sizeof(*q) - offsetof(struct bq_query, latency_us));
+
+	if (q->chips == 0 || (devices_used < 32 &&
+			      q->chips >> devices_used) ||
+	    q->cells >> BQ_QUERY_CELLS ||
+	    (q->cells == 0 && !(q->flags & BQ_QUERY_TEMPERATURE)))
+	{
+		kfree(q);
+		return -EINVAL;
+	}
+
+	/* Tell the scan we are waiting */
+	atomic_inc(&bq_dev.queries);
+	status = bq_bus_get();
+	atomic_dec(&bq_dev.queries);
+	if (status == 0)
+	{
+		status = bq_run_query(q);
+		if (status != 0)
+			bq_prepare_spi_message();
+		bq_bus_put();
+	}
+
+	us = ktime_us_delta(ktime_get(), start);
+	if (status == 0)
+	{
+		bq_hist_add(&bq_dev.query_hist, us);
+		q->latency_us = us;
+		if (copy_to_user(argp, q, sizeof(*q)))
+			status = -EFAULT;
+	}
+
+	kfree(q);
+	return status;
+}
+
+static long bq_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct bq_file *file = filp->private_data;
+	void __user *argp = (void __user *)arg;
+	struct bq_config config;
+	struct bq_config old;
+	int status;
+
+	switch (cmd)
+	{
+	case BQ_IOC_GET_CONFIG:
+		if (down_interruptible(&bq_dev.spi_sem))
+			return -ERESTARTSYS;
+		config = bq_dev.config;
+		up(&bq_dev.spi_sem);
+
+		if (copy_to_user(argp, &config, sizeof(config)))
+			return -EFAULT;
+		return 0;
+
+	case BQ_IOC_SET_CONFIG:
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EPERM;
+		if (copy_from_user(&config, argp, sizeof(config)))
+			return -EFAULT;
+		status = bq_check_config(&config);
+		if (status)
+			return status;
+
+		status = bq_bus_get();
+		if (status)
+			return status;
+		old = bq_dev.config;
+		bq_dev.config = config;
+		status = bq_apply_config();
+		if (status == 0)
+			status = bq_dev.config_verified;
+		if (status != 0)
+		{
+			/* Go back to the settings that were in force */
+			bq_dev.config = old;
+			bq_apply_config();
+		}
+		bq_bus_put();
+		return status;
+
+	case BQ_IOC_REGS:
+		return bq_ioctl_regs(filp, argp);
+
+	case BQ_IOC_QUERY:
+		return bq_ioctl_query(argp);
+
+	case BQ_IOC_TIMING:
+		if (copy_to_user(argp, &file->timing, sizeof(file->timing)))
+			return -EFAULT;
+		return 0;
+
+	default:
+		return -ENOTTY;
+	}
+}
+
+static int bq_probe(struct spi_device *spi_device)
+{
+	int count = 0;
+	int cell_index;
+	int chip_cell_count;
+	int i;
+	int j;
+	int temp;
+	int retval = -EFAULT;
+
+	if (down_interruptible(&bq_dev.spi_sem))
+		return -EBUSY;
+
+	bq_dev.spi_device = spi_device;
+
+	crc8_table = kmalloc(CRC_TABLE_SIZE, GFP_KERNEL);
+	if (!crc8_table) {
+		retval = -ENOMEM;
+		goto bq_probe_error;
+	}
+
+	/* CRC-8, poly = x^8 + x^2 + x^1 + x^0, init = 0
+	   See crc8.h for translation of poly to constant 7
+	*/
+	crc8_populate_msb(crc8_table, BQ_CRC_POLY);
+
+	retval = bq_alloc_spi_buffers(0);
+	if (retval)
+		goto bq_probe_error;
+	retval = -EFAULT;
+
+	bq_dev.devices_expected = devices_used;
+	count = search_pack();
+	if (count == devices_used)
+	{
+ 		dev_info(&bq_dev.spi_device->dev,
+			  "Found %d chips\n", count);
+	}
+	else
+	{
+		/* This is the only effect of not correctly configuring the
+		   pack definition when loading the driver
+		*/
+		dev_alert(&bq_dev.spi_device->dev,
+			  "Expected %d chips found %d\n", devices_used, count);
+		devices_used = count;
+	}
+
+	/* Now the chain is known make room to scan it in one message */
+	if (bq_alloc_spi_buffers(count)) {
+		retval = -ENOMEM;
+		goto bq_probe_error;
+	}
+
+	retval = write_defaults();
+	if (retval == 0 && oversample > 1)
+		retval = bq_set_adc_time(FC_ADCT3);
+	for(i=1; i<count+1; i++)
+		get_chip_status(i);
+	/* Count the cells */
+	total_cell_count = 0;
+	for(i=1; i<count+1; i++)
+	{
+		chip_cell_count = 0;
+		// TODO: make sure all valid cells are 1-x
+		// TODO: set the valid cell mask
+		for(j=VCELL1; j<=VCELL6; j+=2)
+		{
+			bq_prepare_spi_message();
+			temp = readRegister(i, j, 2);
+			dev_alert(&bq_dev.spi_device->dev,
+				  "voltage %d\n", temp);
+			if (temp > CELL_MISSING_THRESHOLD)
+			{
+				total_cell_count++;
+				chip_cell_count++;
+			}
+		}
+		if (cells_per_device[i] != chip_cell_count)
+		{
+			/* This is the only effect of not correctly
+			   configuring the pack definition when
+			   loading the driver
+			*/
+			dev_alert(&bq_dev.spi_device->dev,
+				  " Chip %d expected %d cells found %d\n",
+				  i, cells_per_device[i], chip_cell_count);
+			cells_per_device[i] = chip_cell_count;
+		}
+	}
+
+	cells = kmalloc(total_cell_count*sizeof(cell_t), GFP_KERNEL);
+	if (!cells) {
+		retval = -ENOMEM;
+		goto bq_probe_error;
+	}
+
+	/* Fill in the cell array */
+	cell_index = 0;
+	for(i=1; i<count+1; i++)
+	{
+		for(j=VCELL1; j<=VCELL6; j+=2)
+		{
+			bq_prepare_spi_message();
+			temp = readRegister(i, j, 2);
+			if (temp > CELL_MISSING_THRESHOLD)
+			{
+				cells[cell_index].chip = i;
+				cells[cell_index++].index = j;
+			}
+		}
+	}
+
+	dev_info(&bq_dev.spi_device->dev,
+			  "Total cells = %d\n", total_cell_count);
+
+	bq_dev.record_size = bq_record_size(total_cell_count, count);
+	bq_dev.scan_buff = kmalloc(bq_dev.record_size, GFP_KERNEL);
+	if (!bq_dev.scan_buff) {
+		retval = -ENOMEM;
+		goto bq_probe_error;
+	}
+
+	if (retval == 0)
+	{
+		pm_runtime_set_active(&spi_device->dev);
+		pm_runtime_set_autosuspend_delay(&spi_device->dev,
+						 autosuspend_ms);
+		pm_runtime_use_autosuspend(&spi_device->dev);
+		pm_runtime_mark_last_busy(&spi_device->dev);
+		pm_runtime_enable(&spi_device->dev);
+	}
+
+	if (retval == 0 && scan_interval_ms > 0)
+		retval = bq_start_scans();
+
+	up(&bq_dev.spi_sem);
+ bq_probe_error:
+	if (retval != 0)
+	{
+		bq_free_spi_buffers();
+
+		if (crc8_table)
+			kfree(crc8_table);
+
+		if (bq_dev.scan_buff)
+			kfree(bq_dev.scan_buff);
+
+		if (cells)
+			kfree(cells);
+	}
+
+	return retval;
+}
+
+static int bq_remove(struct spi_device *spi_device)
+{
+	bq_stop_scans();
+
+	pm_runtime_disable(&spi_device->dev);
+	pm_runtime_dont_use_autosuspend(&spi_device->dev);
+	pm_runtime_set_suspended(&spi_device->dev);
+
+	if (down_interruptible(&bq_dev.spi_sem))
+		return -EBUSY;
+
+	bq_dev.spi_device = NULL;
+
+	bq_free_spi_buffers();
+
+	if (crc8_table)
+		kfree(crc8_table);
+
+	if (bq_dev.scan_buff)
+		kfree(bq_dev.scan_buff);
+
+	if (cells)
+		kfree(cells);
+
+	up(&bq_dev.spi_sem);
+
+	return 0;
+}
+
+static int __init add_bq_device_to_bus(void)
+{
+	struct spi_master *spi_master;
+	struct spi_device *spi_device;
+	struct device *pdev;
+	char buff[64];
+	int status = 0;
+
+	spi_master = spi_busnum_to_master(spi_bus);
+	if (!spi_master) {
+		printk(KERN_ALERT
+		       "%s: spi_busnum_to_master(%d) returned NULL\n",
+		       this_driver_name, spi_bus);
+		printk(KERN_ALERT "Missing modprobe omap2_mcspi?\n");
+		return -1;
+	}
+
+	spi_device = spi_alloc_device(spi_master);
+	if (!spi_device) {
+		put_device(&spi_master->dev);
+		printk(KERN_ALERT "%s: spi_alloc_device() failed\n",
+		       this_driver_name);
+		return -1;
+	}
+
+	spi_device->chip_select = SPI_BUS_CS1;
+
+	/* Check whether this SPI bus.cs is already claimed */
+	snprintf(buff, sizeof(buff), "%s.%u",
+			dev_name(&spi_device->master->dev),
+			spi_device->chip_select);
+
+	pdev = bus_find_device_by_name(spi_device->dev.bus, NULL, buff);
+ 	if (pdev) {
+		/* We are not going to use this spi_device, so free it */
+		spi_dev_put(spi_device);
+
+		/*
+		  There is already a device configured for this bus.cs
+		  It is okay if it us, otherwise complain and fail.
+		*/
+		if (pdev->driver && pdev->driver->name &&
+		    strcmp(this_driver_name, pdev->driver->name)) {
+			printk(KERN_ALERT
+			       "Driver [%s] already registered for %s\n",
+			       this_driver_name, buff);
+			status = -1;
+		}
+	} else {
+		spi_device->max_speed_hz = spi_speed_hz;
+		spi_device->mode = SPI_MODE_1;
+		spi_device->bits_per_word = 8;
+		spi_device->irq = -1;
+		spi_device->controller_state = NULL;
+		spi_device->controller_data = NULL;
+		strlcpy(spi_device->modalias, this_driver_name, SPI_NAME_SIZE);
+
+		status = spi_add_device(spi_device);
+		if (status < 0) {
+			spi_dev_put(spi_device);
+			dev_alert(&bq_dev.spi_device->dev,
+				  "spi_add_device() failed: %d\n", status);
+		}
+	}
+
+	put_device(&spi_master->dev);
+
+	return status;
+}
+
+static struct spi_driver bq_driver = {
+	.driver = {
+		.name =	this_driver_name,
+		.owner = THIS_MODULE,
+		.pm = &bq_pm_ops,
+	},
+	.probe = bq_probe,
+	.remove = __devexit_p(bq_remove),
+};
+
+static int __init bq_init_spi(void)
+{
+	int error;
+
+	error = spi_register_driver(&bq_driver);
+	if (error < 0) {
+		printk(KERN_ALERT "%s spi_register_driver() failed %d\n",
+		       this_driver_name, error);
+		goto bq_init_error;
+	}
+
+	error = add_bq_device_to_bus();
+	if (error < 0) {
+		printk(KERN_ALERT "%s: add_bq_to_bus() failed\n",
+		       this_driver_name);
+		spi_unregister_driver(&bq_driver);
+		goto bq_init_error;
+	}
+
+	return 0;
+
+bq_init_error:
+
+	bq_free_spi_buffers();
+
+	return error;
+}
+
+static const struct file_operations bq_fops = {
+	.owner =	THIS_MODULE,
+	.read = 	bq_read,
+	.poll =		bq_poll,
+	.unlocked_ioctl = bq_ioctl,
+	/* The structures are the same for 32 bit programs */
+	.compat_ioctl =	bq_ioctl,
+	.open =		bq_open,
+	.release =	bq_release,
+};
+
+static int __init bq_init_cdev(void)
+{
+	int error;
+
+	bq_dev.devt = MKDEV(0, 0);
+
+	error = alloc_chrdev_region(&bq_dev.devt, 0, 1, this_driver_name);
+	if (error < 0) {
+		printk(KERN_ALERT "%s: alloc_chrdev_region() failed: %d \n",
+		       this_driver_name, error);
+		return -1;
+	}
+
+	cdev_init(&bq_dev.cdev, &bq_fops);
+	bq_dev.cdev.owner = THIS_MODULE;
+
+	error = cdev_add(&bq_dev.cdev, bq_dev.devt, 1);
+	if (error) {
+		printk(KERN_ALERT "%s: cdev_add() failed: %d\n",
+		       this_driver_name, error);
+		unregister_chrdev_region(bq_dev.devt, 1);
+		return -1;
+	}
+
+	return 0;
+}
+
+static ssize_t scan_state_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%s\n", bq_rate_names[bq_dev.rate]);
+}
+
+static ssize_t scan_interval_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%d\n", bq_rate_interval(bq_dev.rate));
+}
+
+/* Milliseconds spent at each scan rate, like cpufreq time_in_state */
+static ssize_t time_in_state_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	u64 time[RATE_COUNT];
+	ssize_t len = 0;
+	int i;
+
+	spin_lock(&bq_dev.rate_lock);
+	memcpy(time, bq_dev.rate_time, sizeof(time));
+	time[bq_dev.rate] += jiffies - bq_dev.rate_since;
+	spin_unlock(&bq_dev.rate_lock);
+
+	for (i = 0; i < RATE_COUNT; i++)
+		len += sprintf(buf + len, "%s %u\n", bq_rate_names[i],
+			       jiffies_to_msecs(time[i]));
+
+	return len;
+}
+
+static ssize_t wake_latency_us_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lld\n", bq_dev.wake_latency_us);
+}
+
+static ssize_t wake_latency_max_us_show(struct device *dev,
+					struct device_attribute *attr,
+					char *buf)
+{
+	return sprintf(buf, "%lld\n", bq_dev.wake_latency_max_us);
+}
+
+static ssize_t overruns_show(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%llu\n", bq_dev.overruns);
+}
+
+static ssize_t convert_skew_ns_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u %u\n", bq_dev.convert_skew_ns,
+		       bq_dev.convert_skew_max_ns);
+}
+
+/* All the totals from one consistent copy */
+static ssize_t link_stats_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct bq_stats *copy;
+	struct bq_link_counters *c;
+	ssize_t len;
+
+	copy = kmalloc(sizeof(*copy), GFP_KERNEL);
+	if (!copy)
+		return -ENOMEM;
+	bq_stats_copy(copy);
+
+	c = &copy->total;
+	len = sprintf(buf,
+		      "scans %llu\n"
+		      "messages %llu\n"
+		      "transfers %llu\n"
+		      "bytes %llu\n"
+		      "crc_errors %llu\n"
+		      "spi_errors %llu\n"
+		      "drdy_timeouts %llu\n"
+		      "retries %llu\n"
+		      "address_lost %llu\n"
+		      "faults %llu\n"
+		      "alerts %llu\n"
+		      "over_budget %llu\n"
+		      "chain_resets %llu\n",
+		      copy->scans, copy->messages, c->transfers, c->bytes,
+		      c->crc_errors, c->spi_errors, copy->drdy_timeouts,
+		      c->retries, c->address_lost, c->faults, c->alerts,
+		      copy->over_budget, copy->chain_resets);
+
+	kfree(copy);
+	return len;
+}
+
+/* The protection settings and the result of the last check */
+static ssize_t config_show(struct device *dev,
+			   struct device_attribute *attr, char *buf)
+{
+	struct bq_config c;
+	int verified;
+
+	if (down_interruptible(&bq_dev.spi_sem))
+		return -ERESTARTSYS;
+	c = bq_dev.config;
+	verified = bq_dev.config_verified;
+	up(&bq_dev.spi_sem);
+
+	return sprintf(buf,
+		       "cov %02x\n"
+		       "covt %02x\n"
+		       "cuv %02x\n"
+		       "cutv %02x\n"
+		       "ot %02x\n"
+		       "ott %02x\n"
+		       "verified %d\n",
+		       c.cov, c.covt, c.cuv, c.cutv, c.ot, c.ott, verified);
+}
+
+static DEVICE_ATTR(scan_state, S_IRUGO, scan_state_show, NULL);
+static DEVICE_ATTR(scan_interval, S_IRUGO, scan_interval_show, NULL);
+static DEVICE_ATTR(time_in_state, S_IRUGO, time_in_state_show, NULL);
+static DEVICE_ATTR(wake_latency_us, S_IRUGO, wake_latency_us_show, NULL);
+static DEVICE_ATTR(wake_latency_max_us, S_IRUGO,
+		   wake_latency_max_us_show, NULL);
+static DEVICE_ATTR(overruns, S_IRUGO, overruns_show, NULL);
+static DEVICE_ATTR(convert_skew_ns, S_IRUGO, convert_skew_ns_show, NULL);
+static DEVICE_ATTR(link_stats, S_IRUGO, link_stats_show, NULL);
+static DEVICE_ATTR(config, S_IRUGO, config_show, NULL);
+
+static u32 bq_diag_errors(const struct bq_diag_result *r)
+{
+	return r->crc_errors + r->bad_values + r->spi_errors;
+}
+
+static ssize_t link_diag_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	const struct bq_diag *d = &bq_dev.diag;
+	const struct bq_diag_result *r;
+	size_t size = PAGE_SIZE;
+	int len = 0;
+	int worst;
+	u32 rise;
+	u32 most;
+	int s;
+	int i;
+
+	if (down_interruptible(&bq_dev.spi_sem))
+		return -ERESTARTSYS;
+
+	if (d->status)
+	{
+		up(&bq_dev.spi_sem);
+		return sprintf(buf, "status %d\n", d->status);
+	}
+
+	/* errors/reads and the time per read of each chip at each speed */
+	len += scnprintf(buf + len, size - len, "chip");
+	for (s = 0; s < d->speeds; s++)
+		len += scnprintf(buf + len, size - len, " %10u Hz   ",
+				 d->speed_hz[s]);
+	len += scnprintf(buf + len, size - len, "\n");
+	for (i = 1; i < d->chips + 1; i++)
+	{
+		len += scnprintf(buf + len, size - len, "%4d", i);
+		for (s = 0; s < d->speeds; s++)
+		{
+			r = &d->chip[s][i];
+			len += scnprintf(buf + len, size - len,
+					 " %5u/%-5u %4uus", bq_diag_errors(r),
+					 r->reads, r->reads ? r->us / r->reads : 0);
+		}
+		len += scnprintf(buf + len, size - len, "\n");
+	}
+
+	/* The link where the errors go up the most, 0 is the host */
+	for (s = 0; s < d->speeds; s++)
+	{
+		worst = 0;
+		most = 0;
+		for (i = 1; i < d->chips + 1; i++)
+		{
+			rise = bq_diag_errors(&d->chip[s][i]);
+			if (i > 1)
+				rise -= min(rise,
+					    bq_diag_errors(&d->chip[s][i-1]));
+			if (rise > most)
+			{
+				most = rise;
+				worst = i;
+			}
+		}
+		if (worst)
+			len += scnprintf(buf + len, size - len,
+					 "%u Hz: link %d-%d degraded, "
+					 "%u more errors\n", d->speed_hz[s],
+					 worst - 1, worst, most);
+		else
+			len += scnprintf(buf + len, size - len,
+					 "%u Hz: all links good\n",
+					 d->speed_hz[s]);
+	}
+
+	if (d->chips < d->expected)
+		len += scnprintf(buf + len, size - len,
+				 "break: %d of %d chips found, link %d-%d "
+				 "open or chip %d dead\n", d->chips,
+				 d->expected, d->chips, d->chips + 1,
+				 d->chips + 1);
+	len += scnprintf(buf + len, size - len, "config %d\n", d->config);
+
+	up(&bq_dev.spi_sem);
+
+	return len;
+}
+
+static ssize_t link_diag_store(struct device *dev,
+			       struct device_attribute *attr,
+			       const char *buf, size_t count)
+{
+	int status;
+
+	status = bq_bus_get();
+	if (status)
+		return status;
+	status = bq_link_diag();
+	bq_bus_put();
+
+	return status ? status : count;
+}
+
+static DEVICE_ATTR(link_diag, S_IRUGO | S_IWUSR, link_diag_show,
+		   link_diag_store);
+
+static struct attribute *bq_attrs[] = {
+	&dev_attr_scan_state.attr,
+	&dev_attr_scan_interval.attr,
+	&dev_attr_time_in_state.attr,
+	&dev_attr_wake_latency_us.attr,
+	&dev_attr_wake_latency_max_us.attr,
+	&dev_attr_overruns.attr,
+	&dev_attr_convert_skew_ns.attr,
+	&dev_attr_link_stats.attr,
+	&dev_attr_link_diag.attr,
+	&dev_attr_config.attr,
+	NULL
+};
+
+static const struct attribute_group bq_attr_group = {
+	.attrs = bq_attrs,
+};
+
+static int __init bq_init_class(void)
+{
+	bq_dev.class = class_create(THIS_MODULE, this_driver_name);
+
+	if (!bq_dev.class) {
+		printk(KERN_ALERT "%s: class_create() failed\n",
+		       this_driver_name);
+		return -1;
+	}
+
+	bq_dev.device = device_create(bq_dev.class, NULL, bq_dev.devt, NULL,
+				      this_driver_name);
+	if (!bq_dev.device) {
+		printk(KERN_ALERT "device_create(..., %s) failed\n",
+			this_driver_name);
+		class_destroy(bq_dev.class);
+		return -1;
+	}
+
+	if (sysfs_create_group(&bq_dev.device->kobj, &bq_attr_group)) {
+		printk(KERN_ALERT "%s: sysfs_create_group() failed\n",
+			this_driver_name);
+		device_destroy(bq_dev.class, bq_dev.devt);
+		class_destroy(bq_dev.class);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* The CONV line idles low, conversions start on the rising edge */
+static int __init bq_init_conv(void)
+{
+	int error;
+
+	if (conv_gpio < 0)
+		return 0;
+
+	error = gpio_request(conv_gpio, this_driver_name);
+	if (error < 0) {
+		printk(KERN_ALERT "%s: gpio_request(%d) failed: %d\n",
+		       this_driver_name, conv_gpio, error);
+		return error;
+	}
+
+	error = gpio_direction_output(conv_gpio, 0);
+	if (error < 0) {
+		printk(KERN_ALERT "%s: gpio_direction_output(%d) failed: %d\n",
+		       this_driver_name, conv_gpio, error);
+		gpio_free(conv_gpio);
+		return error;
+	}
+
+	return 0;
+}
+
+static void bq_free_conv(void)
+{
+	if (conv_gpio >= 0)
+		gpio_free(conv_gpio);
+}
+
+static int __init bq_init(void)
+{
+	int i;
+
+	/* Validate the configuration data
+	   Don't register the device if this is not valid
+	*/
+	// TODO: is this needed???
+	for (i=1; i<devices_used+1; i++) {
+		if ((cells_per_device[i] != 3) &&
+		    (cells_per_device[i] != 4) &&
+		    (cells_per_device[i] != 5) &&
+		    (cells_per_device[i] != 6)) {
+			printk(KERN_ALERT
+	 		       "%s: cellsPerDevice %d is not 3..6\n",
+			       this_driver_name, cells_per_device[i]);
+			goto fail_1;
+		}
+	}
+
+	memset(&bq_dev, 0, sizeof(bq_dev));
+	memset(&bq_ctl, 0, sizeof(bq_ctl));
+
+	sema_init(&bq_dev.spi_sem, 1);
+	sema_init(&bq_dev.fop_sem, 1);
+	sema_init(&bq_dev.sample_sem, 1);
+	atomic_set(&bq_dev.queries, 0);
+	init_waitqueue_head(&bq_dev.sample_wait);
+	spin_lock_init(&bq_dev.rate_lock);
+	bq_dev.rate = RATE_NORMAL;
+	bq_dev.rate_since = jiffies;
+	bq_dev.config = bq_default_config;
+	bq_dev.config_verified = -ENODATA;
+	bq_dev.diag.status = -ENODATA;
+	bq_debugfs_init();
+	INIT_DELAYED_WORK(&bq_dev.scan_work, bq_scan_work);
+
+	if (bq_init_cdev() < 0)
+		goto fail_1;
+
+	if (bq_init_class() < 0)
+		goto fail_2;
+
+	if (bq_nl_init() < 0)
+		goto fail_3;
+
+	if (bq_init_conv() < 0)
+		goto fail_4;
+
+	if (bq_init_spi() < 0)
+		goto fail_5;
+
+	return 0;
+
+fail_5:
+	bq_free_conv();
+
+fail_4:
+	genl_unregister_family(&bq_nl_family);
+
+fail_3:
+	sysfs_remove_group(&bq_dev.device->kobj, &bq_attr_group);
+	device_destroy(bq_dev.class, bq_dev.devt);
+	class_destroy(bq_dev.class);
+
+fail_2:
+	cdev_del(&bq_dev.cdev);
+	unregister_chrdev_region(bq_dev.devt, 1);
+
+fail_1:
+	debugfs_remove_recursive(bq_dev.debugfs);
+	return -1;
+}
+module_init(bq_init);
+
+static void __exit bq_exit(void)
+{
+	spi_unregister_device(bq_dev.spi_device);
+	spi_unregister_driver(&bq_driver);
+	bq_free_conv();
+
+	genl_unregister_family(&bq_nl_family);
+
+	sysfs_remove_group(&bq_dev.device->kobj, &bq_attr_group);
+	device_destroy(bq_dev.class, bq_dev.devt);
+	class_destroy(bq_dev.class);
+
+	cdev_del(&bq_dev.cdev);
+	unregister_chrdev_region(bq_dev.devt, 1);
+
+	if (bq_dev.user_buff)
+		kfree(bq_dev.user_buff);
+
+	debugfs_remove_recursive(bq_dev.debugfs);
+}
+module_exit(bq_exit);
+
+MODULE_AUTHOR("Scott Ellis");
+MODULE_DESCRIPTION("Driver for Texas Instruments BQ76PL536");
+MODULE_LICENSE("GPL");
+MODULE_VERSION("0.2");
+
@@ -0,0 +1,313 @@
+/*
+  bq76pl536_proto.c
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+  The protocol core, see bq76pl536_proto.h. Nothing in here knows about
+  the kernel or SPI so the same file builds into the module and into
+  the host library in testing/.
+*/
+#ifdef __KERNEL__
+#include <linux/string.h>
+#else
+#include <string.h>
+#endif
+#include "bq76pl536_proto.h"
+
+/* Same table crc8_populate_msb() makes in the kernel */
+void bq_crc8_populate(u8 *table)
+{
+	int i;
+	int bit;
+	u8 crc;
+
+	for (i = 0; i < 256; i++)
+	{
+		crc = i;
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc & 0x80) ? (crc << 1) ^ BQ_CRC_POLY : crc << 1;
+		table[i] = crc;
+	}
+}
+
+u8 bq_crc8(const u8 *table, const u8 *p, int len, u8 crc)
+{
+	while (len-- > 0)
+		crc = table[crc ^ *p++];
+	return crc;
+}
+
+void bq_proto_init(struct bq_proto *proto, const struct bq_proto_ops *ops,
+		   const u8 *crc_table, u8 *tx, u8 *rx, int buff_size,
+		   struct bq_packet *packet, int max_packets)
+{
+	proto->ops = ops;
+	proto->crc_table = crc_table;
+	proto->tx = tx;
+	proto->rx = rx;
+	proto->buff_size = buff_size;
+	proto->packet = packet;
+	proto->max_packets = max_packets;
+	proto->packets = 0;
+	proto->sent = 0;
+	proto->bytes = 0;
+}
+
+/* Start a new chain of packets */
+void bq_proto_reset(struct bq_proto *proto)
+{
+	memset(proto->rx, 0, proto->bytes);
+	proto->packets = 0;
+	proto->sent = 0;
+	proto->bytes = 0;
+}
+
+/* Room for a packet of len bytes, NULL when the buffers are full */
+static struct bq_packet *bq_proto_add(struct bq_proto *proto, int len,
+				      bool read)
+{
+	struct bq_packet *packet;
+
+	if (proto->packets >= proto->max_packets ||
+	    proto->bytes + len > proto->buff_size)
+		return NULL;
+
+	packet = &proto->packet[proto->packets++];
+	packet->tx = &proto->tx[proto->bytes];
+	packet->rx = read ? &proto->rx[proto->bytes] : NULL;
+	packet->len = len;
+	proto->bytes += len;
+
+	return packet;
+}
+
+int bq_proto_write(struct bq_proto *proto, u8 address, u8 reg, u8 data)
+{
+	struct bq_packet *packet = bq_proto_add(proto, 4, false);
+
+	if (!packet)
+		return -ENOSPC;
+
+	/* Shift the address over and add the write bit */
+	packet->tx[0] = address << 1 | 1;
+	packet->tx[1] = reg;
+	packet->tx[2] = data;
+	packet->tx[3] = bq_crc8(proto->crc_table, packet->tx, 3, 0);
+
+	return 0;
+}
+
+/*
+  Queue a read of count registers starting at reg. Returns the packet
+  index to give bq_proto_read_data() once the message has run.
+*/
+int bq_proto_queue_read(struct bq_proto *proto, u8 address, u8 reg,
+			int count)
+{
+	struct bq_packet *packet;
+
+	if (count < 1 || count > 0x7F)
+		return -EINVAL;
+
+	/* Header, the registers and the CRC. There is no need to pad
+	   with zeros, the chip does not look at them.
+	*/
+	packet = bq_proto_add(proto, 3 + count + 1, true);
+	if (!packet)
+		return -ENOSPC;
+
+	/* Shift the address over and leave zero for read bit */
+	packet->tx[0] = address << 1;
+	packet->tx[1] = reg;
+	packet->tx[2] = count;
+
+	return proto->packets - 1;
+}
+
+/* Send everything queued since the last run */
+int bq_proto_run(struct bq_proto *proto)
+{
+	int first = proto->sent;
+	int status;
+
+	if (first == proto->packets)
+		return 0;
+
+	status = proto->ops->transfer(proto, first, proto->packets - first);
+	proto->sent = proto->packets;
+
+	return status;
+}
+
+/*
+  Check the CRC of a read that has run. A read that fails is run again
+  on its own while the crc_error op says so.
+*/
+int bq_proto_read_data(struct bq_proto *proto, int index, const u8 **data)
+{
+	struct bq_packet *packet = &proto->packet[index];
+	int count = packet->len - 4;
+	u8 crc;
+	int status;
+	int tries;
+
+	for (tries = 0; ; tries++)
+	{
+		crc = bq_crc8(proto->crc_table, packet->tx, 3, 0);
+		crc = bq_crc8(proto->crc_table, packet->rx + 3, count, crc);
+		if (crc == packet->rx[count + 3])
+		{
+			*data = packet->rx + 3;
+			return 0;
+		}
+
+		if (!proto->ops->crc_error ||
+		    !proto->ops->crc_error(proto, packet, crc, tries))
+			return -EFAULT;
+
+		status = proto->ops->transfer(proto, index, 1);
+		if (status)
+			return status;
+	}
+}
+
+/*
+  Read a register or a register pair. This runs the chain of writes
+  queued before it and starts a new chain. Returns the value.
+*/
+int bq_proto_read(struct bq_proto *proto, u8 address, u8 reg, int count)
+{
+	const u8 *result;
+	int index;
+	int val;
+
+	if ((count != 1) && (count != 2))
+		return -EINVAL;
+
+	index = bq_proto_queue_read(proto, address, reg, count);
+	if (index < 0)
+		return index;
+
+	val = bq_proto_run(proto);
+	if (val == 0)
+		val = bq_proto_read_data(proto, index, &result);
+	if (val == 0)
+		val = count == 1 ? result[0] : result[0] << 8 | result[1];
+
+	/* Start a new chain so the buffers do not fill up */
+	bq_proto_reset(proto);
+
+	return val;
+}
+
+/*
+  Give the chips addresses 1..n in chain order. Every pass resets the
+  chain and addresses one more chip until max_chips answer or one does
+  not. Returns how many chips answered.
+*/
+int bq_proto_search(struct bq_proto *proto, int max_chips)
+{
+	int look_for = 0;
+	int verify;
+	int status;
+	int n;
+
+	bq_proto_reset(proto);
+	do
+	{
+		status = bq_proto_write(proto, BROADCAST, RESET,
+					RESET_COMMAND);
+		if (status != 0)
+			return status;
+		look_for++;
+		n = 0;
+		do
+		{
+			n++;
+			status = bq_proto_write(proto, DISCOVERY_ADDR,
+						ADDRESS_CONTROL, n);
+			if (status != 0)
+				return status;
+			verify = bq_proto_read(proto, n, ADDRESS_CONTROL, 1);
+			if (verify != (n | AC_ADDR_RQST))
+				return n-1;
+		} while (n < look_for);
+	} while (n < max_chips);
+
+	return n;
+}
+
+/*
+  Queue the reads for a scan of chips 1..chips. Returns the index of
+  the first packet to give bq_proto_decode_chip().
+*/
+int bq_proto_queue_scan(struct bq_proto *proto, int chips)
+{
+	int first = proto->packets;
+	int status;
+	int i;
+
+	for (i = 1; i < chips + 1; i++)
+	{
+		status = bq_proto_queue_read(proto, i, DEVICE_STATUS,
+					     BQ_CHIP_DATA_REGS);
+		if (status >= 0)
+			status = bq_proto_queue_read(proto, i, ALERT_STATUS,
+						     BQ_CHIP_STATUS_REGS);
+		if (status < 0)
+			return status;
+	}
+
+	return first;
+}
+
+/* A register pair from a block read that started at DEVICE_STATUS */
+static u16 bq_reg16(const u8 *data, u8 reg)
+{
+	return data[reg] << 8 | data[reg+1];
+}
+
+/* Decode one chip (1..n) of a scan queued at first and run */
+int bq_proto_decode_chip(struct bq_proto *proto, int first, int chip,
+			 struct bq_chip_regs *regs)
+{
+	const u8 *data;
+	const u8 *status;
+	int index = first + BQ_SCAN_PACKETS(chip - 1);
+	int error;
+	int i;
+
+	error = bq_proto_read_data(proto, index, &data);
+	if (error == 0)
+		error = bq_proto_read_data(proto, index + 1, &status);
+	if (error)
+		return error;
+
+	regs->status = data[DEVICE_STATUS];
+	regs->gpai = bq_reg16(data, GPAI);
+	for (i = 0; i < 6; i++)
+		regs->cell[i] = bq_reg16(data, VCELL1 + 2*i);
+	regs->temperature[0] = bq_reg16(data, TEMPERATURE1);
+	regs->temperature[1] = bq_reg16(data, TEMPERATURE2);
+
+	regs->alert = status[ALERT_STATUS - ALERT_STATUS];
+	regs->fault = status[FAULT_STATUS - ALERT_STATUS];
+	regs->cov = status[COV_FAULT - ALERT_STATUS];
+	regs->cuv = status[CUV_FAULT - ALERT_STATUS];
+
+	return 0;
+}
@@ -0,0 +1,123 @@
+/*
+  bq76pl536_proto.h
+
+  The bq76pl536 wire protocol without the wire: packet framing, CRC,
+  address assignment and decoding a scan. The driver runs it over
+  spi_sync, testing/ builds it into a library that runs over whatever
+  transfer function the program gives it.
+
+  Packets are queued into buffers that belong to the caller and sent
+  as one message by bq_proto_run(). Each packet is its own chip select.
+  Functions return 0 or a negative errno unless they say otherwise.
+*/
+#ifndef BQ76PL536_PROTO_H
+#define BQ76PL536_PROTO_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/errno.h>
+#else
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+#endif
+
+#include "bq76pl536.h"
+
+/* A scan reads DEVICE_STATUS..TEMPERATURE2 and ALERT_STATUS..CUV_FAULT
+   from each chip as two block reads. Each read is 3 header bytes, the
+   data and a CRC.
+*/
+#define BQ_CHIP_DATA_REGS	(TEMPERATURE2 + 2 - DEVICE_STATUS)
+#define BQ_CHIP_STATUS_REGS	(CUV_FAULT + 1 - ALERT_STATUS)
+#define BQ_SCAN_PACKETS(chips)	(2 * (chips))
+#define BQ_SCAN_BYTES(chips)	\
+	((chips) * (4 + BQ_CHIP_DATA_REGS + 4 + BQ_CHIP_STATUS_REGS))
+
+/* CRC-8, poly = x^8 + x^2 + x^1 + x^0, init = 0 */
+#define BQ_CRC_POLY		0x07
+
+/* One packet, one chip select */
+struct bq_packet {
+	u8 *tx;
+	u8 *rx;		/* NULL for a write */
+	int len;
+};
+
+struct bq_proto;
+
+struct bq_proto_ops {
+	/* Send packet[first] .. packet[first+count-1] as one message */
+	int (*transfer)(struct bq_proto *proto, int first, int count);
+
+	/* Optional. A read failed its CRC, crc is what it should have
+	   been, tries how often it was run again already. Return true to
+	   run it again.
+	*/
+	bool (*crc_error)(struct bq_proto *proto,
+			  const struct bq_packet *packet, u8 crc, int tries);
+};
+
+struct bq_proto {
+	const struct bq_proto_ops *ops;
+	void *priv;			/* For the caller		*/
+	const u8 *crc_table;		/* 256 entries, MSB first	*/
+
+	u8 *tx;
+	u8 *rx;
+	int buff_size;
+	struct bq_packet *packet;
+	int max_packets;
+
+	int packets;			/* Queued			*/
+	int sent;			/* Already run			*/
+	int bytes;			/* Used in tx and rx		*/
+};
+
+/* Raw register values of one chip from a scan */
+struct bq_chip_regs {
+	u8 status;
+	u8 alert;
+	u8 fault;
+	u8 cov;
+	u8 cuv;
+	u16 gpai;
+	u16 cell[6];
+	u16 temperature[2];
+};
+
+void bq_crc8_populate(u8 *table);
+u8 bq_crc8(const u8 *table, const u8 *p, int len, u8 crc);
+
+void bq_proto_init(struct bq_proto *proto, const struct bq_proto_ops *ops,
+		   const u8 *crc_table, u8 *tx, u8 *rx, int buff_size,
+		   struct bq_packet *packet, int max_packets);
+void bq_proto_reset(struct bq_proto *proto);
+
+int bq_proto_write(struct bq_proto *proto, u8 address, u8 reg, u8 data);
+int bq_proto_queue_read(struct bq_proto *proto, u8 address, u8 reg,
+			int count);
+int bq_proto_run(struct bq_proto *proto);
+int bq_proto_read_data(struct bq_proto *proto, int index, const u8 **data);
+int bq_proto_read(struct bq_proto *proto, u8 address, u8 reg, int count);
+
+int bq_proto_search(struct bq_proto *proto, int max_chips);
+int bq_proto_queue_scan(struct bq_proto *proto, int chips);
+int bq_proto_decode_chip(struct bq_proto *proto, int first, int chip,
+			 struct bq_chip_regs *regs);
+
+/* Conversions the driver uses, raw ADC counts to volts */
+static inline u32 bq_cell_uv(u16 raw)
+{
+	return (raw * 6250000ULL) / 16383;
+}
+
+static inline int bq_gpai_mv(u16 raw)
+{
+	return (raw * 2500) / 16383;
+}
+
+#endif /* BQ76PL536_PROTO_H */
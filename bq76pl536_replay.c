@@ -0,0 +1,833 @@
+/*
+  bq76pl536_replay.c
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+  A stand in for /dev/bq76pl536 to load test the programs that read
+  it. Creates /dev/bq76pl536_replay which hands out records in the same
+  format as the driver, CRC included, at a set rate or as fast as they
+  can be read. No pack, SPI bus or driver is needed.
+
+  insmod bq76pl536_replay.ko rate_hz=1000 cells=6,6,6,6
+
+  Every read returns one full record, like a delta_mode reader of the
+  driver that is only ever sent keyframes. A read blocks until the next
+  record is due, poll and O_NONBLOCK work. Every open file gets its own
+  stream of records starting when it is opened.
+
+  Records come from the synthetic chain given by cells, one entry per
+  chip, unless records were written to the device. Writing a capture of
+  the driver, records back to back as cat /dev/bq76pl536 gives them,
+  replaces the synthetic chain and the records are played in a loop.
+  Open with O_TRUNC (cat capture > /dev/bq76pl536_replay) to start over.
+  Records with a bad CRC are refused, delta records are not replayed.
+
+  Everything below can be changed while it is running through
+  /sys/module/bq76pl536_replay/parameters.
+    rate_hz          Records per second for each reader
+    jitter_us        Each record is due up to this much early or late,
+                     at most half the period
+    max_speed        Ignore rate_hz, a record is always ready
+    default_mv       Synthetic cells move swing_mv around default_mv
+    swing_mv         over 256 records, each cell a bit behind the last,
+    noise_mv         with +/- noise_mv of random noise on top
+    temperature_c    Both thermistors on every synthetic chip
+    sample_bits      8 for full records, 9..16 for extended records
+    crc_error_every  Corrupt the CRC of every nth record, 0 for never
+    fault_every      Every nth record shows fault_bits in FAULT_STATUS
+    fault_chip       of this chip with DS_FAULT set in its status
+    fault_bits
+
+  Consumer lag
+
+  The driver only keeps the latest scan, so a reader that falls more
+  than a period behind misses records. The replay does the same and
+  counts them. The lag of a read is how long after its record was due
+  it came. stats in /sys/class/bq76pl536_replay/bq76pl536_replay has
+  the records served and missed, the last, average and worst lag and
+  the records per second served since the stats were cleared. Write
+  to it to clear them.
+*/
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/device.h>
+#include <linux/cdev.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/string.h>
+#include <linux/sched.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/spinlock.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/random.h>
+#include <linux/crc8.h>
+#include <asm/uaccess.h>
+#include "bq76pl536.h"
+#include "bq76pl536_user.h"
+
+#define REPLAY_MAX_CHIPS	32
+#define REPLAY_MAX_CELLS	(REPLAY_MAX_CHIPS * 6)
+#define REPLAY_CRC_POLY		7
+
+/* An extended record of the longest chain */
+#define REPLAY_RECORD_MAX \
+	(2 + 1 + REPLAY_MAX_CELLS * 2 + 1 + REPLAY_MAX_CHIPS * 8 + 1)
+
+static const char this_driver_name[] = "bq76pl536_replay";
+
+/* Cells on each synthetic chip, the number of entries is the chips */
+static int cells[REPLAY_MAX_CHIPS] = { 6, 6, 6 };
+static int chips = 3;
+
+module_param_array(cells, int, &chips, S_IRUGO);
+
+/* Size of the buffer for written records */
+static int replay_kb = 1024;
+
+module_param(replay_kb, int, S_IRUGO);
+
+/* Pacing, see the top of this file */
+static int rate_hz = 10;
+static int jitter_us = 0;
+static bool max_speed = 0;
+
+module_param(rate_hz, int, S_IRUGO | S_IWUSR);
+module_param(jitter_us, int, S_IRUGO | S_IWUSR);
+module_param(max_speed, bool, S_IRUGO | S_IWUSR);
+
+/* The synthetic chain, see the top of this file */
+static int default_mv = 3300;
+static int swing_mv = 50;
+static int noise_mv = 5;
+static int temperature_c = 20;
+static int sample_bits = 8;
+
+module_param(default_mv, int, S_IRUGO | S_IWUSR);
+module_param(swing_mv, int, S_IRUGO | S_IWUSR);
+module_param(noise_mv, int, S_IRUGO | S_IWUSR);
+module_param(temperature_c, int, S_IRUGO | S_IWUSR);
+module_param(sample_bits, int, S_IRUGO | S_IWUSR);
+
+/* Fault injection, see the top of this file */
+static int crc_error_every = 0;
+static int fault_every = 0;
+static int fault_chip = 1;
+static int fault_bits = FS_COV;
+
+module_param(crc_error_every, int, S_IRUGO | S_IWUSR);
+module_param(fault_every, int, S_IRUGO | S_IWUSR);
+module_param(fault_chip, int, S_IRUGO | S_IWUSR);
+module_param(fault_bits, int, S_IRUGO | S_IWUSR);
+
+DECLARE_CRC8_TABLE(replay_crc8_table);
+
+/* Where the parts of a record are */
+struct replay_layout {
+	int len;
+	int chips;
+	int chip_at;		/* First chip group			*/
+};
+
+struct replay_stats {
+	int readers;
+	u64 served;
+	u64 missed;
+	u64 crc_errors;
+	u64 faults;
+	s64 lag_us;
+	s64 lag_max_us;
+	s64 lag_total_us;
+	ktime_t since;
+};
+
+struct replay_file {
+	struct semaphore sem;
+	wait_queue_head_t wait;
+	struct hrtimer timer;
+
+	u64 next;		/* Number of the next record		*/
+	ktime_t nominal;	/* When it is due without jitter	*/
+	ktime_t due;
+	size_t offset;		/* Of the next one in the written records */
+	u32 generation;		/* Of the written records offset is in	*/
+
+	u8 buff[REPLAY_RECORD_MAX];
+};
+
+struct replay_dev {
+	dev_t devt;
+	struct cdev cdev;
+	struct class *class;
+	struct device *device;
+
+	/* Written records. replay_len bytes are checked records, the
+	   rest up to fill is the start of one not written completely.
+	*/
+	struct semaphore replay_sem;
+	u8 *replay_buf;
+	size_t replay_size;
+	size_t replay_len;
+	size_t replay_fill;
+	u32 replay_count;
+	u32 replay_generation;	/* Counts O_TRUNC opens			*/
+
+	spinlock_t stats_lock;
+	struct replay_stats stats;
+};
+
+static struct replay_dev replay_dev;
+
+/*
+  Find the parts of the record at p. Returns its length, -EAGAIN when
+  avail is too short to tell and -EINVAL when it is not a full or
+  extended record.
+*/
+static int replay_parse(const u8 *p, size_t avail, struct replay_layout *l)
+{
+	size_t at = 0;
+	int size = 1;
+	int cell_count;
+
+	if (avail < 1)
+		return -EAGAIN;
+	if (p[0] == BQ_RECORD_DELTA || p[0] == BQ_RECORD_EXTENDED_DELTA)
+		return -EINVAL;
+	if (p[0] == BQ_RECORD_EXTENDED)
+	{
+		if (avail < 2)
+			return -EAGAIN;
+		if (p[1] < 9 || p[1] > 16)
+			return -EINVAL;
+		size = 2;
+		at = 2;
+	}
+
+	if (at >= avail)
+		return -EAGAIN;
+	cell_count = p[at++];
+	if (cell_count > REPLAY_MAX_CELLS)
+		return -EINVAL;
+	at += cell_count * size;
+
+	if (at >= avail)
+		return -EAGAIN;
+	l->chips = p[at++];
+	if (l->chips > REPLAY_MAX_CHIPS)
+		return -EINVAL;
+	l->chip_at = at;
+	at += l->chips * 8;
+
+	/* The CRC */
+	if (at >= avail)
+		return -EAGAIN;
+	l->len = at + 1;
+
+	return l->len;
+}
+
+static s64 replay_period_ns(void)
+{
+	return NSEC_PER_SEC / max(rate_hz, 1);
+}
+
+/* Up to jitter_us either way, never more than half the period */
+static s64 replay_jitter_ns(void)
+{
+	s64 limit = min_t(s64, (s64)jitter_us * NSEC_PER_USEC,
+			  replay_period_ns() / 2);
+
+	if (limit <= 0)
+		return 0;
+	return (s64)(random32() % (u32)(2 * limit + 1)) - limit;
+}
+
+/* Millivolts of cell i in record n */
+static int replay_cell_mv(u64 n, int i)
+{
+	int t = ((u32)n + 16 * i) & 0xFF;
+	int triangle = t < 128 ? t : 255 - t;
+	int mv = default_mv + (triangle - 64) * swing_mv / 64;
+
+	if (noise_mv > 0)
+		mv += (int)(random32() % (2 * noise_mv + 1)) - noise_mv;
+	return max(mv, 0);
+}
+
+/* Record n of the synthetic chain into p. Returns the length */
+static int replay_synthetic(u64 n, u8 *p)
+{
+	int bits = clamp_t(int, sample_bits, 8, 16);
+	int chip_count = clamp_t(int, chips, 1, REPLAY_MAX_CHIPS);
+	int cell_count = 0;
+	u8 *save = p;
+	u32 val;
+	int chip;
+	int i;
+
+	for (chip = 0; chip < chip_count; chip++)
+		cell_count += clamp_t(int, cells[chip], 0, 6);
+
+	if (bits > 8)
+	{
+		*p++ = BQ_RECORD_EXTENDED;
+		*p++ = bits;
+	}
+
+	*p++ = cell_count;
+	for (i = 0; i < cell_count; i++)
+	{
+		if (bits == 8)
+		{
+			*p++ = min(replay_cell_mv(n, i) / 20, 255);
+			continue;
+		}
+		/* Units of 5.12 volts / 2^bits like the driver */
+		val = min_t(u32, ((u32)replay_cell_mv(n, i) << bits) / 5120,
+			    0xFFFF);
+		*p++ = val >> 8;
+		*p++ = val;
+	}
+
+	*p++ = chip_count;
+	for (chip = 0; chip < chip_count; chip++)
+	{
+		*p++ = clamp_t(int, cells[chip], 0, 6);
+		*p++ = temperature_c;
+		*p++ = temperature_c;
+		*p++ = DS_ADDR_RQST | DRDY;
+		*p++ = 0;		/* Fault	*/
+		*p++ = 0;		/* Alert	*/
+		*p++ = 0;		/* Undervoltage	*/
+		*p++ = 0;		/* Overvoltage	*/
+	}
+
+	*p = crc8(replay_crc8_table, save, p - save, 0);
+	return p - save + 1;
+}
+
+
+/* True for every nth record counting from 1, never for every <= 0 */
+static bool replay_every(u64 n, int every)
+{
+	if (every <= 0)
+		return false;
+	return do_div(n, every) == every - 1;
+}
+
+/*
+  The written record skip records after the next one into p. Called
+  with replay_sem held and at least one record written. Returns the
+  length or -EINVAL if the records are not what replay_write() checked.
+*/
+static int replay_recorded(struct replay_file *file, u64 skip, u8 *p)
+{
+	struct replay_layout l;
+	u32 i = 0;
+	u32 n = do_div(skip, replay_dev.replay_count);
+	int len;
+
+	/* The records were replaced since this reader last got one */
+	if (file->generation != replay_dev.replay_generation)
+	{
+		file->generation = replay_dev.replay_generation;
+		file->offset = 0;
+	}
+
+	for (;;)
+	{
+		if (file->offset >= replay_dev.replay_len)
+			file->offset = 0;
+		len = replay_parse(replay_dev.replay_buf + file->offset,
+				   replay_dev.replay_len - file->offset, &l);
+		if (len < 0)
+		{
+			if (file->offset == 0)
+				return len;
+			/* Not at the start of a record, start over */
+			file->offset = 0;
+			continue;
+		}
+		if (i++ == n)
+			break;
+		file->offset += len;
+	}
+
+	memcpy(p, replay_dev.replay_buf + file->offset, len);
+	file->offset += len;
+	return len;
+}
+
+/* Set fault_bits on fault_chip of a record. Returns true if it did */
+static bool replay_fault(u8 *p, int len)
+{
+	struct replay_layout l;
+	u8 *group;
+
+	if (replay_parse(p, len, &l) != len ||
+	    fault_chip < 1 || fault_chip > l.chips)
+		return false;
+
+	group = p + l.chip_at + (fault_chip - 1) * 8;
+	group[3] |= DS_FAULT;		/* Status	*/
+	group[4] |= fault_bits;		/* Fault	*/
+	p[len - 1] = crc8(replay_crc8_table, p, len - 1, 0);
+	return true;
+}
+
+static bool replay_ready(struct replay_file *file)
+{
+	return max_speed || ktime_to_ns(ktime_sub(ktime_get(), file->due)) >= 0;
+}
+
+/* Wake up the reader when the next record is due */
+static enum hrtimer_restart replay_timer(struct hrtimer *timer)
+{
+	struct replay_file *file =
+		container_of(timer, struct replay_file, timer);
+
+	wake_up_interruptible(&file->wait);
+	return HRTIMER_NORESTART;
+}
+
+static void replay_arm(struct replay_file *file)
+{
+	if (!max_speed)
+		hrtimer_start(&file->timer, file->due, HRTIMER_MODE_ABS);
+}
+
+/*
+  Build the record that is due into file->buff and work out when the
+  one after it is. A reader more than a period late gets the latest
+  record and the ones in between are missed, like with the driver.
+  Called with file->sem held. Returns the length.
+*/
+static int replay_next(struct replay_file *file)
+{
+	ktime_t now = ktime_get();
+	s64 period = replay_period_ns();
+	s64 lag_ns = 0;
+	u64 missed = 0;
+	bool fault;
+	bool crc;
+	int len;
+
+	if (max_speed)
+		file->nominal = now;
+	else
+	{
+		lag_ns = max_t(s64, ktime_to_ns(ktime_sub(now, file->due)), 0);
+		missed = div64_u64(lag_ns, period);
+	}
+	file->next += missed;
+
+	down(&replay_dev.replay_sem);
+	len = -ENODATA;
+	if (replay_dev.replay_count)
+		len = replay_recorded(file, missed, file->buff);
+	if (len < 0)
+		len = replay_synthetic(file->next, file->buff);
+	up(&replay_dev.replay_sem);
+
+	fault = replay_every(file->next + 1, fault_every) &&
+		replay_fault(file->buff, len);
+	crc = replay_every(file->next + 1, crc_error_every);
+	if (crc)
+		file->buff[len - 1] ^= 0xFF;
+
+	file->next++;
+	file->nominal = ktime_add_ns(file->nominal, (missed + 1) * period);
+	file->due = ktime_add_ns(file->nominal, replay_jitter_ns());
+
+	spin_lock(&replay_dev.stats_lock);
+	replay_dev.stats.served++;
+	replay_dev.stats.missed += missed;
+	replay_dev.stats.faults += fault;
+	replay_dev.stats.crc_errors += crc;
+	replay_dev.stats.lag_us = div_s64(lag_ns, NSEC_PER_USEC);
+	replay_dev.stats.lag_total_us += replay_dev.stats.lag_us;
+	if (replay_dev.stats.lag_us > replay_dev.stats.lag_max_us)
+		replay_dev.stats.lag_max_us = replay_dev.stats.lag_us;
+	spin_unlock(&replay_dev.stats_lock);
+
+	return len;
+}
+
+static ssize_t replay_read(struct file *filp, char __user *buff,
+			   size_t count, loff_t *offp)
+{
+	struct replay_file *file = filp->private_data;
+	ssize_t status;
+	int len;
+
+	if (down_interruptible(&file->sem))
+		return -ERESTARTSYS;
+
+	while (!replay_ready(file))
+	{
+		if (filp->f_flags & O_NONBLOCK)
+		{
+			up(&file->sem);
+			return -EAGAIN;
+		}
+		replay_arm(file);
+		if (wait_event_interruptible(file->wait, replay_ready(file)))
+		{
+			up(&file->sem);
+			return -ERESTARTSYS;
+		}
+	}
+
+	len = replay_next(file);
+	if (len < count)
+		count = len;
+
+	if (copy_to_user(buff, file->buff, count)) {
+		status = -EFAULT;
+	} else {
+		*offp += count;
+		status = count;
+	}
+
+	up(&file->sem);
+
+	return status;
+}
+
+/*
+  Append records to the ones to replay. A record may be split over
+  writes, one that does not check out is refused and dropped.
+*/
+static ssize_t replay_write(struct file *filp, const char __user *buff,
+			    size_t count, loff_t *offp)
+{
+	struct replay_layout l;
+	size_t room;
+	int len;
+	ssize_t status = count;
+
+	if (down_interruptible(&replay_dev.replay_sem))
+		return -ERESTARTSYS;
+
+	room = replay_dev.replay_size - replay_dev.replay_fill;
+	if (count > room) {
+		status = -ENOSPC;
+		goto out;
+	}
+
+	if (copy_from_user(replay_dev.replay_buf + replay_dev.replay_fill,
+			   buff, count)) {
+		status = -EFAULT;
+		goto out;
+	}
+	replay_dev.replay_fill += count;
+
+	for (;;)
+	{
+		len = replay_parse(replay_dev.replay_buf + replay_dev.replay_len,
+				   replay_dev.replay_fill - replay_dev.replay_len,
+				   &l);
+		if (len == -EAGAIN)
+			break;
+		if (len < 0 ||
+		    crc8(replay_crc8_table,
+			 replay_dev.replay_buf + replay_dev.replay_len, len, 0))
+		{
+			replay_dev.replay_fill = replay_dev.replay_len;
+			status = -EINVAL;
+			break;
+		}
+		replay_dev.replay_len += len;
+		replay_dev.replay_count++;
+	}
+
+out:
+	up(&replay_dev.replay_sem);
+
+	if (status > 0)
+		*offp += status;
+	return status;
+}
+
+static unsigned int replay_poll(struct file *filp, poll_table *wait)
+{
+	struct replay_file *file = filp->private_data;
+
+	poll_wait(filp, &file->wait, wait);
+
+	if (replay_ready(file))
+		return POLLIN | POLLRDNORM;
+
+	replay_arm(file);
+	return 0;
+}
+
+static int replay_open(struct inode *inode, struct file *filp)
+{
+	struct replay_file *file;
+
+	if ((filp->f_mode & FMODE_WRITE) && (filp->f_flags & O_TRUNC))
+	{
+		if (down_interruptible(&replay_dev.replay_sem))
+			return -ERESTARTSYS;
+		replay_dev.replay_len = 0;
+		replay_dev.replay_fill = 0;
+		replay_dev.replay_count = 0;
+		replay_dev.replay_generation++;
+		up(&replay_dev.replay_sem);
+	}
+
+	file = kzalloc(sizeof(*file), GFP_KERNEL);
+	if (!file)
+		return -ENOMEM;
+
+	sema_init(&file->sem, 1);
+	init_waitqueue_head(&file->wait);
+	hrtimer_init(&file->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	file->timer.function = replay_timer;
+
+	/* The first record is due right away */
+	file->nominal = ktime_get();
+	file->due = file->nominal;
+
+	if (filp->f_mode & FMODE_READ)
+	{
+		spin_lock(&replay_dev.stats_lock);
+		replay_dev.stats.readers++;
+		spin_unlock(&replay_dev.stats_lock);
+	}
+
+	filp->private_data = file;
+
+	return 0;
+}
+
+static int replay_release(struct inode *inode, struct file *filp)
+{
+	struct replay_file *file = filp->private_data;
+
+	hrtimer_cancel(&file->timer);
+
+	if (filp->f_mode & FMODE_READ)
+	{
+		spin_lock(&replay_dev.stats_lock);
+		replay_dev.stats.readers--;
+		spin_unlock(&replay_dev.stats_lock);
+	}
+
+	kfree(file);
+	filp->private_data = NULL;
+
+	return 0;
+}
+
+static const struct file_operations replay_fops = {
+	.owner =	THIS_MODULE,
+	.read =		replay_read,
+	.write =	replay_write,
+	.poll =		replay_poll,
+	.open =		replay_open,
+	.release =	replay_release,
+};
+
+static ssize_t stats_show(struct device *dev,
+			  struct device_attribute *attr, char *buf)
+{
+	struct replay_stats copy;
+	s64 elapsed_us;
+
+	spin_lock(&replay_dev.stats_lock);
+	copy = replay_dev.stats;
+	spin_unlock(&replay_dev.stats_lock);
+
+	elapsed_us = max_t(s64, ktime_us_delta(ktime_get(), copy.since), 1);
+
+	return sprintf(buf,
+		       "readers %d\n"
+		       "served %llu\n"
+		       "missed %llu\n"
+		       "crc_errors %llu\n"
+		       "faults %llu\n"
+		       "lag_us %lld\n"
+		       "lag_avg_us %lld\n"
+		       "lag_max_us %lld\n"
+		       "records_per_s %llu\n",
+		       copy.readers, copy.served, copy.missed,
+		       copy.crc_errors, copy.faults, copy.lag_us,
+		       copy.served ?
+		       div64_s64(copy.lag_total_us, copy.served) : 0,
+		       copy.lag_max_us,
+		       div64_u64(copy.served * USEC_PER_SEC, elapsed_us));
+}
+
+/* Any write clears the stats */
+static ssize_t stats_store(struct device *dev,
+			   struct device_attribute *attr,
+			   const char *buf, size_t count)
+{
+	spin_lock(&replay_dev.stats_lock);
+	replay_dev.stats.served = 0;
+	replay_dev.stats.missed = 0;
+	replay_dev.stats.crc_errors = 0;
+	replay_dev.stats.faults = 0;
+	replay_dev.stats.lag_us = 0;
+	replay_dev.stats.lag_max_us = 0;
+	replay_dev.stats.lag_total_us = 0;
+	replay_dev.stats.since = ktime_get();
+	spin_unlock(&replay_dev.stats_lock);
+
+	return count;
+}
+
+static ssize_t records_show(struct device *dev,
+			    struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", replay_dev.replay_count);
+}
+
+static DEVICE_ATTR(stats, S_IRUGO | S_IWUSR, stats_show, stats_store);
+static DEVICE_ATTR(records, S_IRUGO, records_show, NULL);
+
+static struct attribute *replay_attrs[] = {
+	&dev_attr_stats.attr,
+	&dev_attr_records.attr,
+	NULL
+};
+
+static const struct attribute_group replay_attr_group = {
+	.attrs = replay_attrs,
+};
+
+static int __init replay_init_cdev(void)
+{
+	int error;
+
+	replay_dev.devt = MKDEV(0, 0);
+
+	error = alloc_chrdev_region(&replay_dev.devt, 0, 1, this_driver_name);
+	if (error < 0) {
+		printk(KERN_ALERT "%s: alloc_chrdev_region() failed: %d \n",
+		       this_driver_name, error);
+		return -1;
+	}
+
+	cdev_init(&replay_dev.cdev, &replay_fops);
+	replay_dev.cdev.owner = THIS_MODULE;
+
+	error = cdev_add(&replay_dev.cdev, replay_dev.devt, 1);
+	if (error) {
+		printk(KERN_ALERT "%s: cdev_add() failed: %d\n",
+		       this_driver_name, error);
+		unregister_chrdev_region(replay_dev.devt, 1);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int __init replay_init_class(void)
+{
+	replay_dev.class = class_create(THIS_MODULE, this_driver_name);
+
+	if (!replay_dev.class) {
+		printk(KERN_ALERT "%s: class_create() failed\n",
+		       this_driver_name);
+		return -1;
+	}
+
+	replay_dev.device = device_create(replay_dev.class, NULL,
+					  replay_dev.devt, NULL,
+					  this_driver_name);
+	if (!replay_dev.device) {
+		printk(KERN_ALERT "device_create(..., %s) failed\n",
+			this_driver_name);
+		class_destroy(replay_dev.class);
+		return -1;
+	}
+
+	if (sysfs_create_group(&replay_dev.device->kobj, &replay_attr_group)) {
+		printk(KERN_ALERT "%s: sysfs_create_group() failed\n",
+			this_driver_name);
+		device_destroy(replay_dev.class, replay_dev.devt);
+		class_destroy(replay_dev.class);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int __init replay_init(void)
+{
+	int i;
+
+	for (i = 0; i < chips; i++) {
+		if (cells[i] < 1 || cells[i] > 6) {
+			printk(KERN_ALERT "%s: cells %d is not 1..6\n",
+			       this_driver_name, cells[i]);
+			return -EINVAL;
+		}
+	}
+
+	memset(&replay_dev, 0, sizeof(replay_dev));
+	sema_init(&replay_dev.replay_sem, 1);
+	spin_lock_init(&replay_dev.stats_lock);
+	replay_dev.stats.since = ktime_get();
+
+	crc8_populate_msb(replay_crc8_table, REPLAY_CRC_POLY);
+
+	replay_dev.replay_size = (size_t)max(replay_kb, 1) * 1024;
+	replay_dev.replay_buf = vmalloc(replay_dev.replay_size);
+	if (!replay_dev.replay_buf)
+		return -ENOMEM;
+
+	if (replay_init_cdev() < 0)
+		goto fail_1;
+
+	if (replay_init_class() < 0)
+		goto fail_2;
+
+	return 0;
+
+fail_2:
+	cdev_del(&replay_dev.cdev);
+	unregister_chrdev_region(replay_dev.devt, 1);
+
+fail_1:
+	vfree(replay_dev.replay_buf);
+	return -1;
+}
+module_init(replay_init);
+
+static void __exit replay_exit(void)
+{
+	sysfs_remove_group(&replay_dev.device->kobj, &replay_attr_group);
+	device_destroy(replay_dev.class, replay_dev.devt);
+	class_destroy(replay_dev.class);
+
+	cdev_del(&replay_dev.cdev);
+	unregister_chrdev_region(replay_dev.devt, 1);
+
+	vfree(replay_dev.replay_buf);
+}
+module_exit(replay_exit);
+
+MODULE_DESCRIPTION("Replays bq76pl536 records for load testing readers");
+MODULE_LICENSE("GPL");
+MODULE_VERSION("0.1");
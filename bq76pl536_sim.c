@@ -0,0 +1,592 @@
+/*
+  bq76pl536_sim.c
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+  A software SPI controller with a chain of bq76pl536 chips behind it.
+  Load it before the driver and the driver finds the chain on bus_num
+  as if it was a real pack. No hardware is needed.
+
+  insmod bq76pl536_sim.ko cells=6,6,6,6,6,6
+  insmod bq76pl536.ko
+
+  cells gives the cells on each chip, one entry per chip in the chain.
+  The chips do what the driver expects from the real ones:
+    Address assignment through DISCOVERY_ADDR and ADDRESS_CONTROL,
+    RESET, broadcast writes and block reads.
+    The register map in bq76pl536.h. Group3 registers (0x40-0x4F)
+    can only be written right after SC_ENABLE is written to SHDW_CTRL.
+    CRC on every packet. A write with a bad CRC is dropped and sets
+    FS_CRC unless IC_CRC_DIS is set in IO_CONFIG.
+    ADC_CONVERT starts a conversion that takes conv_us at ADC time
+    FC_ADCT24, half that at FC_ADCT12 and so on. DRDY is clear until
+    it is done. CONFIG_COV and CONFIG_CUV are checked after every
+    conversion.
+    FAULT_STATUS and ALERT_STATUS latch. Writing a 1 to a bit clears
+    it, the driver writes the value back and then 0.
+    IO_SLEEP sets AS_SLEEP.
+    The time on the wire. Each message takes as long as its bits take
+    at the transfer speed, set wire_time to 0 to turn this off.
+
+  Everything below can be changed while the driver is running through
+  /sys/module/bq76pl536_sim/parameters.
+    cell_mv          Millivolts for each cell in chain order,
+                     default_mv for the cells not listed
+    noise_mv         Random noise added to every cell, +/- millivolts
+    temperature_c    Both thermistors on every chip
+    gpai_mv          GPAI input on every chip
+    crc_error_every  Corrupt the CRC of every nth read, 0 for never
+    fault_chip       Latch fault_bits in FAULT_STATUS of this chip at
+    fault_bits       every conversion, 0 for none
+    break_after      Chips after this one do not answer, 0 for none
+    por_chip         Power on reset this chip once, like a brownout.
+                     It loses its address and Group3 settings. Goes
+                     back to 0 when done
+*/
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/platform_device.h>
+#include <linux/spi/spi.h>
+#include <linux/workqueue.h>
+#include <linux/spinlock.h>
+#include <linux/random.h>
+#include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/crc8.h>
+#include "bq76pl536.h"
+
+#define SIM_MAX_CHIPS	32
+#define SIM_MAX_CELLS	(SIM_MAX_CHIPS * 6)
+#define SIM_REGS	0x50
+#define SIM_CRC_POLY	7
+
+static const char this_driver_name[] = "bq76pl536_sim";
+
+/* The bus the chain is on, the driver looks on bus 2 by default */
+static int bus_num = 2;
+
+module_param(bus_num, int, S_IRUGO);
+
+/* Cells on each chip, the number of entries is the number of chips */
+static int cells[SIM_MAX_CHIPS] = { 4, 4, 4, 3 };
+static int chips = 4;
+
+module_param_array(cells, int, &chips, S_IRUGO);
+
+/* What the chips measure, see the top of this file */
+static int cell_mv[SIM_MAX_CELLS];
+static int cell_mv_count = 0;
+static int default_mv = 3700;
+static int noise_mv = 0;
+static int temperature_c = 25;
+static int gpai_mv = 1250;
+
+module_param_array(cell_mv, int, &cell_mv_count, S_IRUGO | S_IWUSR);
+module_param(default_mv, int, S_IRUGO | S_IWUSR);
+module_param(noise_mv, int, S_IRUGO | S_IWUSR);
+module_param(temperature_c, int, S_IRUGO | S_IWUSR);
+module_param(gpai_mv, int, S_IRUGO | S_IWUSR);
+
+/* Timing, see the top of this file */
+static int conv_us = 1000;
+static bool wire_time = 1;
+
+module_param(conv_us, int, S_IRUGO | S_IWUSR);
+module_param(wire_time, bool, S_IRUGO | S_IWUSR);
+
+/* Fault injection, see the top of this file */
+static int crc_error_every = 0;
+static int fault_chip = 0;
+static int fault_bits = 0;
+static int break_after = 0;
+static int por_chip = 0;
+
+module_param(crc_error_every, int, S_IRUGO | S_IWUSR);
+module_param(fault_chip, int, S_IRUGO | S_IWUSR);
+module_param(fault_bits, int, S_IRUGO | S_IWUSR);
+module_param(break_after, int, S_IRUGO | S_IWUSR);
+module_param(por_chip, int, S_IRUGO | S_IWUSR);
+
+struct sim_chip {
+	u8 reg[SIM_REGS];
+	bool shadow;		/* Next Group3 write is allowed	*/
+	bool converting;
+	ktime_t conv_done;
+};
+
+struct bq_sim {
+	struct spi_master *master;
+	struct workqueue_struct *wq;
+	struct work_struct work;
+	spinlock_t lock;
+	struct list_head queue;
+
+	/* Only touched from the work function */
+	struct sim_chip chip[SIM_MAX_CHIPS+1];	/* 1..chips, chain order */
+	u32 reads;
+};
+
+static struct platform_device *sim_pdev;
+static struct spi_master *sim_master;
+
+DECLARE_CRC8_TABLE(sim_crc8_table);
+
+/* Chips past a break in the chain see nothing */
+static int sim_chips(void)
+{
+	int n = min(chips, SIM_MAX_CHIPS);
+
+	if (break_after > 0 && break_after < n)
+		n = break_after;
+	return n;
+}
+
+/* Power on state, what the chip has after RESET */
+static void sim_reset_chip(struct sim_chip *chip)
+{
+	memset(chip->reg, 0, sizeof(chip->reg));
+	chip->reg[FAULT_STATUS] = FS_POR;
+	chip->reg[ALERT_STATUS] = AS_AR;
+	chip->reg[FUNCTION_CONFIG] = FC_ADCT24;
+	chip->reg[CONFIG_COV] = COV_DISABLE;
+	chip->reg[CONFIG_CUV] = UV_DISABLE;
+	chip->shadow = false;
+	chip->converting = false;
+}
+
+static bool sim_addressed(const struct sim_chip *chip)
+{
+	return (chip->reg[ADDRESS_CONTROL] & AC_ADDR_RQST) != 0;
+}
+
+/* The chip that answers to address in a packet, NULL for none */
+static struct sim_chip *sim_find(struct bq_sim *sim, u8 address)
+{
+	int i;
+
+	for (i = 1; i <= sim_chips(); i++)
+	{
+		struct sim_chip *chip = &sim->chip[i];
+
+		/* Only the first unaddressed chip hears discovery */
+		if (address == DISCOVERY_ADDR && !sim_addressed(chip))
+			return chip;
+		if (address != DISCOVERY_ADDR && sim_addressed(chip) &&
+		    (chip->reg[ADDRESS_CONTROL] & 0x3F) == address)
+			return chip;
+	}
+	return NULL;
+}
+
+static void sim_put16(struct sim_chip *chip, u8 reg, int value)
+{
+	value = clamp(value, 0, 16383);
+	chip->reg[reg] = value >> 8;
+	chip->reg[reg+1] = value;
+}
+
+/* Load the results of a conversion, first_cell is its chain index */
+static void sim_convert(struct sim_chip *chip, int position, int first_cell)
+{
+	u8 control = chip->reg[ADC_CONTROL];
+	int cov = chip->reg[CONFIG_COV];
+	int cuv = chip->reg[CONFIG_CUV];
+	int selected = (control & 0x07) + 1;
+	int mv;
+	int i;
+
+	chip->reg[COV_FAULT] = 0;
+	chip->reg[CUV_FAULT] = 0;
+
+	for (i = 0; i < 6; i++)
+	{
+		if (i >= cells[position-1] || i >= selected)
+		{
+			sim_put16(chip, VCELL1 + 2*i, 0);
+			continue;
+		}
+
+		if (first_cell + i < cell_mv_count)
+			mv = cell_mv[first_cell + i];
+		else
+			mv = default_mv;
+		if (noise_mv > 0)
+			mv += (int)(random32() % (2*noise_mv + 1)) - noise_mv;
+
+		/* The driver uses 6.25 volts full scale */
+		sim_put16(chip, VCELL1 + 2*i, (mv * 16383) / 6250);
+
+		if (!(cov & COV_DISABLE) && mv > 2000 + 50 * (cov & 0x3F))
+			chip->reg[COV_FAULT] |= 1 << i;
+		if (!(cuv & UV_DISABLE) && mv < 700 + 100 * (cuv & 0x1F))
+			chip->reg[CUV_FAULT] |= 1 << i;
+	}
+
+	if (chip->reg[COV_FAULT])
+		chip->reg[FAULT_STATUS] |= FS_COV;
+	if (chip->reg[CUV_FAULT])
+		chip->reg[FAULT_STATUS] |= FS_CUV;
+
+	/* 2048 + 120 per degree is what the driver decodes */
+	if (control & AC_TS1)
+		sim_put16(chip, TEMPERATURE1, 2048 + 120 * temperature_c);
+	if (control & AC_TS2)
+		sim_put16(chip, TEMPERATURE2, 2048 + 120 * temperature_c);
+	if (control & AC_GPAI)
+		sim_put16(chip, GPAI, (gpai_mv * 16383) / 2500);
+
+	if (fault_chip == position && fault_bits)
+		chip->reg[FAULT_STATUS] |= fault_bits;
+}
+
+/* Finish any conversion whose time is up */
+static void sim_update(struct bq_sim *sim)
+{
+	ktime_t now = ktime_get();
+	int first_cell = 0;
+	int i;
+
+	for (i = 1; i <= sim_chips(); i++)
+	{
+		struct sim_chip *chip = &sim->chip[i];
+
+		if (por_chip == i)
+		{
+			sim_reset_chip(chip);
+			por_chip = 0;
+		}
+
+		if (chip->converting &&
+		    ktime_to_ns(ktime_sub(now, chip->conv_done)) >= 0)
+		{
+			sim_convert(chip, i, first_cell);
+			chip->converting = false;
+		}
+		first_cell += cells[i-1];
+	}
+}
+
+static u8 sim_read_reg(struct sim_chip *chip, u8 reg)
+{
+	u8 val;
+
+	if (reg >= SIM_REGS)
+		return 0;
+
+	if (reg != DEVICE_STATUS)
+		return chip->reg[reg];
+
+	val = 0;
+	if (sim_addressed(chip))
+		val |= DS_ADDR_RQST;
+	if (chip->reg[FAULT_STATUS])
+		val |= DS_FAULT;
+	if (chip->reg[ALERT_STATUS])
+		val |= DS_ALERT;
+	if (!chip->converting)
+		val |= DRDY;
+	return val;
+}
+
+static void sim_write_reg(struct sim_chip *chip, u8 reg, u8 data)
+{
+	int adct;
+
+	if (reg >= SIM_REGS)
+		return;
+
+	/* Group3 needs SC_ENABLE first, and only for one write */
+	if (reg >= FUNCTION_CONFIG)
+	{
+		if (chip->shadow)
+			chip->reg[reg] = data;
+		chip->shadow = false;
+		return;
+	}
+	chip->shadow = false;
+
+	switch (reg)
+	{
+	case ALERT_STATUS:
+	case FAULT_STATUS:
+		/* Latched, a 1 clears. FORCE sets the bit it is written to */
+		chip->reg[reg] &= ~data;
+		chip->reg[reg] |= data & (reg == ALERT_STATUS ? AS_FORCE : FS_FORCE);
+		break;
+	case ADDRESS_CONTROL:
+		chip->reg[reg] = (data & 0x3F) | AC_ADDR_RQST;
+		chip->reg[ALERT_STATUS] &= ~AS_AR;
+		break;
+	case RESET:
+		if (data == RESET_COMMAND)
+			sim_reset_chip(chip);
+		break;
+	case SHDW_CTRL:
+		chip->shadow = (data == SC_ENABLE);
+		break;
+	case IO_CONTROL:
+		if ((data & IO_SLEEP) && !(chip->reg[reg] & IO_SLEEP))
+			chip->reg[ALERT_STATUS] |= AS_SLEEP;
+		chip->reg[reg] = data;
+		break;
+	case ADC_CONVERT:
+		if (data & AC_CONV)
+		{
+			adct = (chip->reg[FUNCTION_CONFIG] & FC_ADCT_MASK) >> 6;
+			chip->conv_done = ktime_add_us(ktime_get(),
+						       conv_us >> (3 - adct));
+			chip->converting = true;
+		}
+		break;
+	default:
+		/* Read only below ALERT_STATUS */
+		if (reg >= ALERT_STATUS)
+			chip->reg[reg] = data;
+		break;
+	}
+}
+
+/* One packet, one chip select */
+static void sim_packet(struct bq_sim *sim, const u8 *tx, u8 *rx, int len)
+{
+	struct sim_chip *target;
+	struct sim_chip *chip;
+	u8 address;
+	u8 reg;
+	u8 crc;
+	int count;
+	int i;
+
+	if (rx)
+		memset(rx, 0, len);
+	if (!tx || len < 3)
+		return;
+
+	address = tx[0] >> 1;
+	reg = tx[1];
+	sim_update(sim);
+
+	if (tx[0] & 1)
+	{
+		/* Write, the 4th byte is the CRC */
+		if (len < 4)
+			return;
+		crc = crc8(sim_crc8_table, (u8 *)tx, 3, 0);
+
+		/* Find the target first, a discovery write addresses it */
+		target = sim_find(sim, address);
+		for (i = 1; i <= sim_chips(); i++)
+		{
+			chip = &sim->chip[i];
+			if (address == BROADCAST)
+			{
+				/* Unaddressed chips still hear a reset */
+				if (!sim_addressed(chip) && reg != RESET)
+					continue;
+			}
+			else if (chip != target)
+				continue;
+
+			if (crc != tx[3] &&
+			    !(chip->reg[IO_CONFIG] & IC_CRC_DIS))
+			{
+				chip->reg[FAULT_STATUS] |= FS_CRC;
+				continue;
+			}
+			sim_write_reg(chip, reg, tx[2]);
+		}
+		return;
+	}
+
+	/* Read, the chip answers after the 3 header bytes */
+	count = tx[2];
+	chip = sim_find(sim, address);
+	if (!chip || !rx || len < 4 + count)
+		return;
+
+	for (i = 0; i < count; i++)
+		rx[3+i] = sim_read_reg(chip, reg + i);
+	crc = crc8(sim_crc8_table, (u8 *)tx, 3, 0);
+	rx[3+count] = crc8(sim_crc8_table, rx+3, count, crc);
+
+	sim->reads++;
+	if (crc_error_every > 0 && sim->reads % crc_error_every == 0)
+		rx[3+count] ^= 0xFF;
+}
+
+static void sim_message(struct bq_sim *sim, struct spi_message *msg)
+{
+	struct spi_transfer *xfer;
+	u64 ns = 0;
+	u32 hz;
+	u32 us;
+
+	list_for_each_entry(xfer, &msg->transfers, transfer_list)
+	{
+		sim_packet(sim, xfer->tx_buf, xfer->rx_buf, xfer->len);
+		msg->actual_length += xfer->len;
+
+		hz = xfer->speed_hz ? xfer->speed_hz : msg->spi->max_speed_hz;
+		if (hz)
+			ns += div_u64((u64)xfer->len * 8 * NSEC_PER_SEC, hz);
+		if (xfer->delay_usecs)
+			udelay(xfer->delay_usecs);
+	}
+
+	if (wire_time && ns > 0)
+	{
+		us = div_u64(ns, NSEC_PER_USEC);
+		if (us < 20)
+			udelay(us);
+		else
+			usleep_range(us, us + us / 8);
+	}
+
+	msg->status = 0;
+	msg->complete(msg->context);
+}
+
+static void sim_work(struct work_struct *work)
+{
+	struct bq_sim *sim = container_of(work, struct bq_sim, work);
+	struct spi_message *msg;
+	unsigned long flags;
+
+	spin_lock_irqsave(&sim->lock, flags);
+	while (!list_empty(&sim->queue))
+	{
+		msg = list_first_entry(&sim->queue, struct spi_message, queue);
+		list_del_init(&msg->queue);
+		spin_unlock_irqrestore(&sim->lock, flags);
+
+		sim_message(sim, msg);
+
+		spin_lock_irqsave(&sim->lock, flags);
+	}
+	spin_unlock_irqrestore(&sim->lock, flags);
+}
+
+static int sim_setup(struct spi_device *spi)
+{
+	if (spi->chip_select >= spi->master->num_chipselect)
+		return -EINVAL;
+	return 0;
+}
+
+/* May be called in atomic context, the work function does the rest */
+static int sim_transfer(struct spi_device *spi, struct spi_message *msg)
+{
+	struct bq_sim *sim = spi_master_get_devdata(spi->master);
+	unsigned long flags;
+
+	msg->actual_length = 0;
+	msg->status = -EINPROGRESS;
+
+	spin_lock_irqsave(&sim->lock, flags);
+	list_add_tail(&msg->queue, &sim->queue);
+	queue_work(sim->wq, &sim->work);
+	spin_unlock_irqrestore(&sim->lock, flags);
+
+	return 0;
+}
+
+static int __init bq_sim_init(void)
+{
+	struct spi_master *master;
+	struct bq_sim *sim;
+	int status;
+	int i;
+
+	if (chips < 1 || chips > SIM_MAX_CHIPS)
+		return -EINVAL;
+	for (i = 0; i < chips; i++)
+		if (cells[i] < 0 || cells[i] > 6)
+			return -EINVAL;
+
+	crc8_populate_msb(sim_crc8_table, SIM_CRC_POLY);
+
+	sim_pdev = platform_device_register_simple(this_driver_name, -1,
+						   NULL, 0);
+	if (IS_ERR(sim_pdev))
+		return PTR_ERR(sim_pdev);
+
+	master = spi_alloc_master(&sim_pdev->dev, sizeof(*sim));
+	if (!master) {
+		status = -ENOMEM;
+		goto fail_1;
+	}
+
+	master->bus_num = bus_num;
+	master->num_chipselect = 1;
+	master->mode_bits = SPI_CPOL | SPI_CPHA;
+	master->setup = sim_setup;
+	master->transfer = sim_transfer;
+
+	sim = spi_master_get_devdata(master);
+	sim->master = master;
+	spin_lock_init(&sim->lock);
+	INIT_LIST_HEAD(&sim->queue);
+	INIT_WORK(&sim->work, sim_work);
+	for (i = 1; i <= SIM_MAX_CHIPS; i++)
+		sim_reset_chip(&sim->chip[i]);
+
+	sim->wq = create_singlethread_workqueue(this_driver_name);
+	if (!sim->wq) {
+		status = -ENOMEM;
+		goto fail_2;
+	}
+
+	status = spi_register_master(master);
+	if (status < 0)
+		goto fail_3;
+
+	sim_master = master;
+	printk(KERN_INFO "%s: %d chips on spi bus %d\n",
+	       this_driver_name, chips, bus_num);
+
+	return 0;
+
+fail_3:
+	destroy_workqueue(sim->wq);
+
+fail_2:
+	spi_master_put(master);
+
+fail_1:
+	platform_device_unregister(sim_pdev);
+
+	return status;
+}
+module_init(bq_sim_init);
+
+static void __exit bq_sim_exit(void)
+{
+	struct bq_sim *sim = spi_master_get_devdata(sim_master);
+
+	/* Keep sim around until the work queue is gone */
+	spi_master_get(sim_master);
+	spi_unregister_master(sim_master);
+	destroy_workqueue(sim->wq);
+	spi_master_put(sim_master);
+
+	platform_device_unregister(sim_pdev);
+}
+module_exit(bq_sim_exit);
+
+MODULE_DESCRIPTION("Emulated bq76pl536 chain on a software SPI controller");
+MODULE_LICENSE("GPL");
+MODULE_VERSION("0.1");
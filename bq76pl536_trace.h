@@ -0,0 +1,165 @@
+/*
+  bq76pl536_trace.h
+
+  Tracepoints on the scan path. Enable them with
+  echo 1 > /sys/kernel/debug/tracing/events/bq76pl536/enable
+*/
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM bq76pl536
+
+#if !defined(_BQ76PL536_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _BQ76PL536_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(bq_scan_start,
+	TP_PROTO(u32 seq),
+	TP_ARGS(seq),
+	TP_STRUCT__entry(
+		__field(u32, seq)
+	),
+	TP_fast_assign(
+		__entry->seq = seq;
+	),
+	TP_printk("seq=%u", __entry->seq)
+);
+
+TRACE_EVENT(bq_scan_done,
+	TP_PROTO(int status, s64 us),
+	TP_ARGS(status, us),
+	TP_STRUCT__entry(
+		__field(int, status)
+		__field(s64, us)
+	),
+	TP_fast_assign(
+		__entry->status = status;
+		__entry->us = us;
+	),
+	TP_printk("status=%d us=%lld", __entry->status, __entry->us)
+);
+
+TRACE_EVENT(bq_adc_convert,
+	TP_PROTO(int status),
+	TP_ARGS(status),
+	TP_STRUCT__entry(
+		__field(int, status)
+	),
+	TP_fast_assign(
+		__entry->status = status;
+	),
+	TP_printk("status=%d", __entry->status)
+);
+
+TRACE_EVENT(bq_drdy_wait,
+	TP_PROTO(int tries, int device_status, s64 us),
+	TP_ARGS(tries, device_status, us),
+	TP_STRUCT__entry(
+		__field(int, tries)
+		__field(int, device_status)
+		__field(s64, us)
+	),
+	TP_fast_assign(
+		__entry->tries = tries;
+		__entry->device_status = device_status;
+		__entry->us = us;
+	),
+	TP_printk("tries=%d status=%x us=%lld", __entry->tries,
+		  __entry->device_status, __entry->us)
+);
+
+TRACE_EVENT(bq_spi_sync,
+	TP_PROTO(int xfers, int bytes),
+	TP_ARGS(xfers, bytes),
+	TP_STRUCT__entry(
+		__field(int, xfers)
+		__field(int, bytes)
+	),
+	TP_fast_assign(
+		__entry->xfers = xfers;
+		__entry->bytes = bytes;
+	),
+	TP_printk("xfers=%d bytes=%d", __entry->xfers, __entry->bytes)
+);
+
+TRACE_EVENT(bq_spi_sync_done,
+	TP_PROTO(int status, s64 us),
+	TP_ARGS(status, us),
+	TP_STRUCT__entry(
+		__field(int, status)
+		__field(s64, us)
+	),
+	TP_fast_assign(
+		__entry->status = status;
+		__entry->us = us;
+	),
+	TP_printk("status=%d us=%lld", __entry->status, __entry->us)
+);
+
+TRACE_EVENT(bq_crc_check,
+	TP_PROTO(u8 address, u8 reg, u8 expected, u8 received),
+	TP_ARGS(address, reg, expected, received),
+	TP_STRUCT__entry(
+		__field(u8, address)
+		__field(u8, reg)
+		__field(u8, expected)
+		__field(u8, received)
+	),
+	TP_fast_assign(
+		__entry->address = address;
+		__entry->reg = reg;
+		__entry->expected = expected;
+		__entry->received = received;
+	),
+	TP_printk("chip=%u reg=%02x crc=%02x/%02x %s", __entry->address,
+		  __entry->reg, __entry->expected, __entry->received,
+		  __entry->expected == __entry->received ? "ok" : "ERROR")
+);
+
+/* One chip of a scan, status is what bq_proto_decode_chip() returned */
+TRACE_EVENT(bq_decode_chip,
+	TP_PROTO(int chip, int status, u8 device_status, u8 alert, u8 fault),
+	TP_ARGS(chip, status, device_status, alert, fault),
+	TP_STRUCT__entry(
+		__field(int, chip)
+		__field(int, status)
+		__field(u8, device_status)
+		__field(u8, alert)
+		__field(u8, fault)
+	),
+	TP_fast_assign(
+		__entry->chip = chip;
+		__entry->status = status;
+		__entry->device_status = device_status;
+		__entry->alert = alert;
+		__entry->fault = fault;
+	),
+	TP_printk("chip=%d status=%d device_status=%02x alert=%02x fault=%02x",
+		  __entry->chip, __entry->status, __entry->device_status,
+		  __entry->alert, __entry->fault)
+);
+
+TRACE_EVENT(bq_encode,
+	TP_PROTO(int cells, int chips, int len),
+	TP_ARGS(cells, chips, len),
+	TP_STRUCT__entry(
+		__field(int, cells)
+		__field(int, chips)
+		__field(int, len)
+	),
+	TP_fast_assign(
+		__entry->cells = cells;
+		__entry->chips = chips;
+		__entry->len = len;
+	),
+	TP_printk("cells=%d chips=%d len=%d", __entry->cells,
+		  __entry->chips, __entry->len)
+);
+
+#endif /* _BQ76PL536_TRACE_H */
+
+/* This part must be outside the multi read protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE bq76pl536_trace
+#include <trace/define_trace.h>
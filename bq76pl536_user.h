@@ -0,0 +1,167 @@
+/*
+  bq76pl536_user.h
+
+  Definitions shared between the bq76pl536 driver and the programs
+  that use it. Nothing in here depends on kernel headers other than
+  <linux/ioctl.h>, which programs have too.
+*/
+#ifndef BQ76PL536_USER_H
+#define BQ76PL536_USER_H
+
+#include <linux/ioctl.h>
+
+/*
+  Generic netlink family
+
+  Every completed scan is multicast to the "samples" group as a
+  BQ_NL_CMD_SAMPLE message and every fault or alert is multicast to
+  the "events" group as a BQ_NL_CMD_EVENT message. Resolve the family
+  and group ids with the generic netlink controller (CTRL_CMD_GETFAMILY)
+  and join the groups you are interested in.
+
+  Sample times are CLOCK_MONOTONIC nanoseconds. The conversion started
+  between CONVERT_NS and CONVERT_NS + SKEW_NS and was done by DRDY_NS.
+*/
+#define BQ_NL_FAMILY_NAME	"bq76pl536"
+#define BQ_NL_VERSION		1
+#define BQ_NL_GROUP_SAMPLES	"samples"
+#define BQ_NL_GROUP_EVENTS	"events"
+
+enum bq_nl_commands {
+	BQ_NL_CMD_UNSPEC,
+	BQ_NL_CMD_SAMPLE,	/* A completed scan of the pack		*/
+	BQ_NL_CMD_EVENT,	/* A chip raised or cleared a fault/alert	*/
+	__BQ_NL_CMD_MAX,
+};
+#define BQ_NL_CMD_MAX (__BQ_NL_CMD_MAX - 1)
+
+enum bq_nl_attrs {
+	BQ_NL_A_UNSPEC,
+	BQ_NL_A_SEQ,		/* u32	Scan sequence number		*/
+	BQ_NL_A_RECORD,		/* binary Same bytes as a read() returns	*/
+	BQ_NL_A_CHIP,		/* u8	Chip address 1..n		*/
+	BQ_NL_A_STATUS,		/* u8	DEVICE_STATUS			*/
+	BQ_NL_A_FAULT,		/* u8	FAULT_STATUS			*/
+	BQ_NL_A_ALERT,		/* u8	ALERT_STATUS			*/
+	BQ_NL_A_CONVERT_NS,	/* u64	Conversion start		*/
+	BQ_NL_A_DRDY_NS,	/* u64	Conversion seen done		*/
+	BQ_NL_A_SKEW_NS,	/* u32	Uncertainty of the start	*/
+	__BQ_NL_A_MAX,
+};
+#define BQ_NL_A_MAX (__BQ_NL_A_MAX - 1)
+
+/*
+  First byte of a record read from the device. A full record starts
+  with the cell count which is never more than 192, the other kinds
+  of record start with one of these markers. See bq76pl536_drv.c for the
+  layout of each.
+*/
+#define BQ_RECORD_EXTENDED_DELTA	0xFD	/* Delta, 16 bit voltages	*/
+#define BQ_RECORD_EXTENDED		0xFE	/* Full, 16 bit voltages	*/
+#define BQ_RECORD_DELTA			0xFF	/* Delta, 8 bit voltages	*/
+
+/*
+  The longest record of a chain. A delta record at 16 bits with every
+  cell and chip changed is longer than any full record.
+*/
+#define BQ_RECORD_SIZE_MAX(cells, chips) \
+	(2 + 1 + (cells) * 3 + 1 + (chips) * 8 + 1)
+
+/*
+  Group3 protection registers CONFIG_COV..CONFIG_OTT in register order,
+  see bq76pl536.h for what goes in each. BQ_IOC_SET_CONFIG writes them
+  to every chip in one message, reads them back from every chip in
+  another along with PRESULT_A/B and fails with EIO if any chip does
+  not have them or reports a parity error, after writing the previous
+  settings back. Values with bits the registers do not use fail with
+  EINVAL. The driver writes them again when a chip reports a power on
+  reset. Needs the device open for writing.
+*/
+struct bq_config {
+	unsigned char cov;
+	unsigned char covt;
+	unsigned char cuv;
+	unsigned char cutv;
+	unsigned char ot;
+	unsigned char ott;
+};
+
+/*
+  Raw register access for diagnostic tools with BQ_IOC_REGS. The
+  operations run in order as one SPI message between scans, each read
+  is CRC checked on its own and the results of all of them come back in
+  ops. The call fails with E2BIG when they do not fit in one message.
+  Writes need the device open for writing and cannot touch the address,
+  reset, test and EPROM programming registers. Group3 registers still
+  need SC_ENABLE written to SHDW_CTRL right before each write. Writing
+  one leaves verified in the driver's config attribute at -ESTALE until
+  BQ_IOC_SET_CONFIG writes the protection settings again.
+*/
+#define BQ_REG_OP_MAX		16	/* Registers in one read	*/
+#define BQ_REGS_MAX		64	/* Operations in one call	*/
+
+struct bq_reg_op {
+	unsigned char address;	/* Chip 1..n, 0x3F to write all of them	*/
+	unsigned char reg;
+	unsigned char count;	/* Registers to read from reg on, 0 writes */
+	unsigned char value;	/* What to write			*/
+	int status;		/* Set by the driver, 0 or -errno	*/
+	unsigned char data[BQ_REG_OP_MAX];	/* What was read	*/
+};
+
+struct bq_regs {
+	unsigned int count;
+	unsigned int reserved;
+	unsigned long long ops;	/* struct bq_reg_op *, as a number so
+				   the layout is the same for 32 and
+				   64 bit programs		*/
+};
+
+/*
+  Targeted query with BQ_IOC_QUERY. Starts a conversion on just the
+  chips in chips and reads just the cells in cells from each, with
+  temperatures and DEVICE_STATUS when flags asks for them. It does not
+  wait for the file lock readers use and goes ahead of the periodic
+  scan, at worst it waits for one conversion of the scan to finish.
+  Cells are by ADC input, VCELL1 is bit 0, and come back in microvolts,
+  everything not asked for is 0. latency_us is the time from the call
+  to the data being ready.
+*/
+#define BQ_QUERY_CHIPS		32
+#define BQ_QUERY_CELLS		6
+
+#define BQ_QUERY_TEMPERATURE	0x01	/* Fill in temperature		*/
+#define BQ_QUERY_STATUS		0x02	/* Fill in status		*/
+
+struct bq_query {
+	unsigned int chips;	/* Bit n-1 asks for chip n		*/
+	unsigned char cells;	/* Bit n-1 asks for VCELLn		*/
+	unsigned char flags;
+	unsigned short reserved;
+	unsigned int latency_us;
+	unsigned int cell_uv[BQ_QUERY_CHIPS][BQ_QUERY_CELLS];
+	signed char temperature[BQ_QUERY_CHIPS][2];	/* Celsius	*/
+	unsigned char status[BQ_QUERY_CHIPS];		/* DEVICE_STATUS */
+};
+
+/*
+  When the record last read on this file was taken, BQ_IOC_TIMING. seq
+  counts scans, the times are as in the netlink samples. Oversampled
+  records have the start of the first conversion and the end of the
+  last one.
+*/
+struct bq_timing {
+	unsigned int seq;
+	unsigned int skew_ns;
+	unsigned long long convert_ns;
+	unsigned long long drdy_ns;
+};
+
+#define BQ_IOC_MAGIC		'b'
+#define BQ_IOC_GET_CONFIG	_IOR(BQ_IOC_MAGIC, 1, struct bq_config)
+#define BQ_IOC_SET_CONFIG	_IOW(BQ_IOC_MAGIC, 2, struct bq_config)
+#define BQ_IOC_REGS		_IOWR(BQ_IOC_MAGIC, 3, struct bq_regs)
+#define BQ_IOC_QUERY		_IOWR(BQ_IOC_MAGIC, 4, struct bq_query)
+#define BQ_IOC_TIMING		_IOR(BQ_IOC_MAGIC, 5, struct bq_timing)
+
+#endif /* BQ76PL536_USER_H */
@@ -0,0 +1,676 @@
+/*
+  bq76pl536_capture.hpp
+
+  A compact file format for long captures of the pack and the code to
+  write and read it. Samples are stored in chunks and each chunk keeps
+  every value as its own column, so the history of one cell is read
+  without touching the others and a chunk outside a time range or a
+  value range is skipped without decoding anything.
+
+  Header only, C++11, uses bq76pl536_decode.hpp for the records.
+
+  All numbers are little endian. Everything starts on 8 bytes so the
+  file can be used through mmap as it is.
+
+  File header, 32 bytes
+    char magic[8]       "BQ76CAP1"
+    u32  header_size    32
+    u32  version        1
+    u32  cells
+    u32  chips
+    u32  chunk_samples  Samples in a full chunk
+    u32  unit_nv        Cell voltage unit, 78125 nV = 5.12 V / 2^16
+
+  Chunks follow the header back to back
+    u32  magic          "BQCK"
+    u32  samples
+    u32  columns        capture_columns(cells, chips)
+    u32  size           Of the whole chunk with padding
+    u64  first_ns       Time of the first sample, ns since the epoch
+    u64  last_ns        Time of the last sample
+    Directory, one entry per column
+      u32  offset       Of the column data from the start of the chunk
+      u32  length       In bytes
+      s64  min          Smallest value in the chunk
+      s64  max          Largest value
+    Column data, padded to 8
+
+  A column is a series of varints (LEB128). An even one, v, is a sample
+  that differs by zigzag decoded v/2 from the one before, the first
+  from 0. An odd one is v/2 samples the same as the one before, so the
+  status columns and a resting pack take next to nothing. Column 0 is
+  the time in ns, then each cell in unit_nv, then 7 columns per chip:
+  temperature 1 and 2 in degrees Celsius, status, fault, alert,
+  undervoltage and overvoltage as in a record.
+
+  A file that was closed has an index and a trailer after the last
+  chunk. A file that was not, because the recorder died, is read by
+  walking the chunks and loses at most the chunk that was being built.
+    Index, one entry per chunk
+      u64  offset       Of the chunk from the start of the file
+      u64  first_ns
+      u64  last_ns
+    Trailer, 32 bytes
+      u64  index_offset
+      u64  chunks
+      u64  reserved
+      char magic[8]     "BQ76IDX1"
+
+  Functions return 0 or a negative errno unless they say otherwise.
+*/
+#ifndef BQ76PL536_CAPTURE_HPP
+#define BQ76PL536_CAPTURE_HPP
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bq76pl536_decode.hpp"
+
+namespace bq {
+
+const char capture_magic[8] = { 'B', 'Q', '7', '6', 'C', 'A', 'P', '1' };
+const char capture_index_magic[8] = { 'B', 'Q', '7', '6', 'I', 'D', 'X', '1' };
+const uint32_t capture_chunk_magic = 'B' | 'Q' << 8 | 'C' << 16 | 'K' << 24;
+const uint32_t capture_version = 1;
+const uint32_t capture_unit_nv = 78125;
+
+const int capture_header_size = 32;
+const int capture_chunk_header_size = 32;
+const int capture_dir_entry_size = 24;
+const int capture_index_entry_size = 24;
+const int capture_trailer_size = 32;
+
+/* Columns of each chip after the cells */
+enum capture_chip_field {
+	field_temperature1,
+	field_temperature2,
+	field_status,
+	field_fault,
+	field_alert,
+	field_cuv,
+	field_cov,
+	chip_fields,
+};
+
+const int time_column = 0;
+
+inline int cell_column(int cell)
+{
+	return 1 + cell;
+}
+
+/* chip is 1..chips like everywhere else */
+inline int chip_column(int cells, int chip, capture_chip_field field)
+{
+	return 1 + cells + (chip - 1) * chip_fields + field;
+}
+
+inline int capture_columns(int cells, int chips)
+{
+	return 1 + cells + chips * chip_fields;
+}
+
+/* Cell voltage of a pack in unit_nv. Both record resolutions are exact */
+inline int64_t capture_cell(const pack &p, int cell)
+{
+	return (int64_t)p.cell_raw(cell) << (16 - p.bits);
+}
+
+inline void put_le32(uint8_t *p, uint32_t v)
+{
+	for (int i = 0; i < 4; i++)
+		p[i] = v >> (8 * i);
+}
+
+inline void put_le64(uint8_t *p, uint64_t v)
+{
+	for (int i = 0; i < 8; i++)
+		p[i] = v >> (8 * i);
+}
+
+inline uint32_t get_le32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+inline uint64_t get_le64(const uint8_t *p)
+{
+	return get_le32(p) | (uint64_t)get_le32(p + 4) << 32;
+}
+
+inline size_t put_varint(uint8_t *p, uint64_t v)
+{
+	size_t n = 0;
+
+	while (v >= 0x80)
+	{
+		p[n++] = v | 0x80;
+		v >>= 7;
+	}
+	p[n++] = v;
+	return n;
+}
+
+/* Returns the bytes used, 0 when the varint runs past end */
+inline size_t get_varint(const uint8_t *p, const uint8_t *end, uint64_t *v)
+{
+	size_t n = 0;
+	int shift = 0;
+
+	*v = 0;
+	while (p + n < end && shift < 64)
+	{
+		*v |= (uint64_t)(p[n] & 0x7F) << shift;
+		if (!(p[n++] & 0x80))
+			return n;
+		shift += 7;
+	}
+	return 0;
+}
+
+inline uint64_t zigzag(int64_t v)
+{
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+inline int64_t unzigzag(uint64_t v)
+{
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+/* Write everything or fail */
+inline int write_all(int fd, const uint8_t *p, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0)
+	{
+		n = write(fd, p, len);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+  Builds a capture. Samples are kept until a chunk is full and written
+  as one, close() writes the last chunk and the index.
+*/
+class capture_writer {
+public:
+	capture_writer() : fd_(-1), cells_(0), chips_(0), chunk_samples_(0),
+			   samples_(0), offset_(0) {}
+	~capture_writer() { close(); }
+
+	int open(const char *path, int cells, int chips,
+		 int chunk_samples = 4096)
+	{
+		uint8_t header[capture_header_size];
+		int status;
+
+		if (cells < 0 || cells > max_cells || chips < 0 ||
+		    chips > max_chips || chunk_samples < 1)
+			return -EINVAL;
+
+		fd_ = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd_ < 0)
+			return -errno;
+
+		cells_ = cells;
+		chips_ = chips;
+		chunk_samples_ = chunk_samples;
+		samples_ = 0;
+		values_.assign((size_t)capture_columns(cells, chips) *
+			       chunk_samples, 0);
+		index_.clear();
+
+		memset(header, 0, sizeof(header));
+		memcpy(header, capture_magic, 8);
+		put_le32(header + 8, capture_header_size);
+		put_le32(header + 12, capture_version);
+		put_le32(header + 16, cells);
+		put_le32(header + 20, chips);
+		put_le32(header + 24, chunk_samples);
+		put_le32(header + 28, capture_unit_nv);
+
+		status = write_all(fd_, header, sizeof(header));
+		offset_ = sizeof(header);
+		return status;
+	}
+
+	/* Add the pack as of time_ns. -EINVAL if the chain changed */
+	int add(uint64_t time_ns, const pack &p)
+	{
+		int64_t *v;
+		int i;
+
+		if (fd_ < 0)
+			return -EBADF;
+		if (!p.valid || p.cell_count != cells_ || p.chip_count != chips_)
+			return -EINVAL;
+
+		v = &values_[(size_t)samples_ * columns()];
+		v[time_column] = time_ns;
+		for (i = 0; i < cells_; i++)
+			v[cell_column(i)] = capture_cell(p, i);
+		for (i = 1; i < chips_ + 1; i++)
+		{
+			const chip_group &c = p.chip[i - 1];
+			int64_t *f = v + chip_column(cells_, i, field_temperature1);
+
+			f[field_temperature1] = c.temperature[0];
+			f[field_temperature2] = c.temperature[1];
+			f[field_status] = c.status;
+			f[field_fault] = c.fault;
+			f[field_alert] = c.alert;
+			f[field_cuv] = c.cuv;
+			f[field_cov] = c.cov;
+		}
+
+		if (++samples_ == chunk_samples_)
+			return flush();
+		return 0;
+	}
+
+	/* Write what there is as a chunk, a short one if need be */
+	int flush()
+	{
+		int cols = columns();
+		size_t dir = capture_chunk_header_size +
+			(size_t)cols * capture_dir_entry_size;
+		uint8_t *p;
+		size_t at;
+		int status;
+		int c;
+		int n;
+
+		if (fd_ < 0)
+			return -EBADF;
+		if (samples_ == 0)
+			return 0;
+
+		/* A varint of 64 bits is at most 10 bytes */
+		chunk_.assign(dir + (size_t)cols * samples_ * 10 + 8, 0);
+		p = &chunk_[0];
+		at = dir;
+
+		for (c = 0; c < cols; c++)
+		{
+			uint8_t *entry = p + capture_chunk_header_size +
+				c * capture_dir_entry_size;
+			int64_t prev = 0;
+			int64_t min = value(0, c);
+			int64_t max = min;
+			size_t start = at;
+			uint64_t run = 0;
+
+			for (n = 0; n < samples_; n++)
+			{
+				int64_t v = value(n, c);
+
+				if (n > 0 && v == prev)
+				{
+					run++;
+					continue;
+				}
+				if (run)
+					at += put_varint(p + at, run << 1 | 1);
+				run = 0;
+				at += put_varint(p + at, zigzag(v - prev) << 1);
+				prev = v;
+				if (v < min)
+					min = v;
+				if (v > max)
+					max = v;
+			}
+			if (run)
+				at += put_varint(p + at, run << 1 | 1);
+			put_le32(entry, start);
+			put_le32(entry + 4, at - start);
+			put_le64(entry + 8, min);
+			put_le64(entry + 16, max);
+		}
+		at = (at + 7) & ~(size_t)7;
+
+		put_le32(p, capture_chunk_magic);
+		put_le32(p + 4, samples_);
+		put_le32(p + 8, cols);
+		put_le32(p + 12, at);
+		put_le64(p + 16, value(0, time_column));
+		put_le64(p + 24, value(samples_ - 1, time_column));
+
+		status = write_all(fd_, p, at);
+		if (status)
+			return status;
+
+		index_.push_back(offset_);
+		index_.push_back(value(0, time_column));
+		index_.push_back(value(samples_ - 1, time_column));
+		offset_ += at;
+		samples_ = 0;
+		return 0;
+	}
+
+	/* Write the last chunk and the index. Safe to call twice */
+	int close()
+	{
+		uint8_t trailer[capture_trailer_size];
+		int status;
+
+		if (fd_ < 0)
+			return 0;
+
+		status = flush();
+		if (status == 0)
+		{
+			chunk_.assign(index_.size() * 8, 0);
+			for (size_t i = 0; i < index_.size(); i++)
+				put_le64(&chunk_[0] + 8 * i, index_[i]);
+			if (!chunk_.empty())
+				status = write_all(fd_, &chunk_[0],
+						   chunk_.size());
+		}
+		if (status == 0)
+		{
+			memset(trailer, 0, sizeof(trailer));
+			put_le64(trailer, offset_);
+			put_le64(trailer + 8, index_.size() / 3);
+			memcpy(trailer + 24, capture_index_magic, 8);
+			status = write_all(fd_, trailer, sizeof(trailer));
+		}
+
+		if (::close(fd_) < 0 && status == 0)
+			status = -errno;
+		fd_ = -1;
+		return status;
+	}
+
+	int columns() const { return capture_columns(cells_, chips_); }
+
+private:
+	int64_t value(int sample, int column) const
+	{
+		return values_[(size_t)sample * columns() + column];
+	}
+
+	int fd_;
+	int cells_;
+	int chips_;
+	int chunk_samples_;
+	int samples_;
+	uint64_t offset_;
+	std::vector<int64_t> values_;	/* Row per sample		*/
+	std::vector<uint8_t> chunk_;
+	std::vector<uint64_t> index_;	/* offset, first, last		*/
+};
+
+/* Where a chunk is and when it covers */
+struct capture_chunk {
+	uint64_t offset;
+	uint64_t first_ns;
+	uint64_t last_ns;
+};
+
+/*
+  Reads a capture through mmap. Only the chunk headers are looked at
+  when it is opened, columns are decoded when they are asked for.
+*/
+class capture_reader {
+public:
+	capture_reader() : map_(0), size_(0), cells_(0), chips_(0) {}
+	~capture_reader() { close(); }
+
+	int open(const char *path)
+	{
+		struct stat st;
+		int fd;
+
+		close();
+		fd = ::open(path, O_RDONLY);
+		if (fd < 0)
+			return -errno;
+		if (fstat(fd, &st) < 0)
+		{
+			::close(fd);
+			return -errno;
+		}
+		size_ = st.st_size;
+		if (size_ < (size_t)capture_header_size)
+		{
+			::close(fd);
+			return -EINVAL;
+		}
+		map_ = (const uint8_t *)mmap(0, size_, PROT_READ, MAP_SHARED,
+					     fd, 0);
+		::close(fd);
+		if (map_ == MAP_FAILED)
+		{
+			map_ = 0;
+			return -errno;
+		}
+
+		if (memcmp(map_, capture_magic, 8) != 0 ||
+		    get_le32(map_ + 12) != capture_version)
+		{
+			close();
+			return -EINVAL;
+		}
+		cells_ = get_le32(map_ + 16);
+		chips_ = get_le32(map_ + 20);
+		if (cells_ > max_cells || chips_ > max_chips)
+		{
+			close();
+			return -EINVAL;
+		}
+
+		if (!load_index())
+			walk_chunks(get_le32(map_ + 8));
+		return 0;
+	}
+
+	void close()
+	{
+		if (map_)
+			munmap((void *)map_, size_);
+		map_ = 0;
+		size_ = 0;
+		chunks_.clear();
+	}
+
+	int cells() const { return cells_; }
+	int chips() const { return chips_; }
+	int columns() const { return capture_columns(cells_, chips_); }
+	size_t chunks() const { return chunks_.size(); }
+	const capture_chunk &chunk(size_t i) const { return chunks_[i]; }
+
+	uint32_t chunk_samples(size_t i) const
+	{
+		return get_le32(map_ + chunks_[i].offset + 4);
+	}
+
+	/* Range of a column in a chunk from the directory, no decoding */
+	void column_range(size_t i, int column, int64_t *min,
+			  int64_t *max) const
+	{
+		const uint8_t *entry = dir_entry(i, column);
+
+		*min = get_le64(entry + 8);
+		*max = get_le64(entry + 16);
+	}
+
+	/*
+	  Decode one column of a chunk into values, which needs room for
+	  chunk_samples(i). Returns the samples decoded.
+	*/
+	int read_chunk(size_t i, int column, int64_t *values) const
+	{
+		const uint8_t *chunk = map_ + chunks_[i].offset;
+		const uint8_t *entry = dir_entry(i, column);
+		const uint8_t *p = chunk + get_le32(entry);
+		const uint8_t *end = p + get_le32(entry + 4);
+		uint32_t samples = get_le32(chunk + 4);
+		int64_t prev = 0;
+		uint64_t v;
+		size_t used;
+		uint32_t n;
+
+		if (end > chunk + get_le32(chunk + 12))
+			return -EINVAL;
+		for (n = 0; n < samples; )
+		{
+			used = get_varint(p, end, &v);
+			if (!used)
+				return -EINVAL;
+			p += used;
+			if (!(v & 1))
+			{
+				prev += unzigzag(v >> 1);
+				values[n++] = prev;
+				continue;
+			}
+			if (n == 0 || (v >> 1) > samples - n)
+				return -EINVAL;
+			for (v >>= 1; v > 0; v--)
+				values[n++] = prev;
+		}
+		return n;
+	}
+
+	/*
+	  The history of one column from from_ns to to_ns inclusive.
+	  Chunks outside the range are skipped by their header and only
+	  the time column and this one are decoded. Returns how many
+	  samples were stored, at most max.
+	*/
+	long read_column(int column, uint64_t from_ns, uint64_t to_ns,
+			 uint64_t *time_ns, int64_t *values, size_t max) const
+	{
+		std::vector<int64_t> times;
+		std::vector<int64_t> vals;
+		size_t stored = 0;
+		int n;
+		int i;
+
+		if (column < 0 || column >= columns())
+			return -EINVAL;
+
+		for (size_t c = 0; c < chunks_.size() && stored < max; c++)
+		{
+			if (chunks_[c].last_ns < from_ns ||
+			    chunks_[c].first_ns > to_ns)
+				continue;
+
+			times.resize(chunk_samples(c));
+			vals.resize(chunk_samples(c));
+			n = read_chunk(c, time_column, times.data());
+			if (n >= 0)
+				n = read_chunk(c, column, vals.data());
+			if (n < 0)
+				return n;
+
+			for (i = 0; i < n && stored < max; i++)
+			{
+				if ((uint64_t)times[i] < from_ns ||
+				    (uint64_t)times[i] > to_ns)
+					continue;
+				time_ns[stored] = times[i];
+				values[stored] = vals[i];
+				stored++;
+			}
+		}
+		return stored;
+	}
+
+private:
+	const uint8_t *dir_entry(size_t i, int column) const
+	{
+		return map_ + chunks_[i].offset + capture_chunk_header_size +
+			(size_t)column * capture_dir_entry_size;
+	}
+
+	/* A chunk header that fits in the file and matches the header */
+	bool chunk_ok(uint64_t offset) const
+	{
+		const uint8_t *p = map_ + offset;
+		uint32_t size;
+
+		if (offset + capture_chunk_header_size > size_ ||
+		    get_le32(p) != capture_chunk_magic ||
+		    get_le32(p + 8) != (uint32_t)columns())
+			return false;
+		size = get_le32(p + 12);
+		return size >= capture_chunk_header_size +
+			(uint64_t)columns() * capture_dir_entry_size &&
+			offset + size <= size_;
+	}
+
+	bool load_index()
+	{
+		const uint8_t *trailer = map_ + size_ - capture_trailer_size;
+		uint64_t offset;
+		uint64_t count;
+		capture_chunk c;
+
+		if (size_ < (size_t)capture_header_size + capture_trailer_size ||
+		    memcmp(trailer + 24, capture_index_magic, 8) != 0)
+			return false;
+		offset = get_le64(trailer);
+		count = get_le64(trailer + 8);
+		if (offset + count * capture_index_entry_size !=
+		    size_ - capture_trailer_size)
+			return false;
+
+		for (uint64_t i = 0; i < count; i++)
+		{
+			const uint8_t *p = map_ + offset +
+				i * capture_index_entry_size;
+
+			c.offset = get_le64(p);
+			c.first_ns = get_le64(p + 8);
+			c.last_ns = get_le64(p + 16);
+			if (!chunk_ok(c.offset))
+			{
+				chunks_.clear();
+				return false;
+			}
+			chunks_.push_back(c);
+		}
+		return true;
+	}
+
+	void walk_chunks(uint64_t offset)
+	{
+		capture_chunk c;
+
+		while (chunk_ok(offset))
+		{
+			c.offset = offset;
+			c.first_ns = get_le64(map_ + offset + 16);
+			c.last_ns = get_le64(map_ + offset + 24);
+			chunks_.push_back(c);
+			offset += get_le32(map_ + offset + 12);
+		}
+	}
+
+	const uint8_t *map_;
+	size_t size_;
+	int cells_;
+	int chips_;
+	std::vector<capture_chunk> chunks_;
+};
+
+} /* namespace bq */
+
+#endif /* BQ76PL536_CAPTURE_HPP */
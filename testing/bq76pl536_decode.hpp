@@ -0,0 +1,489 @@
+/*
+  bq76pl536_decode.hpp
+
+  Decoder for the records read from /dev/bq76pl536 and multicast as
+  BQ_NL_A_RECORD, for programs that read a lot of them. It does what
+  dumpbq.pl does without the per byte cost: the CRC is checked eight
+  bytes at a time, records are decoded where they lie in the caller's
+  buffer and whole packs are converted to millivolts with SSE2 or NEON
+  when the compiler has them. Nothing allocates.
+
+  Header only, C++11. See bq76pl536_drv.c for the record layouts.
+
+    bq::record r;
+    if (r.parse(buff, len) < 0)
+        ...
+    float mv[bq::max_cells];
+    r.cells_mv(mv);
+
+  Delta records only carry what changed, apply them to a bq::pack to
+  keep the whole pack:
+
+    bq::pack pack;
+    pack.apply(r);
+    pack.cells_mv(mv);
+
+  Functions return 0 or a negative errno like the driver unless they
+  say otherwise.
+*/
+#ifndef BQ76PL536_DECODE_HPP
+#define BQ76PL536_DECODE_HPP
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define BQ_DECODE_NEON 1
+#endif
+
+#include "bq76pl536_user.h"
+
+namespace bq {
+
+const int max_cells = 192;
+const int max_chips = 32;
+
+/* CRC-8, poly = x^8 + x^2 + x^1 + x^0, init = 0 */
+const uint8_t crc_poly = 0x07;
+
+/*
+  Slicing by 8. table[0] is the usual byte table, table[k][x] is the
+  CRC of x followed by k zero bytes. The CRC has no final xor so it is
+  linear and eight bytes fold into one lookup each.
+*/
+class crc8_tables {
+public:
+	uint8_t table[8][256];
+
+	crc8_tables()
+	{
+		for (int i = 0; i < 256; i++)
+		{
+			uint8_t crc = i;
+			for (int bit = 0; bit < 8; bit++)
+				crc = (crc & 0x80) ? (crc << 1) ^ crc_poly : crc << 1;
+			table[0][i] = crc;
+		}
+		for (int k = 1; k < 8; k++)
+			for (int i = 0; i < 256; i++)
+				table[k][i] = table[0][table[k-1][i]];
+	}
+
+	static const crc8_tables &get()
+	{
+		static const crc8_tables tables;
+		return tables;
+	}
+};
+
+/* One byte at a time, what dumpbq.pl and the driver do */
+inline uint8_t crc8_bytewise(const uint8_t *p, size_t len, uint8_t crc = 0)
+{
+	const uint8_t (&t)[256] = crc8_tables::get().table[0];
+
+	while (len-- > 0)
+		crc = t[crc ^ *p++];
+	return crc;
+}
+
+inline uint8_t crc8(const uint8_t *p, size_t len, uint8_t crc = 0)
+{
+	const crc8_tables &t = crc8_tables::get();
+
+	while (len >= 8)
+	{
+		crc = t.table[7][crc ^ p[0]] ^ t.table[6][p[1]] ^
+			t.table[5][p[2]] ^ t.table[4][p[3]] ^
+			t.table[3][p[4]] ^ t.table[2][p[5]] ^
+			t.table[1][p[6]] ^ t.table[0][p[7]];
+		p += 8;
+		len -= 8;
+	}
+	while (len-- > 0)
+		crc = t.table[0][crc ^ *p++];
+	return crc;
+}
+
+/* The 8 bytes of a chip group, in record order */
+struct chip_group {
+	uint8_t cells;
+	int8_t temperature[2];		/* Degrees Celsius		*/
+	uint8_t status;
+	uint8_t fault;
+	uint8_t alert;
+	uint8_t cuv;
+	uint8_t cov;
+};
+
+enum record_kind {
+	full,			/* 8 bit voltages, the original record	*/
+	delta,			/* BQ_RECORD_DELTA			*/
+	extended,		/* BQ_RECORD_EXTENDED			*/
+	extended_delta,		/* BQ_RECORD_EXTENDED_DELTA		*/
+};
+
+/*
+  Millivolts per count. 8 bit voltages are 20 mV, extended ones
+  5.12 volts / 2^bits.
+*/
+inline float mv_per_count(int bits)
+{
+	return bits == 8 ? 20.0f : 5120.0f / (1 << bits);
+}
+
+/* Big endian 16 bit voltage */
+inline uint16_t be16(const uint8_t *p)
+{
+	return p[0] << 8 | p[1];
+}
+
+/*
+  Convert count voltages of width bits, as they are in a record, to
+  millivolts. This is the hot loop, 16 or 8 voltages at a time.
+*/
+inline void convert_mv(const uint8_t *p, int count, int bits, float *mv)
+{
+	const float scale = mv_per_count(bits);
+	int i = 0;
+
+	if (bits == 8)
+	{
+#if defined(__SSE2__)
+		const __m128i zero = _mm_setzero_si128();
+		const __m128 s = _mm_set1_ps(scale);
+
+		for (; i + 16 <= count; i += 16)
+		{
+			__m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+			__m128i lo = _mm_unpacklo_epi8(v, zero);
+			__m128i hi = _mm_unpackhi_epi8(v, zero);
+
+			_mm_storeu_ps(mv + i, _mm_mul_ps(s,
+				_mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero))));
+			_mm_storeu_ps(mv + i + 4, _mm_mul_ps(s,
+				_mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero))));
+			_mm_storeu_ps(mv + i + 8, _mm_mul_ps(s,
+				_mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero))));
+			_mm_storeu_ps(mv + i + 12, _mm_mul_ps(s,
+				_mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero))));
+		}
+#elif defined(BQ_DECODE_NEON)
+		for (; i + 16 <= count; i += 16)
+		{
+			uint8x16_t v = vld1q_u8(p + i);
+			uint16x8_t lo = vmovl_u8(vget_low_u8(v));
+			uint16x8_t hi = vmovl_u8(vget_high_u8(v));
+
+			vst1q_f32(mv + i, vmulq_n_f32(vcvtq_f32_u32(
+				vmovl_u16(vget_low_u16(lo))), scale));
+			vst1q_f32(mv + i + 4, vmulq_n_f32(vcvtq_f32_u32(
+				vmovl_u16(vget_high_u16(lo))), scale));
+			vst1q_f32(mv + i + 8, vmulq_n_f32(vcvtq_f32_u32(
+				vmovl_u16(vget_low_u16(hi))), scale));
+			vst1q_f32(mv + i + 12, vmulq_n_f32(vcvtq_f32_u32(
+				vmovl_u16(vget_high_u16(hi))), scale));
+		}
+#endif
+		for (; i < count; i++)
+			mv[i] = p[i] * scale;
+		return;
+	}
+
+#if defined(__SSE2__)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		const __m128 s = _mm_set1_ps(scale);
+
+		for (; i + 8 <= count; i += 8)
+		{
+			__m128i v = _mm_loadu_si128((const __m128i *)(p + 2*i));
+
+			/* Swap to little endian */
+			v = _mm_or_si128(_mm_slli_epi16(v, 8),
+					 _mm_srli_epi16(v, 8));
+			_mm_storeu_ps(mv + i, _mm_mul_ps(s,
+				_mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero))));
+			_mm_storeu_ps(mv + i + 4, _mm_mul_ps(s,
+				_mm_cvtepi32_ps(_mm_unpackhi_epi16(v, zero))));
+		}
+	}
+#elif defined(BQ_DECODE_NEON)
+	for (; i + 8 <= count; i += 8)
+	{
+		uint16x8_t v = vreinterpretq_u16_u8(vrev16q_u8(
+			vld1q_u8(p + 2*i)));
+
+		vst1q_f32(mv + i, vmulq_n_f32(vcvtq_f32_u32(
+			vmovl_u16(vget_low_u16(v))), scale));
+		vst1q_f32(mv + i + 4, vmulq_n_f32(vcvtq_f32_u32(
+			vmovl_u16(vget_high_u16(v))), scale));
+	}
+#endif
+	for (; i < count; i++)
+		mv[i] = be16(p + 2*i) * scale;
+}
+
+/*
+  A record in the caller's buffer. parse() checks it and finds the
+  parts, the accessors read straight from the buffer so it has to stay
+  around as long as the record is used.
+*/
+class record {
+public:
+	record() : data_(0), length_(0), kind_(full), bits_(8),
+		   cells_(0), cell_data_(0), chips_(0), chip_data_(0) {}
+
+	/*
+	  Check the record at the start of p. Returns its length, so
+	  records read back to back can be walked, -EBADMSG for a bad CRC,
+	  -EINVAL when it does not make sense and -EAGAIN when len is too
+	  short to hold all of it.
+	*/
+	int parse(const uint8_t *p, size_t len)
+	{
+		size_t at = 0;
+		int cell_size;
+
+		data_ = p;
+		length_ = 0;
+
+		if (len < 1)
+			return -EAGAIN;
+
+		switch (p[0])
+		{
+		case BQ_RECORD_DELTA:
+			kind_ = delta;
+			bits_ = 8;
+			at = 1;
+			break;
+		case BQ_RECORD_EXTENDED:
+		case BQ_RECORD_EXTENDED_DELTA:
+			kind_ = p[0] == BQ_RECORD_EXTENDED ? extended :
+				extended_delta;
+			if (len < 2)
+				return -EAGAIN;
+			bits_ = p[1];
+			if (bits_ < 9 || bits_ > 16)
+				return -EINVAL;
+			at = 2;
+			break;
+		default:
+			kind_ = full;
+			bits_ = 8;
+			break;
+		}
+		cell_size = bits_ == 8 ? 1 : 2;
+
+		/* Deltas carry a cell number in front of each voltage and a
+		   chip number in place of the cell count
+		*/
+		if (at >= len)
+			return -EAGAIN;
+		cells_ = p[at++];
+		if (cells_ > max_cells)
+			return -EINVAL;
+		cell_data_ = p + at;
+		at += cells_ * (cell_size + is_delta());
+
+		if (at >= len)
+			return -EAGAIN;
+		chips_ = p[at++];
+		if (chips_ > max_chips)
+			return -EINVAL;
+		chip_data_ = p + at;
+		at += chips_ * sizeof(chip_group);
+
+		/* The CRC */
+		if (at >= len)
+			return -EAGAIN;
+		at++;
+
+		/* The CRC of everything including the CRC is 0 */
+		if (crc8(p, at) != 0)
+			return -EBADMSG;
+
+		length_ = at;
+		return at;
+	}
+
+	record_kind kind() const { return kind_; }
+	bool is_delta() const
+	{
+		return kind_ == delta || kind_ == extended_delta;
+	}
+	int bits() const { return bits_; }
+	size_t length() const { return length_; }
+	const uint8_t *data() const { return data_; }
+
+	/* Voltages in the record, for a delta the ones that changed */
+	int cells() const { return cells_; }
+
+	/* The voltages as they are in the record */
+	const uint8_t *cell_data() const { return cell_data_; }
+
+	/* Cell number of voltage i, 0..Voltage count-1 */
+	int cell_index(int i) const
+	{
+		return is_delta() ? cell_data_[i * cell_stride()] : i;
+	}
+
+	/* Voltage i in counts of bits() */
+	uint16_t cell_raw(int i) const
+	{
+		const uint8_t *p = cell_data_ + i * cell_stride() + is_delta();
+
+		return bits_ == 8 ? p[0] : be16(p);
+	}
+
+	/*
+	  All voltages of a full or extended record in millivolts. mv
+	  needs room for cells(). -EINVAL for a delta, use a pack.
+	*/
+	int cells_mv(float *mv) const
+	{
+		if (is_delta())
+			return -EINVAL;
+		convert_mv(cell_data_, cells_, bits_, mv);
+		return 0;
+	}
+
+	int chips() const { return chips_; }
+
+	/* Chip number of group i, 1..Chip count */
+	int chip_number(int i) const
+	{
+		return is_delta() ? chip_data_[i * sizeof(chip_group)] : i + 1;
+	}
+
+	/*
+	  Chip group i. A delta has the chip number where a full record
+	  has the cell count, cells is 0 then.
+	*/
+	chip_group chip(int i) const
+	{
+		chip_group c;
+
+		std::memcpy(&c, chip_data_ + i * sizeof(c), sizeof(c));
+		if (is_delta())
+			c.cells = 0;
+		return c;
+	}
+
+private:
+	int cell_stride() const
+	{
+		return (bits_ == 8 ? 1 : 2) + is_delta();
+	}
+
+	const uint8_t *data_;
+	size_t length_;
+	record_kind kind_;
+	int bits_;
+	int cells_;
+	const uint8_t *cell_data_;
+	int chips_;
+	const uint8_t *chip_data_;
+};
+
+/*
+  The whole pack as of the last record applied. A full record replaces
+  it, a delta updates it. Deltas before the first full record or with a
+  different resolution are refused with -ESTALE, wait for the next
+  keyframe.
+*/
+class pack {
+public:
+	pack() : valid(false), bits(8), cell_count(0), chip_count(0) {}
+
+	bool valid;
+	int bits;
+	int cell_count;
+	int chip_count;
+	/* Voltages stored as they are in a record, so 16 bit voltages
+	   stay big endian and convert_mv() works on them
+	*/
+	uint8_t raw[max_cells * 2];
+	chip_group chip[max_chips];
+
+	int apply(const record &r)
+	{
+		int size = r.bits() == 8 ? 1 : 2;
+		int i;
+		int n;
+
+		if (r.is_delta())
+		{
+			if (!valid || r.bits() != bits)
+				return -ESTALE;
+			for (i = 0; i < r.cells(); i++)
+			{
+				n = r.cell_index(i);
+				if (n >= cell_count)
+					return -EINVAL;
+				put(n, r.cell_raw(i));
+			}
+			for (i = 0; i < r.chips(); i++)
+			{
+				n = r.chip_number(i) - 1;
+				if (n < 0 || n >= chip_count)
+					return -EINVAL;
+				chip_group c = r.chip(i);
+				c.cells = chip[n].cells;
+				chip[n] = c;
+			}
+			return 0;
+		}
+
+		bits = r.bits();
+		cell_count = r.cells();
+		chip_count = r.chips();
+		std::memcpy(raw, r.cell_data(), cell_count * size);
+		for (i = 0; i < chip_count; i++)
+			chip[i] = r.chip(i);
+		valid = true;
+		return 0;
+	}
+
+	uint16_t cell_raw(int i) const
+	{
+		return bits == 8 ? raw[i] : be16(raw + 2*i);
+	}
+
+	/* mv needs room for cell_count */
+	void cells_mv(float *mv) const
+	{
+		convert_mv(raw, cell_count, bits, mv);
+	}
+
+	/* Both temperatures of every chip, chip_count * 2 values */
+	void temperatures_c(float *c) const
+	{
+		for (int i = 0; i < chip_count; i++)
+		{
+			c[2*i] = chip[i].temperature[0];
+			c[2*i + 1] = chip[i].temperature[1];
+		}
+	}
+
+private:
+	void put(int n, uint16_t val)
+	{
+		if (bits == 8)
+			raw[n] = val;
+		else
+		{
+			raw[2*n] = val >> 8;
+			raw[2*n + 1] = val;
+		}
+	}
+};
+
+} /* namespace bq */
+
+#endif /* BQ76PL536_DECODE_HPP */
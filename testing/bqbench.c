@@ -0,0 +1,600 @@
+/*
+  bqbench.c
+
+  Host benchmarks for the protocol core in bq76pl536_proto.c. The chain
+  is a callback that answers reads the way the chips do, so this runs
+  anywhere without a kernel.
+
+  ./bqbench [-n iterations]
+
+  For every chain size it prints the cost of building a scan, of
+  checking and decoding one, and of a full address search. It also
+  prints the CRC throughput. It exits with 1 if anything decodes wrong
+  or a scan or search takes more bus traffic than it should, so it can
+  run in CI.
+
+  Before the benchmarks it tests the protocol core over the same
+  chain: reads with bad CRCs that are retried, cell discovery and
+  ordering on a 4,4,4,3 chain and conversions that poll for DRDY or
+  time out. It also builds the largest records and scan of a 32 chip,
+  192 cell chain in buffers sized the way the driver sizes them.
+
+  Only bq_proto_* is the code the driver runs. The flows around it,
+  the conversion in convert_and_scan(), the cell discovery and the
+  budget constants, are copies of bq76pl536_drv.c and do not follow
+  changes to it. The driver itself only runs against real chips or
+  bq76pl536_sim.ko.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "bq76pl536_proto.h"
+#include "bq76pl536_user.h"
+
+#define MAX_CHIPS	32
+#define MAX_PACKETS	(10 + BQ_SCAN_PACKETS(MAX_CHIPS))
+#define BUFF_SIZE	(50 + BQ_SCAN_BYTES(MAX_CHIPS))
+#define CRC_BYTES	(1 << 20)
+
+/* As in bq76pl536_drv.c */
+#define DRDY_POLLS		7
+#define READ_RETRIES		1
+#define CELL_MISSING_THRESHOLD	1000
+#define SCAN_MESSAGES(polls)		(1 + (polls) + 1)
+#define SCAN_TRANSFERS(chips, polls)	\
+	(1 + (polls) + BQ_SCAN_PACKETS(chips))
+#define SCAN_BYTES(chips, polls)	\
+	(4 + (polls) * 5 + BQ_SCAN_BYTES(chips))
+
+/* Bytes of one chip in a scan counted from the register map: 3 header
+   bytes, DEVICE_STATUS..TEMPERATURE2 low byte and a CRC, then the
+   same around ALERT_STATUS..CUV_FAULT
+*/
+#define CHIP_SCAN_BYTES		((3 + 0x13 + 1) + (3 + 4 + 1))
+
+static u8 crc_table[256];
+
+/* The emulated chain */
+static int chain_chips;
+static int addressed;
+static const int *chain_cells;	/* Cells on chip n, NULL for all six */
+static int bad_crcs;		/* Corrupt the CRC of this many reads	*/
+static int drdy_reads;		/* Status reads before DRDY after a
+				   conversion starts			*/
+static int busy_reads;
+
+static u8 tx[BUFF_SIZE];
+static u8 rx[BUFF_SIZE];
+static struct bq_packet packet[MAX_PACKETS];
+
+static int failures;
+
+/* Bus traffic since the last clear_traffic() */
+static long messages;
+static long transfers;
+static long bytes;
+static long crc_errors;
+
+/* What chip n has in register reg */
+static u8 chip_reg(int chip, u8 reg)
+{
+	if (chain_cells && reg >= VCELL1 && reg < VCELL1 + 12 &&
+	    (reg - VCELL1) / 2 >= chain_cells[chip])
+		return 0;
+
+	switch (reg)
+	{
+	case DEVICE_STATUS:
+		if (busy_reads > 0)
+		{
+			busy_reads--;
+			return DS_ADDR_RQST;
+		}
+		return DS_ADDR_RQST | DRDY;
+	case ADDRESS_CONTROL:
+		return chip | AC_ADDR_RQST;
+	case ALERT_STATUS:
+		return 0;
+	case FAULT_STATUS:
+		return chip & 1 ? FS_COV : 0;
+	default:
+		/* Register pairs start on odd registers, make each differ */
+		return (reg & 1) ? chip + reg : 0x25;
+	}
+}
+
+static int chain_transfer(struct bq_proto *proto, int first, int count)
+{
+	struct bq_packet *p;
+	int address;
+	int i;
+	int j;
+
+	messages++;
+	for (i = first; i < first + count; i++)
+	{
+		p = &proto->packet[i];
+		transfers++;
+		bytes += p->len;
+		address = p->tx[0] >> 1;
+
+		if (p->tx[0] & 1)
+		{
+			if (address == BROADCAST && p->tx[1] == RESET)
+				addressed = 0;
+			else if (address == BROADCAST &&
+				 p->tx[1] == ADC_CONVERT)
+				busy_reads = drdy_reads;
+			else if (address == DISCOVERY_ADDR &&
+				 p->tx[1] == ADDRESS_CONTROL &&
+				 addressed < chain_chips)
+				addressed++;
+			continue;
+		}
+
+		if (address < 1 || address > addressed)
+		{
+			memset(p->rx, 0, p->len);
+			continue;
+		}
+		for (j = 0; j < p->tx[2]; j++)
+			p->rx[3+j] = chip_reg(address, p->tx[1] + j);
+		p->rx[p->len - 1] =
+			bq_crc8(crc_table, p->rx + 3, p->tx[2],
+				bq_crc8(crc_table, p->tx, 3, 0));
+		if (bad_crcs > 0)
+		{
+			bad_crcs--;
+			p->rx[p->len - 1] ^= 0xFF;
+		}
+	}
+	return 0;
+}
+
+/* Retries like the driver with read_retries at its default */
+static bool chain_crc_error(struct bq_proto *proto,
+			    const struct bq_packet *packet, u8 crc, int tries)
+{
+	crc_errors++;
+	return tries < READ_RETRIES;
+}
+
+static const struct bq_proto_ops chain_ops = {
+	.transfer = chain_transfer,
+};
+
+static const struct bq_proto_ops retry_ops = {
+	.transfer = chain_transfer,
+	.crc_error = chain_crc_error,
+};
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void clear_traffic(void)
+{
+	messages = 0;
+	transfers = 0;
+	bytes = 0;
+	crc_errors = 0;
+}
+
+static void check(int ok, const char *what, int chips)
+{
+	if (!ok)
+	{
+		fprintf(stderr, "FAIL %s with %d chips\n", what, chips);
+		failures++;
+	}
+}
+
+static void bench_chain(struct bq_proto *proto, int chips, long iterations)
+{
+	struct bq_chip_regs regs;
+	double start;
+	double build_ns;
+	double decode_ns;
+	double search_ns;
+	long n;
+	int first = 0;
+	int found = 0;
+	int i;
+
+	chain_chips = chips;
+
+	start = now_ns();
+	for (n = 0; n < iterations / 100 + 1; n++)
+		found = bq_proto_search(proto, chips);
+	search_ns = (now_ns() - start) / n;
+	check(found == chips, "search", chips);
+
+	/* Pass n resets the chain and writes and reads n addresses */
+	clear_traffic();
+	bq_proto_search(proto, chips);
+	check(messages <= (long)chips * (chips + 1) / 2, "search budget",
+	      chips);
+
+	start = now_ns();
+	for (n = 0; n < iterations; n++)
+	{
+		bq_proto_reset(proto);
+		first = bq_proto_queue_scan(proto, chips);
+	}
+	build_ns = (now_ns() - start) / iterations;
+	check(first == 0, "queue scan", chips);
+
+	/* One message with two block reads per chip, nothing else */
+	clear_traffic();
+	bq_proto_run(proto);
+	check(messages == 1 && transfers == 2 * chips &&
+	      bytes == chips * CHIP_SCAN_BYTES, "scan budget", chips);
+
+	start = now_ns();
+	for (n = 0; n < iterations; n++)
+		for (i = 1; i < chips + 1; i++)
+			if (bq_proto_decode_chip(proto, first, i, &regs))
+				failures++;
+	decode_ns = (now_ns() - start) / iterations;
+
+	for (i = 1; i < chips + 1; i++)
+	{
+		check(bq_proto_decode_chip(proto, first, i, &regs) == 0,
+		      "decode", chips);
+		check(regs.status == (DS_ADDR_RQST | DRDY) &&
+		      regs.cell[0] == ((i + VCELL1) << 8 | 0x25) &&
+		      regs.temperature[1] == ((i + TEMPERATURE2) << 8 | 0x25) &&
+		      regs.fault == (i & 1 ? FS_COV : 0),
+		      "decoded values", chips);
+	}
+
+	/* A bad CRC has to be caught */
+	proto->packet[first].rx[3] ^= 0x01;
+	check(bq_proto_decode_chip(proto, first, 1, &regs) == -EFAULT,
+	      "CRC rejection", chips);
+	proto->packet[first].rx[3] ^= 0x01;
+
+	printf("%5d %8d %8d %12.0f %12.0f %12.0f\n", chips,
+	       proto->packets, proto->bytes, build_ns, decode_ns, search_ns);
+}
+
+/* A read with a bad CRC is run again on its own, once */
+static void test_crc_retry(struct bq_proto *proto)
+{
+	struct bq_chip_regs regs;
+	int first;
+	int val;
+
+	chain_chips = 4;
+	check(bq_proto_search(proto, 4) == 4, "search", 4);
+
+	bad_crcs = 1;
+	clear_traffic();
+	val = bq_proto_read(proto, 2, DEVICE_STATUS, 1);
+	check(val == (DS_ADDR_RQST | DRDY) && crc_errors == 1 &&
+	      messages == 2 && transfers == 2, "CRC retry", 4);
+
+	bad_crcs = READ_RETRIES + 1;
+	clear_traffic();
+	val = bq_proto_read(proto, 2, DEVICE_STATUS, 1);
+	check(val == -EFAULT && crc_errors == READ_RETRIES + 1 &&
+	      transfers == READ_RETRIES + 1, "CRC retries used up", 4);
+
+	/* Only the read that failed goes out again */
+	bq_proto_reset(proto);
+	first = bq_proto_queue_scan(proto, 4);
+	bq_proto_run(proto);
+	proto->packet[first + 2].rx[3] ^= 0x01;
+	clear_traffic();
+	check(bq_proto_decode_chip(proto, first, 2, &regs) == 0 &&
+	      crc_errors == 1 && transfers == 1 &&
+	      bytes == 3 + 0x13 + 1 &&
+	      regs.cell[0] == ((2 + VCELL1) << 8 | 0x25),
+	      "scan CRC retry", 4);
+	bad_crcs = 0;
+}
+
+/*
+  Find the cells like the driver does at probe and check a scan puts
+  them in chip order, missing cells left out.
+*/
+static void test_cell_order(struct bq_proto *proto)
+{
+	static const int four_four_four_three[] = { 0, 4, 4, 4, 3 };
+	struct bq_chip_regs regs;
+	int chip[4 * 6];
+	int index[4 * 6];
+	int cell_count = 0;
+	int cell;
+	int first;
+	int raw;
+	int i;
+	int j;
+
+	chain_chips = 4;
+	chain_cells = four_four_four_three;
+	check(bq_proto_search(proto, 4) == 4, "search", 4);
+
+	for (i = 1; i < 4 + 1; i++)
+	{
+		for (j = VCELL1; j < VCELL1 + 12; j += 2)
+		{
+			if (bq_proto_read(proto, i, j, 2) <=
+			    CELL_MISSING_THRESHOLD)
+				continue;
+			chip[cell_count] = i;
+			index[cell_count++] = j;
+		}
+	}
+	check(cell_count == 15, "cell count 4,4,4,3", 4);
+
+	bq_proto_reset(proto);
+	first = bq_proto_queue_scan(proto, 4);
+	bq_proto_run(proto);
+
+	cell = 0;
+	for (i = 1; i < 4 + 1; i++)
+	{
+		check(bq_proto_decode_chip(proto, first, i, &regs) == 0,
+		      "decode 4,4,4,3", 4);
+		check(regs.cell[5] == 0 && (i < 4 || regs.cell[3] == 0),
+		      "missing cells 4,4,4,3", 4);
+		for (; cell < cell_count && chip[cell] == i; cell++)
+		{
+			raw = regs.cell[(index[cell] - VCELL1) / 2];
+			check(raw == ((i + index[cell]) << 8 | 0x25) &&
+			      index[cell] ==
+			      VCELL1 + 2 * (cell - 4 * (i - 1)),
+			      "cell order 4,4,4,3", 4);
+		}
+	}
+	check(cell == 15, "cells placed 4,4,4,3", 4);
+	chain_cells = NULL;
+}
+
+/*
+  A copy of what get_voltages() sends, kept in step by hand. Returns 0
+  or -EIO when DRDY did not come in DRDY_POLLS status reads.
+*/
+static int convert_and_scan(struct bq_proto *proto, int chips)
+{
+	struct bq_chip_regs regs;
+	int tries = 0;
+	int first;
+	int temp;
+	int i;
+
+	bq_proto_reset(proto);
+	bq_proto_write(proto, BROADCAST, ADC_CONVERT, AC_CONV);
+	bq_proto_run(proto);
+
+	do
+	{
+		bq_proto_reset(proto);
+		temp = bq_proto_read(proto, 1, DEVICE_STATUS, 1);
+		if (++tries >= DRDY_POLLS)
+			return -EIO;
+	} while ((temp & DRDY) == 0);
+
+	bq_proto_reset(proto);
+	first = bq_proto_queue_scan(proto, chips);
+	if (first < 0 || bq_proto_run(proto))
+		return -EIO;
+	for (i = 1; i < chips + 1; i++)
+		if (bq_proto_decode_chip(proto, first, i, &regs))
+			return -EIO;
+	return 0;
+}
+
+/* Conversions counted at the transfer op against the driver's budget */
+static void test_conversion(struct bq_proto *proto, int chips)
+{
+	chain_chips = chips;
+	check(bq_proto_search(proto, chips) == chips, "search", chips);
+
+	/* Ready on the third status read */
+	drdy_reads = 2;
+	clear_traffic();
+	check(convert_and_scan(proto, chips) == 0, "conversion", chips);
+	check(messages == 1 + 3 + 1 &&
+	      transfers == 1 + 3 + 2 * chips &&
+	      bytes == 4 + 3 * 5 + chips * CHIP_SCAN_BYTES,
+	      "conversion traffic", chips);
+
+	/* The budget follows the polls, nothing is left over to hide an
+	   extra message in
+	*/
+	check(messages == SCAN_MESSAGES(3) &&
+	      transfers == SCAN_TRANSFERS(chips, 3) &&
+	      bytes == SCAN_BYTES(chips, 3), "conversion budget", chips);
+
+	/* The slowest conversion that still counts */
+	drdy_reads = DRDY_POLLS - 2;
+	clear_traffic();
+	check(convert_and_scan(proto, chips) == 0, "slow conversion",
+	      chips);
+	check(messages == SCAN_MESSAGES(DRDY_POLLS - 1) &&
+	      transfers == SCAN_TRANSFERS(chips, DRDY_POLLS - 1) &&
+	      bytes == SCAN_BYTES(chips, DRDY_POLLS - 1),
+	      "slow conversion budget", chips);
+
+	/* No DRDY, no scan */
+	drdy_reads = DRDY_POLLS;
+	clear_traffic();
+	check(convert_and_scan(proto, chips) == -EIO, "DRDY timeout",
+	      chips);
+	check(messages == 1 + DRDY_POLLS &&
+	      transfers == 1 + DRDY_POLLS &&
+	      bytes == 4 + DRDY_POLLS * 5, "DRDY timeout traffic", chips);
+
+	drdy_reads = 0;
+	busy_reads = 0;
+}
+
+/*
+  A record laid out like the driver's encoders do it, every cell and
+  chip in it. Returns the length or -1 if it would not fit in size.
+*/
+static int build_record(u8 *p, int size, int cells, int chips, int bits,
+			bool delta)
+{
+	int len = 0;
+	u8 crc;
+	int i;
+	int j;
+
+#define PUT(b)	do { if (len >= size) return -1; p[len++] = (b); } while (0)
+	if (bits > 8)
+	{
+		PUT(delta ? BQ_RECORD_EXTENDED_DELTA : BQ_RECORD_EXTENDED);
+		PUT(bits);
+	}
+	else if (delta)
+		PUT(BQ_RECORD_DELTA);
+
+	PUT(cells);
+	for (i = 0; i < cells; i++)
+	{
+		if (delta)
+			PUT(i);
+		PUT(0x80 + i);
+		if (bits > 8)
+			PUT(i);
+	}
+
+	PUT(chips);
+	for (i = 1; i < chips + 1; i++)
+	{
+		/* Cell count in a full record, the chip in a delta */
+		PUT(delta ? i : cells / chips);
+		for (j = 0; j < 7; j++)
+			PUT(j);
+	}
+	crc = bq_crc8(crc_table, p, len, 0);
+	PUT(crc);
+#undef PUT
+
+	return len;
+}
+
+/* The longest chain the driver takes, 32 chips of 6 cells */
+static void test_largest_chain(void)
+{
+	static u8 record[BQ_RECORD_SIZE_MAX(32 * 6, 32)];
+	struct bq_chip_regs regs;
+	struct bq_proto proto;
+	int size = sizeof(record);
+	int first;
+	int i;
+
+	check(build_record(record, size, 192, 32, 8, false) ==
+	      1 + 192 + 1 + 32 * 8 + 1, "full record", 32);
+	check(build_record(record, size, 192, 32, 16, false) ==
+	      2 + 1 + 192 * 2 + 1 + 32 * 8 + 1, "extended record", 32);
+	check(build_record(record, size, 192, 32, 8, true) ==
+	      1 + 1 + 192 * 2 + 1 + 32 * 8 + 1, "delta record", 32);
+	check(build_record(record, size, 192, 32, 16, true) == size,
+	      "extended delta record", 32);
+	check(build_record(record, size - 1, 192, 32, 16, true) == -1,
+	      "record size", 32);
+	check(192 < BQ_RECORD_EXTENDED_DELTA, "cell count marker", 32);
+
+	/* A scan fits in BQ_SCAN_BYTES and BQ_SCAN_PACKETS exactly */
+	chain_chips = 32;
+	bq_proto_init(&proto, &chain_ops, crc_table, tx, rx,
+		      BQ_SCAN_BYTES(32), packet, BQ_SCAN_PACKETS(32));
+	check(bq_proto_search(&proto, 32) == 32, "search", 32);
+	bq_proto_reset(&proto);
+	first = bq_proto_queue_scan(&proto, 32);
+	check(first == 0 && proto.bytes == BQ_SCAN_BYTES(32) &&
+	      bq_proto_run(&proto) == 0, "scan buffers", 32);
+	for (i = 1; i < 32 + 1; i++)
+		check(bq_proto_decode_chip(&proto, first, i, &regs) == 0 &&
+		      regs.cell[5] == ((i + VCELL1 + 10) << 8 | 0x25),
+		      "decode", 32);
+
+	bq_proto_init(&proto, &chain_ops, crc_table, tx, rx,
+		      BQ_SCAN_BYTES(32) - 1, packet, BQ_SCAN_PACKETS(32));
+	check(bq_proto_queue_scan(&proto, 32) == -ENOSPC,
+	      "scan buffer too short", 32);
+	bq_proto_init(&proto, &chain_ops, crc_table, tx, rx,
+		      BQ_SCAN_BYTES(32), packet, BQ_SCAN_PACKETS(32) - 1);
+	check(bq_proto_queue_scan(&proto, 32) == -ENOSPC,
+	      "too few scan packets", 32);
+}
+
+static void bench_crc(long iterations)
+{
+	static u8 data[CRC_BYTES];
+	double start;
+	double ns;
+	long passes = iterations / 10000 + 1;
+	long n;
+	volatile u8 crc = 0;
+	int i;
+
+	for (i = 0; i < CRC_BYTES; i++)
+		data[i] = i * 31;
+
+	start = now_ns();
+	for (n = 0; n < passes; n++)
+		crc = bq_crc8(crc_table, data, CRC_BYTES, crc);
+	ns = now_ns() - start;
+
+	printf("CRC %.1f MB/s\n", (double)CRC_BYTES * passes / ns * 1e3);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bq_proto proto;
+	static const int sizes[] = { 1, 4, 8, 16, 32 };
+	long iterations = 100000;
+	int opt;
+	unsigned i;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			iterations = atol(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n iterations]\n", argv[0]);
+			return 2;
+		}
+	}
+	if (iterations < 1)
+		iterations = 1;
+
+	bq_crc8_populate(crc_table);
+
+	bq_proto_init(&proto, &retry_ops, crc_table, tx, rx, BUFF_SIZE,
+		      packet, MAX_PACKETS);
+	test_crc_retry(&proto);
+	test_cell_order(&proto);
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+		test_conversion(&proto, sizes[i]);
+	test_largest_chain();
+
+	bq_proto_init(&proto, &chain_ops, crc_table, tx, rx, BUFF_SIZE,
+		      packet, MAX_PACKETS);
+
+	printf("chips  packets    bytes  build ns/scan decode ns/scan search ns\n");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+		bench_chain(&proto, sizes[i], iterations);
+	bench_crc(iterations);
+
+	if (failures)
+	{
+		fprintf(stderr, "%d failures\n", failures);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,294 @@
+/*
+  bqdecode.cpp
+
+  Checks and benchmarks bq76pl536_decode.hpp.
+
+  ./bqdecode [-n iterations] [file]
+
+  file is a capture of the device, bqdevice by default. It has to decode
+  to the same values dumpbq.pl prints for it. Then records the size of a
+  full chain (32 chips, 192 cells) are built in every format, decoded
+  and compared with a plain byte at a time decoder, and the time for
+  each is printed. It exits with 1 if anything decodes wrong.
+*/
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <ctime>
+#include <unistd.h>
+#include "bq76pl536_decode.hpp"
+
+static int failures;
+
+static void check(bool ok, const char *what)
+{
+	if (!ok)
+	{
+		fprintf(stderr, "FAIL %s\n", what);
+		failures++;
+	}
+}
+
+static double now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Keep the compiler from dropping the work being timed */
+static volatile float sink;
+
+/* How dumpbq.pl reads a full record */
+static void dumpbq_decode(const uint8_t *p, size_t len, float *mv)
+{
+	int cells;
+	int i;
+
+	if (bq::crc8_bytewise(p, len) != 0)
+		return;
+	cells = *p++;
+	for (i = 0; i < cells; i++)
+		mv[i] = *p++ * 20.0f;
+}
+
+/* Build a record the way the driver does. Returns its length */
+static int build(uint8_t *p, bq::record_kind kind, int bits, int cells,
+		 int chips)
+{
+	uint8_t *save = p;
+	bool is_delta = kind == bq::delta || kind == bq::extended_delta;
+	int i;
+
+	if (kind == bq::delta)
+		*p++ = BQ_RECORD_DELTA;
+	else if (kind == bq::extended || kind == bq::extended_delta)
+	{
+		*p++ = kind == bq::extended ? BQ_RECORD_EXTENDED :
+			BQ_RECORD_EXTENDED_DELTA;
+		*p++ = bits;
+	}
+
+	*p++ = cells;
+	for (i = 0; i < cells; i++)
+	{
+		/* Deltas carry every other cell */
+		int n = is_delta ? 2*i + 1 : i;
+		uint16_t val = bits == 8 ? 150 + n % 7 :
+			(3300 + n) << (bits - 12);
+
+		if (is_delta)
+			*p++ = n;
+		if (bits > 8)
+			*p++ = val >> 8;
+		*p++ = val;
+	}
+
+	*p++ = chips;
+	for (i = 1; i < chips + 1; i++)
+	{
+		*p++ = is_delta ? i : 6;
+		*p++ = 20 + i % 3;
+		*p++ = -5;
+		*p++ = 0xA1;
+		*p++ = i & 1;
+		*p++ = 0x80;
+		*p++ = 0;
+		*p++ = i & 1 ? 0x04 : 0;
+	}
+
+	*p = bq::crc8_bytewise(save, p - save);
+	return p - save + 1;
+}
+
+static void test_fixture(const char *name)
+{
+	static uint8_t buff[4096];
+	bq::record r;
+	bq::chip_group c;
+	float mv[bq::max_cells];
+	FILE *f = fopen(name, "rb");
+	size_t len;
+
+	if (!f)
+	{
+		perror(name);
+		failures++;
+		return;
+	}
+	len = fread(buff, 1, sizeof(buff), f);
+	fclose(f);
+
+	check(r.parse(buff, len) == (int)len, "fixture parses");
+	check(r.kind() == bq::full && r.cells() == 18 && r.chips() == 3,
+	      "fixture layout");
+	check(r.cells_mv(mv) == 0, "fixture convert");
+	check(std::fabs(mv[0] - 2980.0f) < 0.01f &&
+	      std::fabs(mv[1] - 3000.0f) < 0.01f &&
+	      std::fabs(mv[17] - 2960.0f) < 0.01f, "fixture voltages");
+	c = r.chip(1);
+	check(c.cells == 6 && c.temperature[0] == 20 &&
+	      c.temperature[1] == 19 && c.status == 0xA1 &&
+	      c.alert == 0x80, "fixture chip 2");
+
+	buff[5] ^= 0x10;
+	check(r.parse(buff, len) == -EBADMSG, "fixture CRC rejection");
+	buff[5] ^= 0x10;
+	check(r.parse(buff, len - 1) == -EAGAIN, "fixture short read");
+}
+
+static void test_crc(long iterations)
+{
+	static uint8_t data[1 << 16];
+	double start;
+	double sliced;
+	double bytewise;
+	long passes = iterations / 1000 + 1;
+	long n;
+	size_t len;
+	uint8_t crc = 0;
+
+	for (size_t i = 0; i < sizeof(data); i++)
+		data[i] = i * 131 + (i >> 8);
+
+	for (len = 0; len < 64; len++)
+		check(bq::crc8(data + 3, len) ==
+		      bq::crc8_bytewise(data + 3, len), "sliced CRC");
+
+	start = now_ns();
+	for (n = 0; n < passes; n++)
+		crc ^= bq::crc8_bytewise(data, sizeof(data), crc);
+	bytewise = now_ns() - start;
+
+	start = now_ns();
+	for (n = 0; n < passes; n++)
+		crc ^= bq::crc8(data, sizeof(data), crc);
+	sliced = now_ns() - start;
+	sink = crc;
+
+	printf("CRC bytewise %.0f MB/s sliced %.0f MB/s\n",
+	       (double)sizeof(data) * passes / bytewise * 1e3,
+	       (double)sizeof(data) * passes / sliced * 1e3);
+}
+
+static void bench_kind(const char *name, bq::record_kind kind, int bits,
+		       long iterations)
+{
+	static uint8_t buff[2048];
+	static uint8_t full_buff[2048];
+	bq::record r;
+	bq::record full;
+	bq::pack pack;
+	float mv[bq::max_cells];
+	float ref[bq::max_cells];
+	bool is_delta = kind == bq::delta || kind == bq::extended_delta;
+	int cells = is_delta ? bq::max_cells / 2 : bq::max_cells;
+	int len = build(buff, kind, bits, cells, bq::max_chips);
+	double start;
+	double ns;
+	long n;
+	int i;
+
+	check(r.parse(buff, len) == len, name);
+
+	/* A delta needs the full record of the same resolution first */
+	if (is_delta)
+	{
+		int full_len = build(full_buff, bits == 8 ? bq::full :
+				     bq::extended, bits, bq::max_cells,
+				     bq::max_chips);
+
+		check(full.parse(full_buff, full_len) == full_len, name);
+		check(pack.apply(r) == -ESTALE, "delta before keyframe");
+		check(pack.apply(full) == 0, name);
+	}
+	check(pack.apply(r) == 0, name);
+	check(pack.cell_count == bq::max_cells &&
+	      pack.chip_count == bq::max_chips, name);
+
+	pack.cells_mv(mv);
+	for (i = 0; i < pack.cell_count; i++)
+		ref[i] = pack.cell_raw(i) * bq::mv_per_count(bits);
+	for (i = 0; i < pack.cell_count; i++)
+		check(mv[i] == ref[i], "SIMD conversion");
+	if (is_delta)
+		check(pack.cell_raw(1) == r.cell_raw(0) &&
+		      pack.chip[0].cells == 6 &&
+		      pack.chip[31].temperature[1] == -5, name);
+
+	start = now_ns();
+	for (n = 0; n < iterations; n++)
+	{
+		r.parse(buff, len);
+		pack.apply(r);
+		pack.cells_mv(mv);
+		sink = mv[n % bq::max_cells];
+	}
+	ns = (now_ns() - start) / iterations;
+
+	printf("%-15s %6d %12.0f %10.0f\n", name, len, ns, len / ns * 1e3);
+}
+
+static void bench_dumpbq(long iterations)
+{
+	static uint8_t buff[2048];
+	float mv[bq::max_cells];
+	int len = build(buff, bq::full, 8, bq::max_cells, bq::max_chips);
+	double start;
+	double ns;
+	long n;
+
+	start = now_ns();
+	for (n = 0; n < iterations; n++)
+	{
+		dumpbq_decode(buff, len, mv);
+		sink = mv[n % bq::max_cells];
+	}
+	ns = (now_ns() - start) / iterations;
+
+	printf("%-15s %6d %12.0f %10.0f\n", "bytewise", len, ns,
+	       len / ns * 1e3);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *fixture = "bqdevice";
+	long iterations = 100000;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			iterations = atol(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n iterations] [file]\n",
+				argv[0]);
+			return 2;
+		}
+	}
+	if (optind < argc)
+		fixture = argv[optind];
+	if (iterations < 1)
+		iterations = 1;
+
+	test_fixture(fixture);
+	test_crc(iterations);
+
+	printf("record           bytes   ns/record       MB/s\n");
+	bench_dumpbq(iterations);
+	bench_kind("full", bq::full, 8, iterations);
+	bench_kind("delta", bq::delta, 8, iterations);
+	bench_kind("extended", bq::extended, 12, iterations);
+	bench_kind("extended delta", bq::extended_delta, 16, iterations);
+
+	if (failures)
+	{
+		fprintf(stderr, "%d failures\n", failures);
+		return 1;
+	}
+	return 0;
+}
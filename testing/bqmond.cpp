@@ -0,0 +1,1094 @@
+/*
+  bqmond.cpp
+
+  Monitoring daemon. Reads the pack from the driver in one epoll loop
+  and hands every sample to sinks. Each sink runs on its own thread
+  behind a lock free single producer, single consumer ring, so a slow
+  sink drops its own samples and never holds up the device or the
+  other sinks. Programs that want the pack talk to the daemon instead
+  of each scanning the chain.
+
+  ./bqmond [-d device] [-p ms] [-q ring] [-s socket] [-m textfile]
+           [-M ms] [-o capture] [-c chunk samples]
+
+  The device is /dev/bq76pl536 by default. Without -p it is read when
+  poll says there is a new scan, which needs scan_interval_ms, with -p
+  it is read every that many milliseconds. A plain file of records is
+  read with -p and started over at its end, for trying out sinks.
+
+  -s  Unix stream socket. Clients get full records back to back, the
+      same bytes a read of the device returns without delta_mode, so
+      bq76pl536_decode.hpp reads the stream as it is. A client that
+      does not keep up loses records, never parts of one.
+  -m  Prometheus textfile collector file, written every -M ms, 1000 by
+      default. It has the pack and the daemon's own counters.
+  -o  Capture file, see bq76pl536_capture.hpp.
+
+  Every stage keeps its latency, count, total and worst: read from the
+  device being ready to the record decoded, queue from a sample being
+  put in a ring to its sink taking it, and the sink handling it. The
+  counters and the drops of each sink are in the textfile and printed
+  on SIGUSR1 and at exit.
+*/
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include "bq76pl536_capture.hpp"
+
+/* Longest full record, 16 bit voltages */
+static const int max_record = 2 + 1 + bq::max_cells * 2 + 1 +
+	bq::max_chips * 8 + 1;
+
+static_assert(sizeof(bq::chip_group) == 8, "chip group is 8 bytes");
+
+static uint64_t mono_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t real_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* The full record for a pack, as the driver would build it */
+static int encode_full(const bq::pack &p, uint8_t *buff)
+{
+	uint8_t *q = buff;
+	int size = p.bits == 8 ? 1 : 2;
+
+	if (p.bits != 8)
+	{
+		*q++ = BQ_RECORD_EXTENDED;
+		*q++ = p.bits;
+	}
+	*q++ = p.cell_count;
+	memcpy(q, p.raw, p.cell_count * size);
+	q += p.cell_count * size;
+	*q++ = p.chip_count;
+	memcpy(q, p.chip, p.chip_count * sizeof(bq::chip_group));
+	q += p.chip_count * sizeof(bq::chip_group);
+	*q = bq::crc8(buff, q - buff);
+	return q - buff + 1;
+}
+
+/*
+  Single producer, single consumer ring. The producer fills the slot
+  claim() gives it in place and publish()es it, the consumer looks at
+  front() and pop()s it when done. head and tail are on their own
+  cache lines so the two threads do not fight over them.
+*/
+template <typename T>
+class spsc_ring {
+public:
+	explicit spsc_ring(size_t size) : head_(0), tail_(0)
+	{
+		size_t n = 1;
+
+		while (n < size)
+			n <<= 1;
+		mask_ = n - 1;
+		slots_.resize(n);
+	}
+
+	/* Producer */
+	T *claim()
+	{
+		size_t head = head_.load(std::memory_order_relaxed);
+
+		if (head - tail_.load(std::memory_order_acquire) > mask_)
+			return 0;
+		return &slots_[head & mask_];
+	}
+
+	void publish()
+	{
+		head_.store(head_.load(std::memory_order_relaxed) + 1,
+			    std::memory_order_release);
+	}
+
+	/* Consumer */
+	const T *front()
+	{
+		size_t tail = tail_.load(std::memory_order_relaxed);
+
+		if (tail == head_.load(std::memory_order_acquire))
+			return 0;
+		return &slots_[tail & mask_];
+	}
+
+	void pop()
+	{
+		tail_.store(tail_.load(std::memory_order_relaxed) + 1,
+			    std::memory_order_release);
+	}
+
+	size_t size() const { return mask_ + 1; }
+
+private:
+	size_t mask_;
+	std::vector<T> slots_;
+	char pad0_[64];
+	std::atomic<size_t> head_;
+	char pad1_[64];
+	std::atomic<size_t> tail_;
+	char pad2_[64];
+};
+
+/* Latency of one stage, written by one thread and read by any */
+class stage_latency {
+public:
+	stage_latency() : count(0), total_ns(0), max_ns(0) {}
+
+	void add(uint64_t ns)
+	{
+		count.fetch_add(1, std::memory_order_relaxed);
+		total_ns.fetch_add(ns, std::memory_order_relaxed);
+		if (ns > max_ns.load(std::memory_order_relaxed))
+			max_ns.store(ns, std::memory_order_relaxed);
+	}
+
+	std::atomic<uint64_t> count;
+	std::atomic<uint64_t> total_ns;
+	std::atomic<uint64_t> max_ns;
+};
+
+struct sample {
+	uint64_t time_ns;	/* CLOCK_REALTIME when it was read	*/
+	uint64_t queued_ns;	/* CLOCK_MONOTONIC when it was queued	*/
+	uint64_t seq;
+	bq::pack pack;
+};
+
+/*
+  A sink gets every sample on its own thread. It can watch file
+  descriptors of its own, they come to event() on the same thread.
+*/
+class sink {
+public:
+	sink(const char *name, size_t ring) : drops(0), handled(0),
+		errors(0), name_(name), ring_(ring), efd_(-1), epfd_(-1),
+		stop_(false) {}
+	virtual ~sink() {}
+
+	const char *name() const { return name_; }
+
+	int start()
+	{
+		int status;
+
+		efd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		epfd_ = epoll_create1(EPOLL_CLOEXEC);
+		if (efd_ < 0 || epfd_ < 0)
+			return -errno;
+		status = watch(efd_, EPOLLIN);
+		if (status == 0)
+			status = open();
+		if (status)
+			return status;
+		thread_ = std::thread(&sink::run, this);
+		return 0;
+	}
+
+	void stop()
+	{
+		uint64_t one = 1;
+
+		stop_.store(true);
+		if (write(efd_, &one, sizeof(one)) < 0)
+			perror(name_);
+		if (thread_.joinable())
+			thread_.join();
+		close();
+		::close(epfd_);
+		::close(efd_);
+	}
+
+	/* Producer side, from the reading thread */
+	void push(const sample &s)
+	{
+		uint64_t one = 1;
+		sample *slot = ring_.claim();
+
+		if (!slot)
+		{
+			drops.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		*slot = s;
+		slot->queued_ns = mono_ns();
+		ring_.publish();
+		if (write(efd_, &one, sizeof(one)) < 0)
+			errors.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	stage_latency queue_latency;
+	stage_latency handle_latency;
+	std::atomic<uint64_t> drops;
+	std::atomic<uint64_t> handled;
+	std::atomic<uint64_t> errors;
+
+protected:
+	virtual int open() { return 0; }
+	virtual void close() {}
+	virtual void handle(const sample &s) = 0;
+	virtual void event(int fd, uint32_t events) { (void)fd; (void)events; }
+
+	int watch(int fd, uint32_t events)
+	{
+		struct epoll_event ev;
+
+		ev.events = events;
+		ev.data.fd = fd;
+		if (epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev) == 0)
+			return 0;
+		if (errno != EEXIST)
+			return -errno;
+		return epoll_ctl(epfd_, EPOLL_CTL_MOD, fd, &ev) ? -errno : 0;
+	}
+
+	void unwatch(int fd)
+	{
+		epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, 0);
+	}
+
+	const char *name_;
+
+private:
+	void run()
+	{
+		struct epoll_event ev[16];
+		const sample *s;
+		uint64_t value;
+		uint64_t now;
+		int n;
+		int i;
+
+		while (!stop_.load())
+		{
+			n = epoll_wait(epfd_, ev, 16, -1);
+			for (i = 0; i < n; i++)
+			{
+				if (ev[i].data.fd == efd_)
+				{
+					if (read(efd_, &value, sizeof(value)) < 0)
+						continue;
+				}
+				else
+					event(ev[i].data.fd, ev[i].events);
+			}
+
+			while ((s = ring_.front()) != 0)
+			{
+				now = mono_ns();
+				queue_latency.add(now - s->queued_ns);
+				handle(*s);
+				handle_latency.add(mono_ns() - now);
+				handled.fetch_add(1, std::memory_order_relaxed);
+				ring_.pop();
+			}
+		}
+	}
+
+	spsc_ring<sample> ring_;
+	int efd_;
+	int epfd_;
+	std::atomic<bool> stop_;
+	std::thread thread_;
+};
+
+/* Full records to every client of a Unix stream socket */
+class socket_sink : public sink {
+public:
+	socket_sink(const char *path, size_t ring) : sink("socket", ring),
+		path_(path), fd_(-1) {}
+
+protected:
+	int open()
+	{
+		struct sockaddr_un addr;
+
+		if (strlen(path_) >= sizeof(addr.sun_path))
+			return -ENAMETOOLONG;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strcpy(addr.sun_path, path_);
+
+		fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK |
+			     SOCK_CLOEXEC, 0);
+		if (fd_ < 0)
+			return -errno;
+		unlink(path_);
+		if (bind(fd_, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		    listen(fd_, 16) < 0)
+			return -errno;
+		return watch(fd_, EPOLLIN);
+	}
+
+	void close()
+	{
+		for (size_t i = 0; i < clients_.size(); i++)
+			::close(clients_[i].fd);
+		clients_.clear();
+		if (fd_ >= 0)
+		{
+			::close(fd_);
+			unlink(path_);
+		}
+		fd_ = -1;
+	}
+
+	void handle(const sample &s)
+	{
+		int len = encode_full(s.pack, record_);
+
+		for (size_t i = 0; i < clients_.size(); i++)
+		{
+			client &c = clients_[i];
+
+			/* Still sending the last one, this one is lost */
+			if (!c.pending.empty())
+			{
+				drops.fetch_add(1, std::memory_order_relaxed);
+				continue;
+			}
+			c.pending.assign(record_, record_ + len);
+			send_pending(c);
+		}
+		reap();
+	}
+
+	void event(int fd, uint32_t events)
+	{
+		if (fd == fd_)
+		{
+			accept_clients();
+			return;
+		}
+
+		for (size_t i = 0; i < clients_.size(); i++)
+		{
+			client &c = clients_[i];
+			char b[64];
+
+			if (c.fd != fd)
+				continue;
+			if (events & (EPOLLHUP | EPOLLERR | EPOLLRDHUP))
+				c.dead = true;
+			/* Clients have nothing to say, just see them go */
+			else if ((events & EPOLLIN) &&
+				 recv(fd, b, sizeof(b), MSG_DONTWAIT) == 0)
+				c.dead = true;
+			if (!c.dead && (events & EPOLLOUT))
+				send_pending(c);
+		}
+		reap();
+	}
+
+private:
+	struct client {
+		int fd;
+		bool dead;
+		std::vector<uint8_t> pending;
+	};
+
+	void accept_clients()
+	{
+		client c;
+
+		for (;;)
+		{
+			c.fd = accept4(fd_, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if (c.fd < 0)
+				break;
+			c.dead = false;
+			if (watch(c.fd, EPOLLIN | EPOLLRDHUP))
+			{
+				::close(c.fd);
+				continue;
+			}
+			clients_.push_back(c);
+		}
+	}
+
+	void send_pending(client &c)
+	{
+		ssize_t n;
+
+		n = send(c.fd, c.pending.data(), c.pending.size(),
+			 MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+		{
+			c.dead = true;
+			return;
+		}
+		if (n > 0)
+			c.pending.erase(c.pending.begin(),
+					c.pending.begin() + n);
+		/* Wait for room for the rest */
+		watch(c.fd, EPOLLIN | EPOLLRDHUP |
+		      (c.pending.empty() ? 0 : (uint32_t)EPOLLOUT));
+	}
+
+	void reap()
+	{
+		for (size_t i = 0; i < clients_.size(); )
+		{
+			if (!clients_[i].dead)
+			{
+				i++;
+				continue;
+			}
+			unwatch(clients_[i].fd);
+			::close(clients_[i].fd);
+			clients_.erase(clients_.begin() + i);
+		}
+	}
+
+	const char *path_;
+	int fd_;
+	std::vector<client> clients_;
+	uint8_t record_[max_record];
+};
+
+/* Every sample into a capture file */
+class capture_sink : public sink {
+public:
+	capture_sink(const char *path, int chunk, size_t ring) :
+		sink("capture", ring), path_(path), chunk_(chunk),
+		open_(false), failed_(false) {}
+
+protected:
+	void close()
+	{
+		int status = writer_.close();
+
+		if (status)
+			fprintf(stderr, "%s: %s\n", path_, strerror(-status));
+	}
+
+	void handle(const sample &s)
+	{
+		int status;
+
+		if (failed_)
+			return;
+		if (!open_)
+		{
+			status = writer_.open(path_, s.pack.cell_count,
+					      s.pack.chip_count, chunk_);
+			if (status)
+			{
+				fail(status);
+				return;
+			}
+			open_ = true;
+		}
+		status = writer_.add(s.time_ns, s.pack);
+		if (status)
+			fail(status);
+	}
+
+private:
+	void fail(int status)
+	{
+		fprintf(stderr, "%s: %s\n", path_, status == -EINVAL ?
+			"chain changed, stopped recording" :
+			strerror(-status));
+		errors.fetch_add(1, std::memory_order_relaxed);
+		failed_ = true;
+	}
+
+	const char *path_;
+	int chunk_;
+	bool open_;
+	bool failed_;
+	bq::capture_writer writer_;
+};
+
+/* What the textfile needs from the rest of the daemon */
+struct counters {
+	std::atomic<uint64_t> samples;
+	std::atomic<uint64_t> bad_records;
+	std::atomic<uint64_t> read_errors;
+	stage_latency read_latency;
+	std::vector<sink *> sinks;
+
+	counters() : samples(0), bad_records(0), read_errors(0) {}
+};
+
+static void print_latency(FILE *f, const char *stage, const char *sink,
+			  const stage_latency &l)
+{
+	char labels[64];
+
+	if (sink)
+		snprintf(labels, sizeof(labels), "stage=\"%s\",sink=\"%s\"",
+			 stage, sink);
+	else
+		snprintf(labels, sizeof(labels), "stage=\"%s\"", stage);
+
+	fprintf(f, "bqmond_latency_seconds_count{%s} %llu\n", labels,
+		(unsigned long long)l.count.load());
+	fprintf(f, "bqmond_latency_seconds_sum{%s} %.9f\n", labels,
+		l.total_ns.load() / 1e9);
+	fprintf(f, "bqmond_latency_max_seconds{%s} %.9f\n", labels,
+		l.max_ns.load() / 1e9);
+}
+
+/*
+  Prometheus textfile. The last sample is kept and written out with the
+  counters every interval, to a temporary file renamed over the real one
+  so the collector never sees half of it.
+*/
+class textfile_sink : public sink {
+public:
+	textfile_sink(const char *path, int interval_ms, const counters &c,
+		      size_t ring) : sink("textfile", ring), path_(path),
+		tmp_(std::string(path) + ".tmp"), interval_ms_(interval_ms),
+		counters_(c), tfd_(-1), have_(false) {}
+
+protected:
+	int open()
+	{
+		struct itimerspec its;
+
+		tfd_ = timerfd_create(CLOCK_MONOTONIC,
+				      TFD_NONBLOCK | TFD_CLOEXEC);
+		if (tfd_ < 0)
+			return -errno;
+		memset(&its, 0, sizeof(its));
+		its.it_interval.tv_sec = interval_ms_ / 1000;
+		its.it_interval.tv_nsec = (interval_ms_ % 1000) * 1000000L;
+		its.it_value = its.it_interval;
+		if (timerfd_settime(tfd_, 0, &its, 0) < 0)
+			return -errno;
+		return watch(tfd_, EPOLLIN);
+	}
+
+	void close()
+	{
+		if (tfd_ >= 0)
+			::close(tfd_);
+		tfd_ = -1;
+	}
+
+	void handle(const sample &s)
+	{
+		last_ = s;
+		have_ = true;
+	}
+
+	void event(int fd, uint32_t events)
+	{
+		uint64_t ticks;
+
+		(void)events;
+		if (fd != tfd_ || read(tfd_, &ticks, sizeof(ticks)) < 0)
+			return;
+		if (write_file())
+			errors.fetch_add(1, std::memory_order_relaxed);
+	}
+
+private:
+	int write_file()
+	{
+		FILE *f = fopen(tmp_.c_str(), "w");
+		int status;
+
+		if (!f)
+			return -errno;
+		if (have_)
+			write_pack(f);
+		write_counters(f);
+		status = ferror(f);
+		if (fclose(f) || status)
+			return -EIO;
+		return rename(tmp_.c_str(), path_) ? -errno : 0;
+	}
+
+	void write_pack(FILE *f)
+	{
+		const bq::pack &p = last_.pack;
+		float mv[bq::max_cells];
+		int i;
+
+		p.cells_mv(mv);
+		fprintf(f, "# TYPE bq_sample_timestamp_seconds gauge\n");
+		fprintf(f, "bq_sample_timestamp_seconds %.3f\n",
+			last_.time_ns / 1e9);
+		fprintf(f, "# TYPE bq_cell_volts gauge\n");
+		for (i = 0; i < p.cell_count; i++)
+			fprintf(f, "bq_cell_volts{cell=\"%d\"} %.4f\n", i,
+				mv[i] / 1000);
+		fprintf(f, "# TYPE bq_temperature_celsius gauge\n");
+		for (i = 0; i < p.chip_count; i++)
+		{
+			fprintf(f, "bq_temperature_celsius{chip=\"%d\","
+				"sensor=\"1\"} %d\n", i + 1,
+				p.chip[i].temperature[0]);
+			fprintf(f, "bq_temperature_celsius{chip=\"%d\","
+				"sensor=\"2\"} %d\n", i + 1,
+				p.chip[i].temperature[1]);
+		}
+		fprintf(f, "# TYPE bq_chip_status gauge\n");
+		for (i = 0; i < p.chip_count; i++)
+			fprintf(f, "bq_chip_status{chip=\"%d\"} %u\n", i + 1,
+				p.chip[i].status);
+		fprintf(f, "# TYPE bq_chip_fault gauge\n");
+		for (i = 0; i < p.chip_count; i++)
+			fprintf(f, "bq_chip_fault{chip=\"%d\"} %u\n", i + 1,
+				p.chip[i].fault);
+		fprintf(f, "# TYPE bq_chip_alert gauge\n");
+		for (i = 0; i < p.chip_count; i++)
+			fprintf(f, "bq_chip_alert{chip=\"%d\"} %u\n", i + 1,
+				p.chip[i].alert);
+	}
+
+	void write_counters(FILE *f)
+	{
+		const counters &c = counters_;
+		size_t i;
+
+		fprintf(f, "# TYPE bqmond_samples_total counter\n");
+		fprintf(f, "bqmond_samples_total %llu\n",
+			(unsigned long long)c.samples.load());
+		fprintf(f, "# TYPE bqmond_bad_records_total counter\n");
+		fprintf(f, "bqmond_bad_records_total %llu\n",
+			(unsigned long long)c.bad_records.load());
+		fprintf(f, "# TYPE bqmond_read_errors_total counter\n");
+		fprintf(f, "bqmond_read_errors_total %llu\n",
+			(unsigned long long)c.read_errors.load());
+		fprintf(f, "# TYPE bqmond_drops_total counter\n");
+		for (i = 0; i < c.sinks.size(); i++)
+			fprintf(f, "bqmond_drops_total{sink=\"%s\"} %llu\n",
+				c.sinks[i]->name(),
+				(unsigned long long)c.sinks[i]->drops.load());
+		fprintf(f, "# TYPE bqmond_handled_total counter\n");
+		for (i = 0; i < c.sinks.size(); i++)
+			fprintf(f, "bqmond_handled_total{sink=\"%s\"} %llu\n",
+				c.sinks[i]->name(),
+				(unsigned long long)c.sinks[i]->handled.load());
+		fprintf(f, "# TYPE bqmond_sink_errors_total counter\n");
+		for (i = 0; i < c.sinks.size(); i++)
+			fprintf(f, "bqmond_sink_errors_total{sink=\"%s\"} %llu\n",
+				c.sinks[i]->name(),
+				(unsigned long long)c.sinks[i]->errors.load());
+
+		fprintf(f, "# TYPE bqmond_latency_seconds summary\n");
+		print_latency(f, "read", 0, c.read_latency);
+		for (i = 0; i < c.sinks.size(); i++)
+		{
+			print_latency(f, "queue", c.sinks[i]->name(),
+				      c.sinks[i]->queue_latency);
+			print_latency(f, "sink", c.sinks[i]->name(),
+				      c.sinks[i]->handle_latency);
+		}
+	}
+
+	const char *path_;
+	std::string tmp_;
+	int interval_ms_;
+	const counters &counters_;
+	int tfd_;
+	bool have_;
+	sample last_;
+};
+
+static void print_stage(const char *name, const stage_latency &l)
+{
+	uint64_t n = l.count.load();
+
+	fprintf(stderr, "  %-18s %10llu %10.1f %10.1f us\n", name,
+		(unsigned long long)n, n ? l.total_ns.load() / 1e3 / n : 0.0,
+		l.max_ns.load() / 1e3);
+}
+
+static void print_counters(const counters &c)
+{
+	std::string name;
+
+	fprintf(stderr, "%llu samples, %llu bad records, %llu read errors\n",
+		(unsigned long long)c.samples.load(),
+		(unsigned long long)c.bad_records.load(),
+		(unsigned long long)c.read_errors.load());
+	fprintf(stderr, "  %-18s %10s %10s %10s\n", "stage", "count", "mean",
+		"max");
+	print_stage("read", c.read_latency);
+	for (size_t i = 0; i < c.sinks.size(); i++)
+	{
+		const sink *s = c.sinks[i];
+
+		name = std::string("queue ") + s->name();
+		print_stage(name.c_str(), s->queue_latency);
+		name = std::string("sink ") + s->name();
+		print_stage(name.c_str(), s->handle_latency);
+		fprintf(stderr, "  %-18s %10llu dropped %llu errors\n",
+			s->name(), (unsigned long long)s->drops.load(),
+			(unsigned long long)s->errors.load());
+	}
+}
+
+/* The device, or a file of records, and what has been read from it */
+class source {
+public:
+	source(const char *path, counters &c) : path_(path), counters_(c),
+		fd_(-1), is_device_(false), have_(0), buff_(4096) {}
+
+	~source()
+	{
+		if (fd_ >= 0)
+			close(fd_);
+	}
+
+	int open()
+	{
+		struct stat st;
+
+		fd_ = ::open(path_, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+		if (fd_ < 0 || fstat(fd_, &st) < 0)
+			return -errno;
+		is_device_ = S_ISCHR(st.st_mode);
+		have_ = 0;
+		return 0;
+	}
+
+	int fd() const { return fd_; }
+	bool is_device() const { return is_device_; }
+
+	/*
+	  Read the next sample and give it to the sinks. ready_ns is when
+	  the device was known to have something. Returns 1 when the
+	  device was opened again and has to be watched again.
+	*/
+	int read_samples(uint64_t ready_ns)
+	{
+		bool wrapped = false;
+		int reopened = 0;
+		ssize_t n;
+
+		for (;;)
+		{
+			if (next_record(ready_ns))
+				return reopened;
+
+			n = read(fd_, buff_.data() + have_, buff_.size() - have_);
+			if (n < 0)
+			{
+				if (errno != EAGAIN && errno != EINTR)
+					counters_.read_errors++;
+				return reopened;
+			}
+			if (n > 0)
+			{
+				have_ += n;
+				continue;
+			}
+
+			/* One record per open without delta_mode, a file
+			   starts over
+			*/
+			if (wrapped)
+				return reopened;
+			if (reopen() < 0)
+				return -errno;
+			wrapped = true;
+			reopened = is_device_;
+		}
+	}
+
+private:
+	int reopen()
+	{
+		if (!is_device_)
+			return lseek(fd_, 0, SEEK_SET) < 0 ? -1 : 0;
+		close(fd_);
+		fd_ = ::open(path_, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+		have_ = 0;
+		return fd_;
+	}
+
+	/* Apply the next record in the buffer, true when there was one */
+	bool next_record(uint64_t ready_ns)
+	{
+		bq::record r;
+		bool applied;
+		int len;
+
+		while (have_ > 0 &&
+		       (len = r.parse(buff_.data(), have_)) != -EAGAIN)
+		{
+			applied = false;
+			if (len < 0)
+			{
+				counters_.bad_records++;
+				len = 1;
+			}
+			else
+				applied = apply(r, ready_ns);
+			have_ -= len;
+			memmove(buff_.data(), buff_.data() + len, have_);
+			if (applied)
+				return true;
+		}
+		if (have_ == buff_.size())
+			have_ = 0;
+		return false;
+	}
+
+	bool apply(const bq::record &r, uint64_t ready_ns)
+	{
+		if (pack_.apply(r) != 0)
+			return false;
+
+		sample_.time_ns = real_ns();
+		sample_.seq = counters_.samples.load() + 1;
+		sample_.pack = pack_;
+		counters_.read_latency.add(mono_ns() - ready_ns);
+		counters_.samples++;
+		for (size_t i = 0; i < counters_.sinks.size(); i++)
+			counters_.sinks[i]->push(sample_);
+		return true;
+	}
+
+	const char *path_;
+	counters &counters_;
+	int fd_;
+	bool is_device_;
+	size_t have_;
+	std::vector<uint8_t> buff_;
+	bq::pack pack_;
+	sample sample_;
+};
+
+static int watch(int epfd, int fd)
+{
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static int run(source &src, counters &c, int period_ms)
+{
+	struct epoll_event ev[4];
+	struct signalfd_siginfo si;
+	struct itimerspec its;
+	sigset_t mask;
+	uint64_t ticks;
+	bool done = false;
+	int sfd;
+	int tfd = -1;
+	int epfd;
+	int status;
+	int n;
+	int i;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGUSR1);
+	sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (sfd < 0 || epfd < 0 || watch(epfd, sfd) < 0)
+	{
+		perror("bqmond");
+		return 1;
+	}
+
+	if (period_ms > 0)
+	{
+		tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+		memset(&its, 0, sizeof(its));
+		its.it_interval.tv_sec = period_ms / 1000;
+		its.it_interval.tv_nsec = (period_ms % 1000) * 1000000L;
+		its.it_value = its.it_interval;
+		if (tfd < 0 || timerfd_settime(tfd, 0, &its, 0) < 0 ||
+		    watch(epfd, tfd) < 0)
+		{
+			perror("timer");
+			return 1;
+		}
+	}
+	else if (!src.is_device() || watch(epfd, src.fd()) < 0)
+	{
+		fprintf(stderr, "can not poll, use -p\n");
+		return 1;
+	}
+
+	while (!done)
+	{
+		n = epoll_wait(epfd, ev, 4, -1);
+		if (n < 0 && errno != EINTR)
+		{
+			perror("epoll_wait");
+			break;
+		}
+		for (i = 0; i < n; i++)
+		{
+			if (ev[i].data.fd == sfd)
+			{
+				if (read(sfd, &si, sizeof(si)) != sizeof(si))
+					continue;
+				if (si.ssi_signo == SIGUSR1)
+					print_counters(c);
+				else
+					done = true;
+				continue;
+			}
+
+			if (ev[i].data.fd == tfd &&
+			    read(tfd, &ticks, sizeof(ticks)) < 0)
+				continue;
+
+			/* Closing the old fd took it out of the epoll set */
+			status = src.read_samples(mono_ns());
+			if (status < 0)
+			{
+				perror("reopen");
+				done = true;
+			}
+			else if (status > 0 && tfd < 0 &&
+				 watch(epfd, src.fd()) < 0)
+			{
+				perror("epoll_ctl");
+				done = true;
+			}
+		}
+	}
+
+	if (tfd >= 0)
+		close(tfd);
+	close(sfd);
+	close(epfd);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *device = "/dev/bq76pl536";
+	const char *socket_path = 0;
+	const char *textfile = 0;
+	const char *capture = 0;
+	int textfile_ms = 1000;
+	int period_ms = 0;
+	int chunk = 4096;
+	size_t ring = 256;
+	counters c;
+	sigset_t mask;
+	int status;
+	int opt;
+	size_t i;
+
+	while ((opt = getopt(argc, argv, "d:p:q:s:m:M:o:c:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'd':
+			device = optarg;
+			break;
+		case 'p':
+			period_ms = atoi(optarg);
+			break;
+		case 'q':
+			ring = atoi(optarg);
+			break;
+		case 's':
+			socket_path = optarg;
+			break;
+		case 'm':
+			textfile = optarg;
+			break;
+		case 'M':
+			textfile_ms = atoi(optarg);
+			break;
+		case 'o':
+			capture = optarg;
+			break;
+		case 'c':
+			chunk = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-d device] [-p ms] [-q ring] "
+				"[-s socket] [-m textfile] [-M ms]\n"
+				"       [-o capture] [-c chunk]\n", argv[0]);
+			return 2;
+		}
+	}
+	if (ring < 2 || textfile_ms < 1)
+	{
+		fprintf(stderr, "bad ring size or textfile interval\n");
+		return 2;
+	}
+
+	/* Signals come through the signalfd, the sink threads inherit
+	   the mask
+	*/
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &mask, 0);
+	signal(SIGPIPE, SIG_IGN);
+
+	if (socket_path)
+		c.sinks.push_back(new socket_sink(socket_path, ring));
+	if (textfile)
+		c.sinks.push_back(new textfile_sink(textfile, textfile_ms, c,
+						    ring));
+	if (capture)
+		c.sinks.push_back(new capture_sink(capture, chunk, ring));
+
+	source src(device, c);
+	status = src.open();
+	if (status)
+	{
+		fprintf(stderr, "%s: %s\n", device, strerror(-status));
+		return 1;
+	}
+
+	for (i = 0; i < c.sinks.size(); i++)
+	{
+		status = c.sinks[i]->start();
+		if (status)
+		{
+			fprintf(stderr, "%s: %s\n", c.sinks[i]->name(),
+				strerror(-status));
+			/* The ones before are running */
+			while (i-- > 0)
+				c.sinks[i]->stop();
+			return 1;
+		}
+	}
+
+	status = run(src, c, period_ms);
+
+	for (i = 0; i < c.sinks.size(); i++)
+		c.sinks[i]->stop();
+	print_counters(c);
+	for (i = 0; i < c.sinks.size(); i++)
+		delete c.sinks[i];
+
+	return status;
+}
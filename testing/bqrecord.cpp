@@ -0,0 +1,304 @@
+/*
+  bqrecord.cpp
+
+  Records the pack into a capture file, see bq76pl536_capture.hpp, and
+  reads one back.
+
+  ./bqrecord [-o capture] [-c chunk samples] [-p ms] [-n samples] [input]
+
+  input is /dev/bq76pl536 by default. A device is opened again after
+  each full record so it works with and without delta_mode, a plain
+  file of records read back to back is recorded until its end. -p waits
+  that long between reads, use it when the driver scans on its own.
+  Stop it with ^C, the capture is closed properly.
+
+  ./bqrecord -r capture [-C cell] [-f from] [-t to]
+
+  Prints the history of one cell, all cells without -C, from and to
+  are seconds since the epoch. Without -C it also prints the range of
+  every cell in each chunk, which comes from the chunk directories and
+  costs no decoding.
+*/
+#include <cstdio>
+#include <cstdlib>
+#include <csignal>
+#include <ctime>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "bq76pl536_capture.hpp"
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static double cell_mv(int64_t v)
+{
+	return v * (bq::capture_unit_nv / 1e6);
+}
+
+/*
+  Read the next record into buff and apply it. Returns 1 for a record,
+  0 at the end of a plain file and a negative errno on errors.
+*/
+static int next_record(const char *input, int *fd, bool is_device,
+		       std::vector<uint8_t> &buff, size_t *have,
+		       bq::pack &pack)
+{
+	bq::record r;
+	ssize_t n;
+	int len;
+
+	for (;;)
+	{
+		len = r.parse(buff.data(), *have);
+		if (len > 0)
+		{
+			int status = pack.apply(r);
+
+			*have -= len;
+			memmove(buff.data(), buff.data() + len, *have);
+			if (status == -ESTALE)
+				continue;
+			return status < 0 ? status : 1;
+		}
+		if (len != -EAGAIN)
+		{
+			fprintf(stderr, "%s: bad record (%d)\n", input, len);
+			/* Find the next one */
+			*have -= 1;
+			memmove(buff.data(), buff.data() + 1, *have);
+			continue;
+		}
+
+		if (*have == buff.size())
+			return -EMSGSIZE;
+		n = read(*fd, buff.data() + *have, buff.size() - *have);
+		if (n < 0)
+			return -errno;
+		if (n > 0)
+		{
+			*have += n;
+			continue;
+		}
+		if (!is_device)
+			return 0;
+
+		/* One record per open without delta_mode */
+		close(*fd);
+		*fd = open(input, O_RDONLY);
+		if (*fd < 0)
+			return -errno;
+		*have = 0;
+	}
+}
+
+static int record(const char *input, const char *output, int chunk,
+		  int period_ms, long limit)
+{
+	std::vector<uint8_t> buff(4096);
+	bq::capture_writer writer;
+	bq::pack pack;
+	struct stat st;
+	struct sigaction sa;
+	size_t have = 0;
+	long samples = 0;
+	bool is_device;
+	int status;
+	int fd;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, 0);
+	sigaction(SIGTERM, &sa, 0);
+
+	fd = open(input, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0)
+	{
+		perror(input);
+		return 1;
+	}
+	is_device = S_ISCHR(st.st_mode);
+
+	while (!stop && (limit == 0 || samples < limit))
+	{
+		status = next_record(input, &fd, is_device, buff, &have, pack);
+		if (status <= 0)
+		{
+			if (status < 0 && !(status == -EINTR && stop))
+				fprintf(stderr, "%s: %s\n", input,
+					strerror(-status));
+			break;
+		}
+
+		if (samples == 0)
+		{
+			status = writer.open(output, pack.cell_count,
+					     pack.chip_count, chunk);
+			if (status)
+			{
+				fprintf(stderr, "%s: %s\n", output,
+					strerror(-status));
+				close(fd);
+				return 1;
+			}
+		}
+		status = writer.add(now_ns(), pack);
+		if (status)
+		{
+			fprintf(stderr, "%s: %s\n", output,
+				status == -EINVAL ? "chain changed" :
+				strerror(-status));
+			break;
+		}
+		samples++;
+
+		if (period_ms > 0)
+			usleep(period_ms * 1000);
+	}
+
+	if (fd >= 0)
+		close(fd);
+	status = writer.close();
+	if (status)
+	{
+		fprintf(stderr, "%s: %s\n", output, strerror(-status));
+		return 1;
+	}
+	fprintf(stderr, "%ld samples\n", samples);
+	return 0;
+}
+
+static void print_ranges(const bq::capture_reader &reader)
+{
+	int64_t min;
+	int64_t max;
+
+	for (size_t c = 0; c < reader.chunks(); c++)
+	{
+		printf("chunk %zu: %u samples %.3f..%.3f\n", c,
+		       reader.chunk_samples(c), reader.chunk(c).first_ns / 1e9,
+		       reader.chunk(c).last_ns / 1e9);
+		for (int i = 0; i < reader.cells(); i++)
+		{
+			reader.column_range(c, bq::cell_column(i), &min, &max);
+			printf("  cell %3d %7.1f..%7.1f mV\n", i,
+			       cell_mv(min), cell_mv(max));
+		}
+	}
+}
+
+static int replay(const char *input, int cell, double from, double to)
+{
+	bq::capture_reader reader;
+	std::vector<uint64_t> times;
+	std::vector<int64_t> values;
+	uint64_t from_ns = from * 1e9;
+	uint64_t to_ns = to < 0 ? UINT64_MAX : (uint64_t)(to * 1e9);
+	size_t samples = 0;
+	long n;
+	int status;
+
+	status = reader.open(input);
+	if (status)
+	{
+		fprintf(stderr, "%s: %s\n", input, strerror(-status));
+		return 1;
+	}
+	if (cell >= reader.cells())
+	{
+		fprintf(stderr, "%s has %d cells\n", input, reader.cells());
+		return 1;
+	}
+	if (cell < 0)
+	{
+		print_ranges(reader);
+		return 0;
+	}
+
+	for (size_t c = 0; c < reader.chunks(); c++)
+		samples += reader.chunk_samples(c);
+	times.resize(samples);
+	values.resize(samples);
+
+	n = reader.read_column(bq::cell_column(cell), from_ns, to_ns,
+			       times.data(), values.data(), samples);
+	if (n < 0)
+	{
+		fprintf(stderr, "%s: %s\n", input, strerror(-n));
+		return 1;
+	}
+	for (long i = 0; i < n; i++)
+		printf("%.6f %.1f\n", times[i] / 1e9, cell_mv(values[i]));
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *input = "/dev/bq76pl536";
+	const char *output = "capture.bqc";
+	const char *capture = 0;
+	int chunk = 4096;
+	int period_ms = 0;
+	long limit = 0;
+	int cell = -1;
+	double from = 0;
+	double to = -1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "o:c:p:n:r:C:f:t:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'o':
+			output = optarg;
+			break;
+		case 'c':
+			chunk = atoi(optarg);
+			break;
+		case 'p':
+			period_ms = atoi(optarg);
+			break;
+		case 'n':
+			limit = atol(optarg);
+			break;
+		case 'r':
+			capture = optarg;
+			break;
+		case 'C':
+			cell = atoi(optarg);
+			break;
+		case 'f':
+			from = atof(optarg);
+			break;
+		case 't':
+			to = atof(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-o capture] [-c chunk] "
+				"[-p ms] [-n samples] [input]\n"
+				"       %s -r capture [-C cell] [-f from] "
+				"[-t to]\n", argv[0], argv[0]);
+			return 2;
+		}
+	}
+
+	if (capture)
+		return replay(capture, cell, from, to);
+	if (optind < argc)
+		input = argv[optind];
+	return record(input, output, chunk, period_ms, limit);
+}
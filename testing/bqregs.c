@@ -0,0 +1,139 @@
+/*
+  bqregs.c
+
+  Reads and writes chip registers through the BQ_IOC_REGS ioctl while
+  the driver keeps running, for service and bring up work.
+
+  ./bqregs [-d device] op...
+
+  r:chip:reg[:count]	read count registers from reg on, 1 by default
+  w:chip:reg:value	write a register, chip 63 writes all of them
+
+  Numbers are C style, 0x10 is hex. All operations go out as one SPI
+  message in the order given. Writes need write access to the device.
+
+  ./bqregs r:1:0x48:4 r:2:0x48:4	USER1-USER4 of chips 1 and 2
+  ./bqregs w:1:0x33:0x0A		CB_TIME of chip 1 to 10 seconds
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "bq76pl536_user.h"
+
+static int parse_op(const char *arg, struct bq_reg_op *op)
+{
+	unsigned long v[3];
+	const char *p = arg + 2;
+	char *end;
+	int n;
+
+	if ((arg[0] != 'r' && arg[0] != 'w') || arg[1] != ':')
+		return -1;
+
+	for (n = 0; n < 3 && *p; n++)
+	{
+		v[n] = strtoul(p, &end, 0);
+		if (end == p || v[n] > 0xFF || (*end && *end != ':'))
+			return -1;
+		p = *end ? end + 1 : end;
+	}
+
+	memset(op, 0, sizeof(*op));
+	if (n < 2)
+		return -1;
+	op->address = v[0];
+	op->reg = v[1];
+	if (arg[0] == 'r')
+	{
+		op->count = n == 3 ? v[2] : 1;
+		return op->count == 0 ? -1 : 0;
+	}
+	if (n != 3)
+		return -1;
+	op->value = v[2];
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *device = "/dev/bq76pl536";
+	struct bq_reg_op ops[BQ_REGS_MAX];
+	struct bq_regs regs;
+	int writes = 0;
+	int status = 0;
+	int opt;
+	int fd;
+	int i;
+	int j;
+
+	while ((opt = getopt(argc, argv, "d:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'd':
+			device = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-d device] "
+				"r:chip:reg[:count] | w:chip:reg:value...\n",
+				argv[0]);
+			return 2;
+		}
+	}
+
+	memset(&regs, 0, sizeof(regs));
+	for (i = optind; i < argc; i++)
+	{
+		if (regs.count == BQ_REGS_MAX)
+		{
+			fprintf(stderr, "at most %d operations\n", BQ_REGS_MAX);
+			return 2;
+		}
+		if (parse_op(argv[i], &ops[regs.count]))
+		{
+			fprintf(stderr, "bad operation %s\n", argv[i]);
+			return 2;
+		}
+		if (ops[regs.count].count == 0)
+			writes++;
+		regs.count++;
+	}
+	if (regs.count == 0)
+		return 0;
+	regs.ops = (unsigned long)ops;
+
+	fd = open(device, writes ? O_RDWR : O_RDONLY);
+	if (fd < 0)
+	{
+		perror(device);
+		return 1;
+	}
+	if (ioctl(fd, BQ_IOC_REGS, &regs) < 0)
+	{
+		perror("BQ_IOC_REGS");
+		close(fd);
+		return 1;
+	}
+	close(fd);
+
+	for (i = 0; i < (int)regs.count; i++)
+	{
+		if (ops[i].count == 0)
+			continue;
+		printf("%2d %02x:", ops[i].address, ops[i].reg);
+		if (ops[i].status)
+		{
+			printf(" %s\n", strerror(-ops[i].status));
+			status = 1;
+			continue;
+		}
+		for (j = 0; j < ops[i].count; j++)
+			printf(" %02x", ops[i].data[j]);
+		printf("\n");
+	}
+	return status;
+}